@@ -21,70 +21,171 @@
 #include "AntStick.h"
 #include "Tools.h"
 #include <assert.h>
+#include <algorithm>
 
 #include "winsock2.h" // for struct timeval
 
-bool IsGoodChecksum(const Buffer &message)
+// ..................................................... AntMessageRing ....
+
+AntMessageRing::AntMessageRing()
+    : m_Read(0),
+    m_Write(0),
+    m_FirstArrival(0),
+    m_ArrivalCount(0)
+{
+    // empty
+}
+
+void AntMessageRing::Append(const uint8_t *data, unsigned size, uint64_t arrival)
+{
+    assert(size <= Free());
+
+    unsigned pos = m_Write & (CAPACITY - 1);
+    unsigned first = (std::min)(size, CAPACITY - pos);
+    std::copy(data, data + first, &m_Data[pos]);
+    std::copy(data + first, data + size, &m_Data[0]);
+    m_Write += size;
+
+    if (size == 0)
+        return;
+    if (m_ArrivalCount == MAX_ARRIVALS) {
+        Arrival &last = m_Arrivals[(m_FirstArrival + m_ArrivalCount - 1) % MAX_ARRIVALS];
+        last.End = m_Write;
+        last.Time = arrival;
+        return;
+    }
+    Arrival &a = m_Arrivals[(m_FirstArrival + m_ArrivalCount) % MAX_ARRIVALS];
+    a.End = m_Write;
+    a.Time = arrival;
+    m_ArrivalCount++;
+}
+
+/** Copy the first complete message from the ring into `message'.  Bytes
+    * preceding the sync byte are discarded.  When the checksum does not match,
+    * only the sync byte is dropped, so a real message starting inside the bad
+    * one can still be found on the next call.
+    */
+AntMessageRing::FrameStatus AntMessageRing::ExtractMessage(Buffer &message, uint64_t &arrival)
 {
+    // Look for the sync byte which starts a message
+    while (Size() > 0 && At(0) != SYNC_BYTE)
+        m_Read++;
+
+    // An ANT message has the following sequence: SYNC, LEN, MSGID, DATA,
+    // CHECKSUM.  An empty message has at least 4 bytes in it.
+    if (Size() < 4)
+        return FRAME_INCOMPLETE;
+
+    // LEN is the length of the data, actual message length is LEN + 4.
+    unsigned len = At(1) + 4;
+
+    if (Size() < len)
+        return FRAME_INCOMPLETE;
+
 #if !defined(FAKE_CALL)
     uint8_t c = 0;
-    std::for_each(message.begin(), message.end(), [&](uint8_t e) { c ^= e; });
-    return c == 0;
-#else
-    return true;
+    for (unsigned i = 0; i < len; i++)
+        c ^= At(i);
+    if (c != 0) {
+        m_Read++;
+        return FRAME_BAD_CHECKSUM;
+    }
 #endif
+
+    unsigned pos = m_Read & (CAPACITY - 1);
+    unsigned first = (std::min)(len, CAPACITY - pos);
+    message.assign(&m_Data[pos], &m_Data[pos] + first);
+    message.insert(message.end(), &m_Data[0], &m_Data[0] + (len - first));
+    // Remove the message from the buffer.
+    m_Read += len;
+
+    // The message is complete with the append holding its last byte, drop
+    // the appends which were consumed before.  The cursors are free
+    // running, so compare their difference.
+    while (m_ArrivalCount > 0
+           && static_cast<int>(m_Arrivals[m_FirstArrival].End - m_Read) < 0) {
+        m_FirstArrival = (m_FirstArrival + 1) % MAX_ARRIVALS;
+        m_ArrivalCount--;
+    }
+    arrival = m_ArrivalCount > 0 ? m_Arrivals[m_FirstArrival].Time : 0;
+    return FRAME_OK;
 }
 
-AntMessageReader::AntMessageReader(libusb_device_handle *dh, uint8_t endpoint)
+// ................................................... AntMessageReader ....
+
+AntMessageReader::AntMessageReader(
+    libusb_device_handle *dh, uint8_t endpoint, int num_transfers)
     : m_DeviceHandle(dh),
     m_Endpoint(endpoint),
-    m_Transfer(nullptr),
-    m_Mark(0),
-    m_Active(false)
+    m_Transfers(num_transfers),
+    m_NextSubmit(0),
+    m_NextDeliver(0),
+    m_Pending(0),
+    m_TransferError(LIBUSB_TRANSFER_COMPLETED),
+    m_Stopping(false),
+    m_EventDriven(false),
+    m_ReceiveSignal(nullptr),
+    m_LastArrival(0)
 {
-    m_Buffer.reserve(1024);
-    m_Transfer = libusb_alloc_transfer(0);
+    // Leave room for a partial message in addition to all in-flight reads.
+    assert(num_transfers > 0
+           && num_transfers * READ_SIZE <= AntMessageRing::CAPACITY / 2);
+
+    for (auto &t : m_Transfers) {
+        t.reader = this;
+        t.transfer = libusb_alloc_transfer(0);
+        t.state = TS_IDLE;
+        t.arrival = 0;
+    }
 }
 
 AntMessageReader::~AntMessageReader()
 {
-    if (m_Active)
-        libusb_cancel_transfer(m_Transfer);
-    while (m_Active) {
-        libusb_handle_events(nullptr);
+    std::unique_lock<std::mutex> lock(m_Lock);
+    m_Stopping = true;
+#if !defined(FAKE_CALL)
+    for (auto &t : m_Transfers) {
+        if (t.state == TS_ACTIVE)
+            libusb_cancel_transfer(t.transfer);
+    }
+    for (auto &t : m_Transfers) {
+        while (t.state == TS_ACTIVE) {
+            if (m_EventDriven) {
+                m_DataReceived.wait(lock);
+            } else {
+                lock.unlock();
+                libusb_handle_events(nullptr);
+                lock.lock();
+            }
+        }
     }
-    libusb_free_transfer(m_Transfer);
+#endif
+    for (auto &t : m_Transfers)
+        libusb_free_transfer(t.transfer);
 }
 
 /** Fill `message' with the next available message.  If no message is received
-    * within a small amount of time, an empty buffer is returned.  If a message
+    * within `timeout' milliseconds, an empty buffer is returned.  If a message
     * is returned, it is a valid message (good header, length and checksum).
     */
-void AntMessageReader::MaybeGetNextMessage(Buffer &message)
+void AntMessageReader::MaybeGetNextMessage(Buffer &message, unsigned timeout)
 {
     message.clear();
 
-    if (m_Active) {
-        // Finish the transfer, wait 2 seconds for it
-#if !defined(FAKE_CALL)
-        struct timeval tv;
-        tv.tv_sec = 2; tv.tv_usec = 0;
-        int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
-        if (r < 0)
-            throw LibusbError("libusb_handle_events", r);
-#else
-        m_Transfer->status = LIBUSB_TRANSFER_COMPLETED;
-        m_Transfer->actual_length = 4;
-        m_Buffer[0] = SYNC_BYTE;
-        m_Buffer[1] = 0;
-        CompleteUsbTransfer(m_Transfer);
-#endif
-    }
+    // Finish the transfers, wait `timeout' milliseconds for a message
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
 
-    if (m_Active)
-        return;
+    std::unique_lock<std::mutex> lock(m_Lock);
+    while (!GetNextMessage1(message)) {
+        if (m_TransferError != LIBUSB_TRANSFER_COMPLETED)
+            throw LibusbError("AntMessageReader", m_TransferError);
+        SubmitUsbTransfers();
+        if (!WaitForUsbTransfer(lock, deadline))
+            return;
+    }
 
-    GetNextMessage1(message);
+    // Reading the message made room in the ring, keep the pool full.
+    SubmitUsbTransfers();
 }
 
 
@@ -100,75 +201,154 @@ void AntMessageReader::GetNextMessage(Buffer &message)
         throw std::runtime_error("AntMessageReader -- timed out");
 }
 
-void AntMessageReader::GetNextMessage1(Buffer &message)
+/** When `event_driven' is true, libusb events are processed by another thread
+    * (see LibusbEventThread) and the reader will only wait for transfers to
+    * complete.
+    */
+void AntMessageReader::SetEventDriven(bool event_driven)
 {
-    // Cannot operate on the buffer while a transfer is active
-    assert(!m_Active);
-
-    // Look for the sync byte which starts a message
-    while ((!m_Buffer.empty()) && m_Buffer[0] != SYNC_BYTE) {
-        m_Buffer.erase(m_Buffer.begin());
-        m_Mark--;
-    }
-
-    // An ANT message has the following sequence: SYNC, LEN, MSGID, DATA,
-    // CHECKSUM.  An empty message has at least 4 bytes in it.
-    if (m_Mark < 4) {
-        SubmitUsbTransfer();
-        return MaybeGetNextMessage(message);
-    }
-
-    // LEN is the length of the data, actual message length is LEN + 4.
-    unsigned len = m_Buffer[1] + 4;
-
-    if (m_Mark < len) {
-        SubmitUsbTransfer();
-        return MaybeGetNextMessage(message);
-    }
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_EventDriven = event_driven;
+}
 
-    std::copy(m_Buffer.begin(), m_Buffer.begin() + len, std::back_inserter(message));
-    // Remove the message from the buffer.
-    m_Buffer.erase(m_Buffer.begin(), m_Buffer.begin() + len);
-    m_Mark -= len;
+void AntMessageReader::SetReceiveSignal(UpdateSignal *signal)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_ReceiveSignal = signal;
+}
 
-    if (!IsGoodChecksum(message))
+/** Extract the next message from the data received so far.  Returns false if
+    * more data is needed.
+    */
+bool AntMessageReader::GetNextMessage1(Buffer &message)
+{
+    switch (m_Ring.ExtractMessage(message, m_LastArrival)) {
+    case AntMessageRing::FRAME_OK:
+        return true;
+    case AntMessageRing::FRAME_BAD_CHECKSUM:
         throw std::runtime_error("AntMessageReader -- bad checksum");
+    default:
+        return false;
+    }
 }
 
 void LIBUSB_CALL AntMessageReader::Trampoline(libusb_transfer *t)
 {
-    AntMessageReader *a = reinterpret_cast<AntMessageReader*>(t->user_data);
-    a->CompleteUsbTransfer(t);
+    UsbTransfer *ut = reinterpret_cast<UsbTransfer*>(t->user_data);
+    ut->reader->CompleteUsbTransfer(ut);
 }
 
-void AntMessageReader::SubmitUsbTransfer()
+/** Submit idle transfers, in order, as long as the ring has room for the data
+    * of all transfers in flight.
+    */
+void AntMessageReader::SubmitUsbTransfers()
 {
-    assert(!m_Active);
+    while (!m_Stopping
+           && m_TransferError == LIBUSB_TRANSFER_COMPLETED
+           && m_Transfers[m_NextSubmit].state == TS_IDLE
+           && m_Ring.Free() >= (m_Pending + 1) * READ_SIZE)
+    {
+        UsbTransfer &t = m_Transfers[m_NextSubmit];
+#if !defined(FAKE_CALL)
+        libusb_fill_bulk_transfer(
+            t.transfer, m_DeviceHandle, m_Endpoint,
+            t.data, READ_SIZE, Trampoline, &t, TIMEOUT);
 
-    const int read_size = 128;
+        int r = libusb_submit_transfer(t.transfer);
+        if (r < 0)
+            throw LibusbError("libusb_submit_transfer", r);
+#endif
+        t.state = TS_ACTIVE;
+        m_Pending++;
+        m_NextSubmit = (m_NextSubmit + 1) % m_Transfers.size();
+    }
+}
 
-    // Make sure we have enough space in the buffer.
-    m_Buffer.resize(m_Mark + read_size);
+/** Wait until at least one libusb event was handled or `deadline' has passed.
+    * Returns false on timeout.  `lock' is released while waiting.
+    */
+bool AntMessageReader::WaitForUsbTransfer(
+    std::unique_lock<std::mutex> &lock,
+    std::chrono::steady_clock::time_point deadline)
+{
+    auto now = std::chrono::steady_clock::now();
+    if (now >= deadline)
+        return false;
 #if !defined(FAKE_CALL)
-    libusb_fill_bulk_transfer(
-        m_Transfer, m_DeviceHandle, m_Endpoint,
-        &m_Buffer[m_Mark], read_size, Trampoline, this, TIMEOUT);
+    if (m_EventDriven) {
+        m_DataReceived.wait_until(lock, deadline);
+        return true;
+    }
 
-    int r = libusb_submit_transfer(m_Transfer);
+    auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+    struct timeval tv;
+    tv.tv_sec = static_cast<long>(remaining / 1000000);
+    tv.tv_usec = static_cast<long>(remaining % 1000000);
+    lock.unlock();
+    int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+    lock.lock();
     if (r < 0)
-        throw LibusbError("libusb_submit_transfer", r);
+        throw LibusbError("libusb_handle_events", r);
+#else
+    UsbTransfer &t = m_Transfers[m_NextDeliver];
+    if (t.state != TS_ACTIVE)
+        return false;
+    t.transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    t.transfer->actual_length = 4;
+    t.data[0] = SYNC_BYTE;
+    t.data[1] = 0;
+    t.data[2] = 0;
+    t.data[3] = 0;
+    t.arrival = CurrentNanoseconds();
+    t.state = TS_COMPLETED;
+    DeliverCompletedTransfers();
 #endif
-    m_Active = true;
+    return true;
 }
 
-void AntMessageReader::CompleteUsbTransfer(const libusb_transfer *t)
+void AntMessageReader::CompleteUsbTransfer(UsbTransfer *t)
 {
-    assert(t == m_Transfer);
+    // Taken first thing, the lock can be held by a reader for a while.
+    uint64_t arrival = CurrentNanoseconds();
 
-    m_Active = false;
+    std::lock_guard<std::mutex> lock(m_Lock);
+    assert(t->state == TS_ACTIVE);
 
-    bool ok = (m_Transfer->status == LIBUSB_TRANSFER_COMPLETED);
+    t->arrival = arrival;
+    t->state = TS_COMPLETED;
+    DeliverCompletedTransfers();
 
-    m_Mark += ok ? m_Transfer->actual_length : 0;
-    m_Buffer.erase(m_Buffer.begin() + m_Mark, m_Buffer.end());
+    // Keep the endpoint busy.  We are called from inside libusb event
+    // handling here, so errors are only recorded and reported by the next
+    // read.
+    try {
+        SubmitUsbTransfers();
+    }
+    catch (const LibusbError &e) {
+        m_TransferError = LIBUSB_TRANSFER_ERROR;
+        LOG_MSG("%s", e.what());
+    }
+    m_DataReceived.notify_all();
+    if (m_ReceiveSignal)
+        m_ReceiveSignal->Notify();
+}
+
+/** Move data from completed transfers into the ring.  Transfers can complete
+    * out of order, but the data is appended in the order they were submitted.
+    */
+void AntMessageReader::DeliverCompletedTransfers()
+{
+    while (m_Transfers[m_NextDeliver].state == TS_COMPLETED) {
+        UsbTransfer &t = m_Transfers[m_NextDeliver];
+        auto status = t.transfer->status;
+        if (status == LIBUSB_TRANSFER_COMPLETED)
+            m_Ring.Append(t.data, t.transfer->actual_length, t.arrival);
+        else if (status != LIBUSB_TRANSFER_TIMED_OUT
+                 && status != LIBUSB_TRANSFER_CANCELLED
+                 && m_TransferError == LIBUSB_TRANSFER_COMPLETED)
+            m_TransferError = status;
+        t.state = TS_IDLE;
+        m_Pending--;
+        m_NextDeliver = (m_NextDeliver + 1) % m_Transfers.size();
+    }
 }
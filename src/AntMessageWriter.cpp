@@ -24,83 +24,197 @@
 
 #include "winsock2.h" // for struct timeval
 
-AntMessageWriter::AntMessageWriter(libusb_device_handle *dh, uint8_t endpoint)
-    : m_DeviceHandle(dh), m_Endpoint(endpoint), m_Transfer(nullptr), m_Active(false)
+AntMessageWriter::AntMessageWriter(
+    libusb_device_handle *dh, uint8_t endpoint,
+    int num_transfers, unsigned max_queued)
+    : m_DeviceHandle(dh),
+    m_Endpoint(endpoint),
+    m_Transfers(num_transfers),
+    m_NextSubmit(0),
+    m_Active(0),
+    m_Queue(max_queued),
+    m_QueueHead(0),
+    m_Queued(0),
+    m_TransferError(LIBUSB_TRANSFER_COMPLETED),
+    m_EventDriven(false)
 {
-    m_Transfer = libusb_alloc_transfer(0);
+    assert(num_transfers > 0);
+    assert(max_queued > 0);
+
+    for (auto &t : m_Transfers) {
+        t.writer = this;
+        t.transfer = libusb_alloc_transfer(0);
+        t.active = false;
+    }
 }
 
 AntMessageWriter::~AntMessageWriter()
 {
-    if (m_Active)
-        libusb_cancel_transfer(m_Transfer);
-    while (m_Active) {
-        libusb_handle_events(nullptr);
+    // Give pending messages (e.g. channel close requests sent from
+    // destructors) a chance to reach the stick.
+    try {
+        Flush(TIMEOUT);
+    }
+    catch (std::exception &) {
+        // discard it
     }
-    libusb_free_transfer(m_Transfer);
+
+    std::unique_lock<std::mutex> lock(m_Lock);
+    m_Queued = 0;
+#if !defined(FAKE_CALL)
+    for (auto &t : m_Transfers) {
+        if (t.active)
+            libusb_cancel_transfer(t.transfer);
+    }
+    for (auto &t : m_Transfers) {
+        while (t.active) {
+            if (m_EventDriven) {
+                m_DataSent.wait(lock);
+            } else {
+                lock.unlock();
+                libusb_handle_events(nullptr);
+                lock.lock();
+            }
+        }
+    }
+#endif
+    for (auto &t : m_Transfers)
+        libusb_free_transfer(t.transfer);
 }
 
-/** Write `message' to the USB device.  This is presumably an ANT message, but
-    * we don't check.  When this function returns, the message has been written
-    * (there is no buffering on the application side). An exception is thrown if
-    * there is an error or a timeout.
+/** Queue `message' to be written to the USB device.  This is presumably an
+    * ANT message, but we don't check.  The function does not wait for the
+    * message to be written, use the completion and error callbacks (or Flush())
+    * for that.  An exception is thrown if the queue is full or if a previous
+    * write has failed.
     */
-void AntMessageWriter::WriteMessage(const Buffer &message)
+void AntMessageWriter::WriteMessage(const AntMessage &message)
 {
-    assert(!m_Active);
-    m_Buffer = message;
-    m_Active = false;
-    SubmitUsbTransfer();
-#if !defined(FAKE_CALL)
-    // Finish the transfer, wait 2 seconds for it
-    struct timeval tv;
-    tv.tv_sec = 2; tv.tv_usec = 0;
-    int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
-    if (r < 0)
-        throw LibusbError("libusb_handle_events", r);
-#else
-    CompleteUsbTransfer(m_Transfer);
-    m_Transfer->status = LIBUSB_TRANSFER_COMPLETED;
-#endif
-    if (!m_Active && m_Transfer->status != LIBUSB_TRANSFER_COMPLETED)
-        throw LibusbError("AntMessageWriter", m_Transfer->status);
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if (m_TransferError != LIBUSB_TRANSFER_COMPLETED)
+        throw LibusbError("AntMessageWriter", m_TransferError);
+    if (m_Queued >= m_Queue.size())
+        throw std::runtime_error("AntMessageWriter -- queue full");
 
-    if (m_Active) {
-        libusb_cancel_transfer(m_Transfer);
+    m_Queue[(m_QueueHead + m_Queued) % m_Queue.size()] = message;
+    m_Queued++;
+    SubmitUsbTransfers();
+}
+
+/** Wait up to `timeout' milliseconds for all queued messages to be written.
+    * Returns false if some messages are still pending.
+    */
+bool AntMessageWriter::Flush(uint32_t timeout)
+{
+#if !defined(FAKE_CALL)
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    std::unique_lock<std::mutex> lock(m_Lock);
+    while (m_Queued > 0 || m_Active > 0) {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+            return false;
+        if (m_EventDriven) {
+            m_DataSent.wait_until(lock, deadline);
+            continue;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
         struct timeval tv;
-        tv.tv_sec = 0; tv.tv_usec = 10 * 1000;
+        tv.tv_sec = static_cast<long>(remaining / 1000000);
+        tv.tv_usec = static_cast<long>(remaining % 1000000);
+        lock.unlock();
         int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+        lock.lock();
         if (r < 0)
             throw LibusbError("libusb_handle_events", r);
+    }
+#endif
+    return true;
+}
 
-        m_Active = false;               // ready or not!
+/** Number of messages which were queued, but not yet written. */
+unsigned AntMessageWriter::QueuedMessages()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_Queued + m_Active;
+}
 
-        throw std::runtime_error("AntMessageWriter -- timed out");
-    }
+/** When `event_driven' is true, libusb events are processed by another thread
+    * (see LibusbEventThread) and the writer will only wait for transfers to
+    * complete.
+    */
+void AntMessageWriter::SetEventDriven(bool event_driven)
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_EventDriven = event_driven;
 }
 
 void LIBUSB_CALL AntMessageWriter::Trampoline(libusb_transfer *t)
 {
-    AntMessageWriter *a = reinterpret_cast<AntMessageWriter*>(t->user_data);
-    a->CompleteUsbTransfer(t);
+    UsbTransfer *ut = reinterpret_cast<UsbTransfer*>(t->user_data);
+    ut->writer->CompleteUsbTransfer(ut);
 }
 
-void AntMessageWriter::SubmitUsbTransfer()
+/** Move queued messages into free transfers and submit them, in order.
+    */
+void AntMessageWriter::SubmitUsbTransfers()
 {
+    while (m_Queued > 0 && !m_Transfers[m_NextSubmit].active) {
+        UsbTransfer &t = m_Transfers[m_NextSubmit];
+        t.data = m_Queue[m_QueueHead];
+        m_QueueHead = (m_QueueHead + 1) % m_Queue.size();
+        m_Queued--;
+        m_NextSubmit = (m_NextSubmit + 1) % m_Transfers.size();
 #if !defined(FAKE_CALL)
-    libusb_fill_bulk_transfer(
-        m_Transfer, m_DeviceHandle, m_Endpoint,
-        &m_Buffer[0], (int)m_Buffer.size(), Trampoline, this, TIMEOUT);
+        libusb_fill_bulk_transfer(
+            t.transfer, m_DeviceHandle, m_Endpoint,
+            t.data.data(), (int)t.data.size(), Trampoline, &t, TIMEOUT);
 
-    int r = libusb_submit_transfer(m_Transfer);
-    if (r < 0)
-        throw LibusbError("libusb_submit_transfer", r);
+        int r = libusb_submit_transfer(t.transfer);
+        if (r < 0)
+            throw LibusbError("libusb_submit_transfer", r);
+        t.active = true;
+        m_Active++;
+#else
+        if (m_OnComplete)
+            m_OnComplete(t.data);
 #endif
-    m_Active = true;
+    }
 }
 
-void AntMessageWriter::CompleteUsbTransfer(const libusb_transfer *t)
+void AntMessageWriter::CompleteUsbTransfer(UsbTransfer *t)
 {
-    assert(t == m_Transfer);
-    m_Active = false;
-}
\ No newline at end of file
+    std::unique_lock<std::mutex> lock(m_Lock);
+    assert(t->active);
+
+    auto status = t->transfer->status;
+    if (status != LIBUSB_TRANSFER_COMPLETED
+        && status != LIBUSB_TRANSFER_CANCELLED
+        && m_TransferError == LIBUSB_TRANSFER_COMPLETED)
+        m_TransferError = status;
+
+    // The callbacks might write more messages, call them without holding the
+    // lock.  The transfer stays active, so its data is not overwritten.
+    lock.unlock();
+    if (status == LIBUSB_TRANSFER_COMPLETED) {
+        if (m_OnComplete)
+            m_OnComplete(t->data);
+    } else {
+        if (m_OnError)
+            m_OnError(t->data, status);
+    }
+    lock.lock();
+
+    t->active = false;
+    m_Active--;
+
+    // We are called from inside libusb event handling here, so errors are
+    // only recorded and reported by the next write.
+    try {
+        SubmitUsbTransfers();
+    }
+    catch (const LibusbError &e) {
+        m_TransferError = LIBUSB_TRANSFER_ERROR;
+        LOG_MSG("%s", e.what());
+    }
+    m_DataSent.notify_all();
+}
@@ -0,0 +1,158 @@
+/**
+ *  AntScanChannel -- receive from all ANT+ masters in range on one channel
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntScanChannel.h"
+#include "HeartRateMonitor.h"
+#include "FitnessEquipmentControl.h"
+#include "Tools.h"
+
+/** IMPLEMENTATION NOTE
+ *
+ * Continuous scan mode and the flagged extended data format are described in
+ * "ANT Message Protocol And Usage" (sections 5.3 and 7.1.1).
+ */
+
+namespace {
+
+enum {
+    // Not used in scan mode, but the channel needs some values.
+    SCAN_CHANNEL_PERIOD = 8192,
+    SCAN_SEARCH_TIMEOUT = 0xFF,
+
+    // The top bit of the device type in a channel ID is the pairing bit.
+    DEVICE_TYPE_MASK = 0x7F
+};
+
+};                                      // end anonymous namespace
+
+AntScanChannel::AntScanChannel(AntStick *stick,
+                               DecoderFactory factory,
+                               uint8_t frequency)
+    : AntChannel(stick,
+                 AntChannel::Id(0, 0),
+                 SCAN_CHANNEL_PERIOD,
+                 SCAN_SEARCH_TIMEOUT,
+                 frequency,
+                 OPEN_SCAN),
+      m_DecoderFactory(factory)
+{
+}
+
+std::unique_ptr<AntChannel> AntScanChannel::DefaultDecoderFactory(const AntChannel::Id &id)
+{
+    switch (id.DeviceType) {
+    case HRM::ANT_DEVICE_TYPE:
+        return std::unique_ptr<AntChannel>(new HeartRateMonitor(id));
+    case BIKE::ANT_DEVICE_TYPE:
+        return std::unique_ptr<AntChannel>(new FitnessEquipmentControl(id));
+    default:
+        return nullptr;
+    }
+}
+
+const AntScanChannel::Device* AntScanChannel::FindDevice(
+    uint8_t device_type, uint32_t device_number) const
+{
+    auto i = m_Devices.find(DeviceKey(device_type, device_number));
+    return i == m_Devices.end() ? nullptr : &i->second;
+}
+
+std::vector<const AntScanChannel::Device*> AntScanChannel::GetDevices() const
+{
+    std::vector<const Device*> devices;
+    devices.reserve(m_Devices.size());
+    for (auto &d : m_Devices)
+        devices.push_back(&d.second);
+    return devices;
+}
+
+void AntScanChannel::RemoveIdleDevices(uint32_t max_idle)
+{
+    auto now = CurrentMilliseconds();
+    for (auto i = m_Devices.begin(); i != m_Devices.end(); ) {
+        if (now - i->second.LastSeen > max_idle)
+            i = m_Devices.erase(i);
+        else
+            ++i;
+    }
+}
+
+/** Find out who sent a data message from its extended data and pass it on to
+ * the decoder for that master, creating it the first time we hear from it.
+ */
+void AntScanChannel::OnMessageReceived(const uint8_t *data, int size)
+{
+    if (data[2] != BROADCAST_DATA
+        && data[2] != ACKNOWLEDGE_DATA
+        && data[2] != BURST_TRANSFER_DATA)
+        return;
+
+    // SYNC, LEN, MSGID, channel, 8 byte payload, flags, extended data
+    const int flags_pos = 12;
+    int end = 3 + data[1];              // the checksum is not included
+    if (end > size || end <= flags_pos || (data[flags_pos] & EXT_CHANNEL_ID) == 0)
+        return;
+
+    uint8_t flags = data[flags_pos];
+    const uint8_t *ext = data + flags_pos + 1;
+    const uint8_t *ext_end = data + end;
+    if (ext_end - ext < 4)
+        return;
+
+    // note: high nibble of the transmission type byte represents the
+    // extended 20bit device number
+    uint8_t transmission_type = ext[3];
+    uint32_t device_number = ext[0] | (ext[1] << 8) | ((transmission_type & 0xF0) << 12);
+    uint8_t device_type = ext[2] & DEVICE_TYPE_MASK;
+    ext += 4;
+
+    int rssi = 0;
+    if ((flags & EXT_RSSI) && ext_end - ext >= 3) {
+        rssi = static_cast<int8_t>(ext[1]);
+        ext += 3;
+    }
+
+    uint16_t rx_timestamp = 0;
+    if ((flags & EXT_RX_TIMESTAMP) && ext_end - ext >= 2) {
+        rx_timestamp = static_cast<uint16_t>(ext[0] | (ext[1] << 8));
+    }
+
+    uint32_t key = DeviceKey(device_type, device_number);
+    auto i = m_Devices.find(key);
+    if (i == m_Devices.end()) {
+        AntChannel::Id id(device_type, device_number);
+        id.TransmissionType = transmission_type;
+        Device d = { id, 0, 0, 0, 0, nullptr };
+        // We remember masters without a decoder as well, so we don't ask
+        // the factory again for each of their messages.
+        if (m_DecoderFactory)
+            d.Decoder = m_DecoderFactory(id);
+        if (d.Decoder)
+            d.Decoder->SetUpdateSignal(m_UpdateSignal);
+        i = m_Devices.emplace(key, std::move(d)).first;
+        LOG_MSG("AntScanChannel: new device "); LOG_D(device_number);
+    }
+
+    Device &d = i->second;
+    d.Rssi = rssi;
+    d.RxTimestamp = rx_timestamp;
+    d.LastSeen = CurrentMilliseconds();
+    d.MessageCount++;
+    if (d.Decoder)
+        d.Decoder->HandleMessage(data, size, MessageArrival());
+}
@@ -0,0 +1,95 @@
+/**
+ *  AntScanChannel -- receive from all ANT+ masters in range on one channel
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "AntStick.h"
+
+/** Open the stick in continuous scan mode and receive the broadcasts of all
+ * masters in range on the ANT+ frequency, instead of pairing up a channel
+ * with each of them.  The stick appends the channel ID, RSSI and a receive
+ * timestamp to every message, which are used to pass each message on to a
+ * detached decoder channel (e.g. a HeartRateMonitor) for its master.  This
+ * way, a single stick can serve any number of sensors.
+ *
+ * Scan mode uses channel 0 and the stick does not allow other channels to be
+ * open while scanning, so this must be the only channel on the stick.  Scan
+ * mode is receive only: decoders cannot send acknowledged data, which means
+ * FE-C trainers can be monitored, but not controlled.
+ */
+class AntScanChannel : public AntChannel
+{
+public:
+
+    /** Create the decoder for a newly seen master, or return nullptr to
+     * ignore it.  The decoder must be a detached channel. */
+    typedef std::function<std::unique_ptr<AntChannel>(const AntChannel::Id &id)> DecoderFactory;
+
+    /** A master we received messages from. */
+    struct Device {
+        AntChannel::Id Id;
+        /** Signal strength of the last message, in dBm. */
+        int Rssi;
+        /** Stick timestamp of the last message, in 1/32768 seconds, rolls
+         * over every 2 seconds. */
+        uint16_t RxTimestamp;
+        /** CurrentMilliseconds() when the last message was received. */
+        uint32_t LastSeen;
+        unsigned MessageCount;
+        std::unique_ptr<AntChannel> Decoder;
+    };
+
+    AntScanChannel(AntStick *stick,
+                   DecoderFactory factory = DefaultDecoderFactory,
+                   uint8_t frequency = 57);
+
+    /** Decoders for heart rate monitors and FE-C trainers, other device
+     * types are ignored. */
+    static std::unique_ptr<AntChannel> DefaultDecoderFactory(const AntChannel::Id &id);
+
+    /** Return the device with `device_type' and `device_number', or
+     * nullptr if we have not heard from it. */
+    const Device* FindDevice(uint8_t device_type, uint32_t device_number) const;
+
+    /** Return all devices we have heard from, in no particular order. */
+    std::vector<const Device*> GetDevices() const;
+
+    /** Forget the devices we have not heard from in `max_idle' milliseconds,
+     * destroying their decoders. */
+    void RemoveIdleDevices(uint32_t max_idle);
+
+private:
+    void OnMessageReceived(const uint8_t *data, int size) override;
+
+    static uint32_t DeviceKey(uint8_t device_type, uint32_t device_number)
+    {
+        return (static_cast<uint32_t>(device_type) << 24) | (device_number & 0xFFFFF);
+    }
+
+    DecoderFactory m_DecoderFactory;
+    std::unordered_map<uint32_t, Device> m_Devices;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -34,6 +34,10 @@
 #pragma comment (lib, "libusb-1.0.lib")
 #endif
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 /** IMPLEMENTATION NOTE 
  * 
  * The ANT Message Protocol implemented here is documented in the "ANT Message
@@ -64,124 +68,12 @@ enum ChannelType {
     UNIDIRECTIONAL_TRANSMIT_ONLY = 0x50
 };
 
-void CheckChannelResponse (
-    const Buffer &response, uint8_t channel, uint8_t cmd, uint8_t status)
-{
-#if !defined(FAKE_CALL)
-    if (response.size() < 6
-        || response[2] != CHANNEL_RESPONSE
-        || response[3] != channel
-        || response[4] != cmd
-        || response[5] != status)
-    {
-#if defined (DEBUG_DUMP)
-        DumpData(&response[0], response.size(), std::cerr);
-        std::cerr << "expecting channel: " << (int)channel
-                  << ", cmd  " << (int)cmd << ", status " << (int)status << "\n";
-#endif
-        // Funny thing: this function is also called from a destructor while
-        // an exception is being unwound.  Don't cause further trouble...
-        if (! std::uncaught_exception())
-            throw std::runtime_error ("CheckChannelResponse -- bad response");
-    }
-#endif
-}
-
-void AddMessageChecksum (Buffer &b)
-{
-    uint8_t c = 0;
-    std::for_each (b.begin(), b.end(), [&](uint8_t e) { c ^= e; });
-    b.push_back (c);
-}
-
-Buffer MakeMessage (AntMessageId id, uint8_t data)
-{
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (0x01);                 // data length
-    b.push_back (static_cast<uint8_t>(id));
-    b.push_back (data);
-    AddMessageChecksum (b);
-    return b;
-}
-
-Buffer MakeMessage (AntMessageId id, uint8_t data0, uint8_t data1)
-{
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (0x02);                 // data length
-    b.push_back (static_cast<uint8_t>(id));
-    b.push_back (data0);
-    b.push_back (data1);
-    AddMessageChecksum (b);
-    return b;
-}
-
-Buffer MakeMessage (AntMessageId id,
-                    uint8_t data0, uint8_t data1, uint8_t data2)
-{
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (0x03);                 // data length
-    b.push_back (static_cast<uint8_t>(id));
-    b.push_back (data0);
-    b.push_back (data1);
-    b.push_back (data2);
-    AddMessageChecksum (b);
-    return b;
-}
-
-Buffer MakeMessage (AntMessageId id,
-                    uint8_t data0, uint8_t data1, uint8_t data2,
-                    uint8_t data3, uint8_t data4)
-{
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (0x05);                 // data length
-    b.push_back (static_cast<uint8_t>(id));
-    b.push_back (data0);
-    b.push_back (data1);
-    b.push_back (data2);
-    b.push_back (data3);
-    b.push_back (data4);
-    AddMessageChecksum (b);
-    return b;
-}
-
-Buffer MakeMessage (AntMessageId id, Buffer data)
-{
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (static_cast<uint8_t>(data.size()));
-    b.push_back (static_cast<uint8_t>(id));
-    b.insert (b.end(), data.begin(), data.end());
-    AddMessageChecksum (b);
-    return b;
-}
-
-Buffer MakeMessage (AntMessageId id, uint8_t data0, const Buffer &data)
-{
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (static_cast<uint8_t>(data.size() + 1));
-    b.push_back (static_cast<uint8_t>(id));
-    b.push_back (data0);
-    b.insert (b.end(), data.begin(), data.end());
-    AddMessageChecksum (b);
-    return b;
-}
-
-Buffer MakeMessage (AntMessageId id, uint8_t data0, uint8_t data1, const Buffer &data)
+/** Build an ANT message for `id' with `data' as the payload, see AntMessage.
+ */
+template <typename... Data>
+constexpr AntMessage MakeMessage (AntMessageId id, Data... data)
 {
-    Buffer b;
-    b.push_back (SYNC_BYTE);
-    b.push_back (static_cast<uint8_t>(data.size() + 2));
-    b.push_back (static_cast<uint8_t>(id));
-    b.push_back (data0);
-    b.push_back(data1);
-    b.insert (b.end(), data.begin(), data.end());
-    AddMessageChecksum (b);
-    return b;
+    return AntMessage (id, data...);
 }
 
 struct ChannelEventName {
@@ -221,8 +113,21 @@ struct ChannelEventName {
     { NVM_WRITE_ERROR, "nvm write fail" },
     { USB_STRING_WRITE_FAIL, "usb write fail" },
     { MESG_SERIAL_ERROR_ID, "bad usb packet received" },
+    { RESPONSE_TIMEOUT, "no response received" },
     { LAST_EVENT_ID, nullptr}};
 
+/** Index of the lowest bit set in `w', which must not be 0. */
+int LowestSetBit(uint32_t w)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, w);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctz(w);
+#endif
+}
+
 std::ostream& operator<< (std::ostream &out, const AntChannel::Id &id)
 {
     out << "#<ID Type = " << (int)id.DeviceType << "; Number = " << id.DeviceNumber << ">";
@@ -247,18 +152,27 @@ void AntChannel::InternalInit(AntStick *stick)
     if (m_ChannelNumber == -1)
         throw std::runtime_error("no more channel ids left");
 
+    // The stick can only scan on channel 0
+    if (m_OpenMode == OPEN_SCAN && m_ChannelNumber != 0)
+        throw std::runtime_error("scan mode needs channel 0, which is in use");
+
+    // The setup commands are only queued here, their responses are checked
+    // as they arrive and a failure closes the channel.  As far as users are
+    // concerned, the channel is searching from now on.
+    m_State = CH_SEARCHING;
+    m_Stick->RegisterChannel(this);
+
     // we hard code the type to BIDIRECTIONAL_RECEIVE, using other channel
     // types would require changes to the handling code anyway.
-    m_Stick->WriteMessage(
+    m_Assigned = true;
+    SendCommand(
         MakeMessage(
             ASSIGN_CHANNEL, m_ChannelNumber,
             static_cast<uint8_t>(BIDIRECTIONAL_RECEIVE),
             static_cast<uint8_t>(m_Stick->GetNetwork())));
-    Buffer response = m_Stick->ReadMessage();
-    CheckChannelResponse(response, m_ChannelNumber, ASSIGN_CHANNEL, 0);
     LOG_MSG("ASSIGN_CHANNEL: m_ChannelNumber = %d, NetworkKey = %d\n", m_ChannelNumber, static_cast<uint8_t>(m_Stick->GetNetwork()));
 
-    m_Stick->WriteMessage(
+    SendCommand(
         MakeMessage(SET_CHANNEL_ID, m_ChannelNumber,
             static_cast<uint8_t>(m_ChannelId.DeviceNumber & 0xFF),
             static_cast<uint8_t>((m_ChannelId.DeviceNumber >> 8) & 0xFF),
@@ -266,21 +180,34 @@ void AntChannel::InternalInit(AntStick *stick)
             // High nibble of the transmission_type is the top 4 bits
             // of the 20 bit device id.
             static_cast<uint8_t>((m_ChannelId.DeviceNumber >> 12) & 0xF0)));
-    response = m_Stick->ReadMessage();
-    CheckChannelResponse(response, m_ChannelNumber, SET_CHANNEL_ID, 0);
     LOG_MSG("SET_CHANNEL_ID: m_ChannelNumber = %d, m_ChannelId.DeviceNumber = %d, m_ChannelId.DeviceType = %d\n", m_ChannelNumber, m_ChannelId.DeviceNumber, m_ChannelId.DeviceType);
 
     Configure();
-    LOG_MSG("CONFIGURE_CHANNEL: period = %d, timeout = %d, frequency = %d\n", period, timeout, frequency);
-
-    m_Stick->WriteMessage(
-        MakeMessage(OPEN_CHANNEL, m_ChannelNumber));
-    response = m_Stick->ReadMessage();
-    CheckChannelResponse(response, m_ChannelNumber, OPEN_CHANNEL, 0);
-    LOG_MSG("OPEN_CHANNEL: m_ChannelNumber = %d\n", m_ChannelNumber);
-
-    m_State = CH_SEARCHING;
-    m_Stick->RegisterChannel(this);
+    LOG_MSG("CONFIGURE_CHANNEL: period = %d, timeout = %d, frequency = %d\n", m_period, m_timeout, m_frequency);
+
+    if (m_OpenMode == OPEN_SCAN) {
+        SendCommand(
+            MakeMessage(LIB_CONFIG, 0,
+                static_cast<uint8_t>(EXT_CHANNEL_ID | EXT_RSSI | EXT_RX_TIMESTAMP)));
+        // There is no single master to identify, the channel is open as
+        // soon as the stick starts scanning.
+        m_Stick->SendCommand(
+            MakeMessage(OPEN_RX_SCAN_MODE, 0),
+            [this](AntChannelEvent status) {
+                if (status == RESPONSE_NO_ERROR) {
+                    ChangeState(CH_OPEN);
+                    wasChannelOpen.notify_all();
+                } else {
+                    LOG_MSG("OPEN_RX_SCAN_MODE failed: ");
+                    LOG_MSG("%s", ChannelEventAsString(status)); LOG_MSG("\n");
+                    ChangeState(CH_CLOSED);
+                }
+            }, this);
+        LOG_MSG("OPEN_RX_SCAN_MODE\n");
+    } else {
+        SendCommand(MakeMessage(OPEN_CHANNEL, m_ChannelNumber));
+        LOG_MSG("OPEN_CHANNEL: m_ChannelNumber = %d\n", m_ChannelNumber);
+    }
 }
 
 AntChannel::AntChannel (AntStick *stick,
@@ -288,10 +215,24 @@ AntChannel::AntChannel (AntStick *stick,
                         unsigned period,
                         uint8_t timeout,
                         uint8_t frequency)
-    : m_Stick (stick),
-      m_IdReqestOutstanding (false),
+    : AntChannel(stick, channel_id, period, timeout, frequency, OPEN_TRACKING)
+{
+}
+
+AntChannel::AntChannel (AntStick *stick,
+                        AntChannel::Id channel_id,
+                        unsigned period,
+                        uint8_t timeout,
+                        uint8_t frequency,
+                        OpenMode open_mode)
+    : m_ChannelId(channel_id),
       m_AckDataRequestOutstanding(false),
-      m_ChannelId(channel_id),
+      m_IdReqestOutstanding (false),
+      m_Assigned (false),
+      m_OpenMode (open_mode),
+      m_UpdateSignal (nullptr),
+      m_MessageArrival (0),
+      m_Stick (stick),
       m_period(period),
       m_timeout(timeout),
       m_frequency(frequency)
@@ -299,24 +240,40 @@ AntChannel::AntChannel (AntStick *stick,
     InternalInit(stick);
 }
 
+AntChannel::AntChannel (AntChannel::Id channel_id)
+    : m_State (CH_OPEN),
+      m_ChannelId (channel_id),
+      m_ChannelNumber (-1),
+      m_AckDataRequestOutstanding (false),
+      m_IdReqestOutstanding (false),
+      m_Assigned (false),
+      m_OpenMode (OPEN_TRACKING),
+      m_UpdateSignal (nullptr),
+      m_MessageArrival (0),
+      m_Stick (nullptr),
+      m_period (0),
+      m_timeout (0),
+      m_frequency (0)
+{
+}
+
 AntChannel::~AntChannel()
 {
+    if (IsDetached())
+        return;
+
+    bool close = m_State != CH_CLOSED;
     try {
-        if (m_State != CH_CLOSED) {
+        if (close)
             ChangeState(CH_CLOSED);
-            RequestClose();
-            // The channel has to respond with an EVENT_CHANNEL_CLOSED channel
-            // event, but we cannot process that (it would go through
-            // Tick(). We wait at least for the event to be generated.
-            Sleep(0);
-            RequestUnassign();
-        }
     }
     catch (std::exception &) {
         // discard it
     }
 
-    m_Stick->UnregisterChannel (this);
+    // The stick closes and unassigns the channel for us (if needed), the
+    // channel number is reused only after that.
+    m_Stick->UnregisterChannel (this, close, m_Assigned);
 }
 
 /** Request this channel to close.  Closing the channel involves receiving a
@@ -325,21 +282,35 @@ AntChannel::~AntChannel()
  */
 void AntChannel::RequestClose()
 {
-    m_Stick->WriteMessage (MakeMessage (CLOSE_CHANNEL, m_ChannelNumber));
-    Buffer response = m_Stick->ReadMessage();
-    CheckChannelResponse (response, m_ChannelNumber, CLOSE_CHANNEL, 0);
+    SendCommand (MakeMessage (CLOSE_CHANNEL, m_ChannelNumber));
 }
 
 void AntChannel::RequestUnassign()
 {
-    m_Stick->WriteMessage(MakeMessage(UNASSIGN_CHANNEL, m_ChannelNumber));
-    Buffer response = m_Stick->ReadMessage();
-    CheckChannelResponse(response, m_ChannelNumber, UNASSIGN_CHANNEL, 0);
+    m_Assigned = false;
+    SendCommand (MakeMessage (UNASSIGN_CHANNEL, m_ChannelNumber));
 }
 
+/** Send a command for this channel.  The channel is closed if the stick
+ * rejects it (or does not respond).
+ */
+void AntChannel::SendCommand(const AntMessage &command)
+{
+    if (IsDetached())
+        return;
+    m_Stick->SendCommand(command, [this](AntChannelEvent status) {
+        if (status != RESPONSE_NO_ERROR) {
+            LOG_MSG("AntChannel: command failed: ");
+            LOG_MSG("%s", ChannelEventAsString(status)); LOG_MSG("\n");
+            ChangeState(CH_CLOSED);
+        }
+    }, this);
+}
 
-void AntChannel::SendAcknowledgedData(int tag, const Buffer &message)
+void AntChannel::SendAcknowledgedData(int tag, const uint8_t message[8])
 {
+    if (IsDetached())
+        return;                         // nothing to send it on
     m_AckDataQueue.push(AckDataItem(tag, message));
 }
 
@@ -347,17 +318,18 @@ void AntChannel::RequestDataPage(uint8_t page_id, int transmit_count)
 {
     const uint8_t DP_DP_REQUEST = 0x46;
 
-    Buffer msg;
-    msg.push_back(DP_DP_REQUEST);
-    msg.push_back(0xFF);                // slave serial LSB
-    msg.push_back(0xFF);                // slave serial MSB
-    msg.push_back(0xFF);                // descriptor 1
-    msg.push_back(0xFF);                // descriptor 2
-    // number of times we ask the slave to transmit the data page (if it is
-    // lost due to channel collisions the slave won't care)
-    msg.push_back(transmit_count);
-    msg.push_back(page_id);
-    msg.push_back(0x01);                // command type: 0x01 request data page
+    const uint8_t msg[8] = {
+        DP_DP_REQUEST,
+        0xFF,                           // slave serial LSB
+        0xFF,                           // slave serial MSB
+        0xFF,                           // descriptor 1
+        0xFF,                           // descriptor 2
+        // number of times we ask the slave to transmit the data page (if it
+        // is lost due to channel collisions the slave won't care)
+        static_cast<uint8_t>(transmit_count),
+        page_id,
+        0x01                            // command type: 0x01 request data page
+    };
     SendAcknowledgedData(page_id, msg);
 }
 
@@ -365,27 +337,19 @@ void AntChannel::RequestDataPage(uint8_t page_id, int transmit_count)
  */
 void AntChannel::Configure ()
 {
-    m_Stick->WriteMessage (
+    SendCommand (
         MakeMessage (SET_CHANNEL_PERIOD, m_ChannelNumber, m_period & 0xFF, (m_period >> 8) & 0xff));
-    Buffer response = m_Stick->ReadMessage();
-    CheckChannelResponse (response, m_ChannelNumber, SET_CHANNEL_PERIOD, 0);
-
-    m_Stick->WriteMessage (
+    SendCommand (
         MakeMessage (SET_CHANNEL_SEARCH_TIMEOUT, m_ChannelNumber, m_timeout));
-    response = m_Stick->ReadMessage();
-    CheckChannelResponse (response, m_ChannelNumber, SET_CHANNEL_SEARCH_TIMEOUT, 0);
-
-    m_Stick->WriteMessage (
+    SendCommand (
         MakeMessage (SET_CHANNEL_RF_FREQ, m_ChannelNumber, m_frequency));
-    response = m_Stick->ReadMessage();
-    CheckChannelResponse(response, m_ChannelNumber, SET_CHANNEL_RF_FREQ, 0);
 }
 
 /** Called by the AntStick::Tick method to process a message received on this
  * channel.  This will look for some channel events, and process them, but
  * delegate most of the messages to ProcessMessage() in the derived class.
  */
-void AntChannel::HandleMessage(const uint8_t *data, int size)
+void AntChannel::HandleMessage(const uint8_t *data, int size, uint64_t arrival)
 {
     LOG_MSG("HandleMessage: m_ChannelNumber = %d, type = %d\n", m_ChannelNumber, data[2]);
     if (m_State == CH_CLOSED) {
@@ -398,12 +362,14 @@ void AntChannel::HandleMessage(const uint8_t *data, int size)
         return;
     }
 
+    m_MessageArrival = arrival;
     switch (data[2]) {
     case CHANNEL_RESPONSE:
         OnChannelResponseMessage (data, size);
         break;
     case BROADCAST_DATA:
-        if (m_State != CH_OPEN && ! m_IdReqestOutstanding)
+        if (m_OpenMode == OPEN_TRACKING && ! IsDetached()
+            && m_State != CH_OPEN && ! m_IdReqestOutstanding)
         {
             // We received a broadcast message on this channel and we don't
             // have a master serial number, find out who is sending us
@@ -432,7 +398,10 @@ void AntChannel::MaybeSendAckData()
 {
     if (! m_AckDataRequestOutstanding && ! m_AckDataQueue.empty()) {
         const AckDataItem &item = m_AckDataQueue.front();
-        m_Stick->WriteMessage(MakeMessage(ACKNOWLEDGE_DATA, m_ChannelNumber, item.data));
+        const uint8_t *d = item.data;
+        m_Stick->WriteMessage(
+            MakeMessage(ACKNOWLEDGE_DATA, m_ChannelNumber,
+                        d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7]));
         m_AckDataRequestOutstanding = true;
     }
 }
@@ -590,27 +559,29 @@ struct ant_stick_devid_ {
 
 int num_ant_stick_devid = sizeof(ant_stick_devid) / sizeof(ant_stick_devid[0]);
 
-/** Find the USB device for the ANT stick.  Return nullptr if not found,
- * throws an exception if there is a problem with the lookup.
+/** Find the USB devices for all attached ANT sticks.  The caller owns a
+ * reference to each of them.  Throws an exception if there is a problem with
+ * the lookup.
  */
-libusb_device* FindAntStick()
+std::vector<libusb_device*> FindAntSticks()
 {
-    libusb_device *ant_stick = nullptr; // the one we are looking for
+    std::vector<libusb_device*> ant_sticks;
 #if !defined (FAKE_CALL)
     libusb_device **devs;
     ssize_t devcnt = libusb_get_device_list(nullptr, &devs);
     if (devcnt < 0)
         throw LibusbError("libusb_get_device_list", (int)devcnt);
 
-    bool found_it = false;
     int i = 0;
     libusb_device *dev = nullptr;
 
-    while ((dev = devs[i++]) != nullptr && ! found_it)
+    while ((dev = devs[i++]) != nullptr)
     {
         struct libusb_device_descriptor desc;
         int r = libusb_get_device_descriptor(dev, &desc);
         if (r < 0) {
+            for (auto d : ant_sticks)
+                libusb_unref_device(d);
             libusb_free_device_list(devs, 1);
             throw LibusbError("libusb_get_device_descriptor", r);
         }
@@ -620,15 +591,29 @@ libusb_device* FindAntStick()
             if (desc.idVendor == ant_stick_devid[i].vid
                 && desc.idProduct == ant_stick_devid[i].pid)
             {
-                ant_stick = dev;
-                libusb_ref_device(ant_stick);
-                found_it = true;
+                libusb_ref_device(dev);
+                ant_sticks.push_back(dev);
                 break;
             }
         }
     }
     libusb_free_device_list(devs, 1);
 #endif
+    return ant_sticks;
+}
+
+/** Find the USB device for the first ANT stick.  Return nullptr if not found,
+ * throws an exception if there is a problem with the lookup.
+ */
+libusb_device* FindAntStick()
+{
+    libusb_device *ant_stick = nullptr; // the one we are looking for
+    for (auto dev : FindAntSticks()) {
+        if (ant_stick)
+            libusb_unref_device(dev);
+        else
+            ant_stick = dev;
+    }
     return ant_stick;
 }
 
@@ -708,18 +693,18 @@ void GetAntStickReadWriteEndpoints(
     }
 }
 
-AntStick::AntStick()
-    : m_Device (nullptr),
-      m_DeviceHandle (nullptr),
-      m_SerialNumber (0),
-      m_Version (""),
-      m_MaxNetworks (-1),
-      m_MaxChannels (-1),
-      m_Network(-1),
-      m_ChannelsWaitingCraetion()
+// .................................................... LibusbTransport ....
+
+LibusbTransport::LibusbTransport()
+    : LibusbTransport(FindAntStick())
+{
+}
+
+LibusbTransport::LibusbTransport(libusb_device *device)
+    : m_Device (device),
+      m_DeviceHandle (nullptr)
 {
     try {
-        m_Device = FindAntStick();
 #if !defined (FAKE_CALL)
         if (! m_Device)
         {
@@ -753,39 +738,159 @@ AntStick::AntStick()
         m_Writer = std::unique_ptr<AntMessageWriter>(
             new AntMessageWriter(write_endpoint));
 #endif
-        Reset();
-        QueryInfo();
-
-        m_LastReadMessage.reserve (1024);
     }
     catch (...)
     {
         // Need to clean up, as no one will do it for us....
-        m_Reader = std::move (std::unique_ptr<AntMessageReader>());
-        m_Writer = std::move (std::unique_ptr<AntMessageWriter>());
-        if (m_DeviceHandle)
-            libusb_close(m_DeviceHandle);
-        libusb_unref_device(m_Device);
+        Close();
         throw;
     }
 }
 
-AntStick::~AntStick()
+LibusbTransport::~LibusbTransport()
+{
+    // The event thread might be gone already, clean up the transfers
+    // ourselves.
+    SetEventDriven(false);
+    Close();
+}
+
+void LibusbTransport::Close()
 {
     m_Reader = std::move (std::unique_ptr<AntMessageReader>());
     m_Writer = std::move (std::unique_ptr<AntMessageWriter>());
+    if (m_DeviceHandle)
+        libusb_close(m_DeviceHandle);
+    m_DeviceHandle = nullptr;
+    if (m_Device)
+        libusb_unref_device(m_Device);
+    m_Device = nullptr;
+}
+
+std::vector<std::unique_ptr<AntTransport>> LibusbTransport::OpenAll()
+{
+    std::vector<std::unique_ptr<AntTransport>> transports;
+#if !defined (FAKE_CALL)
+    for (auto dev : FindAntSticks()) {
+        try {
+            transports.push_back(
+                std::unique_ptr<AntTransport>(new LibusbTransport(dev)));
+        }
+        catch (std::exception &e) {
+            // The transport released `dev' already
+            LOG_MSG("Skipping ANT stick: "); LOG_MSG("%s", e.what()); LOG_MSG("\n");
+        }
+    }
+#else
+    transports.push_back(std::unique_ptr<AntTransport>(new LibusbTransport()));
+#endif
+    return transports;
+}
+
+bool LibusbTransport::IsAntStick(libusb_device *device)
+{
+#if !defined (FAKE_CALL)
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) < 0)
+        return false;
+
+    for (int i = 0; i < num_ant_stick_devid; ++i)
+    {
+        if (desc.idVendor == ant_stick_devid[i].vid
+            && desc.idProduct == ant_stick_devid[i].pid)
+            return true;
+    }
+#endif
+    return false;
+}
+
+void LibusbTransport::WriteMessage(const AntMessage &message)
+{
+    m_Writer->WriteMessage(message);
+}
+
+void LibusbTransport::MaybeGetNextMessage(Buffer &message)
+{
+    m_Reader->MaybeGetNextMessage(message, m_ReadTimeout);
+    m_LastArrival = m_Reader->GetLastArrival();
+}
+
+void LibusbTransport::HandleEvents()
+{
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 1000;
+    int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+    if (r < 0)
+        throw LibusbError("libusb_handle_events", r);
+}
+
+void LibusbTransport::SetEventDriven(bool event_driven)
+{
+    if (m_Reader)
+        m_Reader->SetEventDriven(event_driven);
+    if (m_Writer)
+        m_Writer->SetEventDriven(event_driven);
+}
+
+void LibusbTransport::SetReceiveSignal(UpdateSignal *signal)
+{
+    if (m_Reader)
+        m_Reader->SetReceiveSignal(signal);
+}
+
+// ....................................................... AntTransport ....
+
+/** Fill `message' with the next available message.  If no message is
+ * received within a small amount of time, a timeout exception will be
+ * thrown.
+ */
+void AntTransport::GetNextMessage(Buffer &message)
+{
+    MaybeGetNextMessage(message);
+    if (message.empty())
+        throw std::runtime_error("AntTransport -- timed out");
+}
+
+// ........................................................... AntStick ....
+
+AntStick::AntStick()
+    : AntStick(std::unique_ptr<AntTransport>(new LibusbTransport()))
+{
+}
+
+AntStick::AntStick(std::unique_ptr<AntTransport> transport)
+    : m_Transport (std::move (transport)),
+      m_SerialNumber (0),
+      m_Version (""),
+      m_MaxNetworks (-1),
+      m_MaxChannels (-1),
+      m_Network(-1),
+      m_EventDriven(false),
+      m_Failed(false),
+      m_LastReadArrival(0),
+      m_ChannelsWaitingCraetion()
+{
+    Reset();
+    QueryInfo();
+
+    m_LastReadMessage.reserve (1024);
+}
+
+AntStick::~AntStick()
+{
     m_ChannelsWaitingCraetion.clear();
     m_ChannelsWaitingCraetion.shrink_to_fit();
-    libusb_close(m_DeviceHandle);
-    libusb_unref_device(m_Device);
 }
 
-void AntStick::WriteMessage(const Buffer &b)
+void AntStick::WriteMessage(const AntMessage &b)
 {
     LOG_MSG("WriteMessage:");
     for (auto c : b) LOG_MSG(" %x ", c);
     LOG_MSG("\n");
-    m_Writer->WriteMessage (b);
+    if (m_Failed)
+        throw std::runtime_error("AntStick -- stick has failed");
+    m_Transport->WriteMessage (b);
 }
 
 const Buffer& AntStick::ReadMessage()
@@ -801,11 +906,13 @@ const Buffer& AntStick::ReadMessage()
     };
     
     for(;;) {
-        m_Reader->GetNextMessage(m_LastReadMessage);
-        if (SetAsideMessage(m_LastReadMessage))
-            m_DelayedMessages.push(m_LastReadMessage);
-        else
+        m_Transport->GetNextMessage(m_LastReadMessage);
+        if (SetAsideMessage(m_LastReadMessage)) {
+            ReceivedMessage m = { m_LastReadMessage, LastArrival() };
+            m_DelayedMessages.push(m);
+        } else {
             return m_LastReadMessage;
+        }
     }
 }
 
@@ -861,26 +968,151 @@ void AntStick::QueryInfo()
     m_MaxChannels = 4; //for 2 sessions
     m_MaxNetworks = 1;
 #endif
+
+    InitChannelTable();
+}
+
+/** Size the channel table for the number of channels the stick has, all of
+ * them free.
+ */
+void AntStick::InitChannelTable()
+{
+    m_Channels.assign(m_MaxChannels, nullptr);
+    m_FreeChannels.assign((m_MaxChannels + 31) / 32, 0);
+    m_ClosingChannels.assign((m_MaxChannels + 31) / 32, 0);
+    for (int i = 0; i < m_MaxChannels; ++i)
+        m_FreeChannels[i / 32] |= uint32_t(1) << (i % 32);
 }
 
 void AntStick::RegisterChannel (AntChannel *c)
 {
-    m_Channels.push_back (c);
+    int n = c->m_ChannelNumber;
+    m_Channels[n] = c;
+    m_FreeChannels[n / 32] &= ~(uint32_t(1) << (n % 32));
 }
 
-void AntStick::UnregisterChannel (AntChannel *c)
+/** Remove `c' from the channel table.  If `unassign' is true, the channel is
+ * unassigned on the stick, after closing it first if `close' is true, and its
+ * channel number becomes free once the stick confirmed the unassign, so
+ * messages still arriving for the old channel are not delivered to a new one.
+ *
+ * The stick only accepts UNASSIGN_CHANNEL once the channel is closed, which
+ * it reports with EVENT_CHANNEL_CLOSED some time after responding to
+ * CLOSE_CHANNEL, see MaybeFinishClose().
+ */
+void AntStick::UnregisterChannel (AntChannel *c, bool close, bool unassign)
 {
-    auto i = std::find (m_Channels.begin(), m_Channels.end(), c);
-    m_Channels.erase(i);
+    int n = c->m_ChannelNumber;
+    if (n < 0 || n >= static_cast<int>(m_Channels.size()) || m_Channels[n] != c)
+        return;
+
+    m_Channels[n] = nullptr;
+
+    // Responses to commands sent by the channel will still arrive, but there
+    // is nobody to tell about them anymore, except for an unassign the
+    // channel started, which decides when the number is free.
+    bool unassigning = false;
+    for (auto &p : m_PendingCommands) {
+        if (p.owner == c) {
+            p.owner = nullptr;
+            if (p.message_id == UNASSIGN_CHANNEL) {
+                p.callback = [this, n](AntChannelEvent status) { ChannelUnassigned(n, status); };
+                unassigning = true;
+            } else {
+                p.callback = nullptr;
+            }
+        }
+    }
+
+    if (unassigning)
+        return;
+    if (! unassign) {
+        FreeChannelNumber(n);
+        return;
+    }
+    if (! close) {
+        UnassignChannel(n);
+        return;
+    }
+
+    const uint32_t bit = uint32_t(1) << (n % 32);
+    m_ClosingChannels[n / 32] |= bit;
+    try {
+        SendCommand(MakeMessage(CLOSE_CHANNEL, n), [this, n, bit](AntChannelEvent status) {
+            // EVENT_CHANNEL_CLOSED follows a successful close.  Otherwise
+            // the channel was closed already (and MaybeFinishClose() may
+            // have seen the event), or the stick did not respond.
+            if (status == RESPONSE_NO_ERROR || (m_ClosingChannels[n / 32] & bit) == 0)
+                return;
+            m_ClosingChannels[n / 32] &= ~bit;
+            if (m_Failed)
+                FreeChannelNumber(n);
+            else
+                UnassignChannel(n);
+        });
+    }
+    catch (std::exception &) {
+        m_ClosingChannels[n / 32] &= ~bit;
+        FreeChannelNumber(n);
+    }
 }
 
+/** If `message' is the EVENT_CHANNEL_CLOSED of a channel closed by
+ * UnregisterChannel(), unassign that channel and return true.
+ */
+bool AntStick::MaybeFinishClose(const Buffer &message)
+{
+    if (message.size() < 6 || message[2] != CHANNEL_RESPONSE || message[4] != 1
+        || message[5] != EVENT_CHANNEL_CLOSED)
+        return false;
+
+    unsigned n = message[3];
+    const uint32_t bit = uint32_t(1) << (n % 32);
+    if (n >= m_Channels.size() || (m_ClosingChannels[n / 32] & bit) == 0)
+        return false;
+
+    m_ClosingChannels[n / 32] &= ~bit;
+    UnassignChannel(static_cast<int>(n));
+    return true;
+}
+
+/** Unassign channel number `n', which is no longer used by a channel, and
+ * free it once that is done.
+ */
+void AntStick::UnassignChannel (int n)
+{
+    try {
+        SendCommand(MakeMessage(UNASSIGN_CHANNEL, n),
+                    [this, n](AntChannelEvent status) { ChannelUnassigned(n, status); });
+    }
+    catch (std::exception &) {
+        FreeChannelNumber(n);
+    }
+}
+
+/** Free channel number `n' if the stick confirmed unassigning it, or if
+ * the stick failed and the number won't be used on it again.  A number the
+ * stick refused to unassign stays taken, assigning it again would fail.
+ */
+void AntStick::ChannelUnassigned (int n, AntChannelEvent status)
+{
+    if (status == RESPONSE_NO_ERROR || m_Failed)
+        FreeChannelNumber(n);
+}
+
+void AntStick::FreeChannelNumber (int n)
+{
+    m_FreeChannels[n / 32] |= uint32_t(1) << (n % 32);
+}
+
+/** Return the lowest free channel number, or -1 if all channels are in use.
+ * The channel is only taken once it is registered.
+ */
 int AntStick::NextChannelId() const
 {
-    int id = 0;
-    for (int i = 0; i < m_MaxChannels; ++i) {
-        auto channel_it = std::find_if(m_Channels.begin(), m_Channels.end(), [i](const AntChannel * item) { return item->m_ChannelNumber == i;  });
-        if (channel_it == m_Channels.end())
-            return i;
+    for (size_t w = 0; w < m_FreeChannels.size(); ++w) {
+        if (m_FreeChannels[w])
+            return static_cast<int>(w * 32) + LowestSetBit(m_FreeChannels[w]);
     }
     return -1;
 }
@@ -890,66 +1122,325 @@ void AntStick::SetNetworkKey (uint8_t key[8])
     uint8_t network = 0;          // always open network 0 for now
 
     m_Network = -1;
-    Buffer nkey;
-    nkey.push_back (network);
-    nkey.insert (nkey.end(), &key[0], &key[8]);
-    WriteMessage (MakeMessage (SET_NETWORK_KEY, nkey));
-    Buffer response = ReadMessage();
-    CheckChannelResponse (response, network, SET_NETWORK_KEY, 0);
+    ExecuteCommand (MakeMessage (SET_NETWORK_KEY, network,
+                                 key[0], key[1], key[2], key[3],
+                                 key[4], key[5], key[6], key[7]));
     m_Network = network;
     LOG_MSG("SetNetworkKey: %d\n", network);
 }
 
-bool AntStick::MaybeProcessMessage(const Buffer &message)
+/** Send `command' and call `cb' with the status from the CHANNEL_RESPONSE
+ * for it, once Tick() receives it.  The response is matched by the channel
+ * number (the first data byte of the command) and message ID.  If no response
+ * arrives within TIMEOUT milliseconds, `cb' is called with RESPONSE_TIMEOUT.
+ * `owner' is the channel the command is for: callbacks are dropped if it is
+ * destroyed.
+ */
+void AntStick::SendCommand(const AntMessage &command, CommandCallback cb, AntChannel *owner)
+{
+    WriteMessage(command);
+#if !defined(FAKE_CALL)
+    PendingCommand p;
+    p.channel = command.size() > 4 ? command[3] : 0;
+    p.message_id = command[2];
+    p.callback = cb;
+    p.owner = owner;
+    p.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TIMEOUT);
+    m_PendingCommands.push_back(p);
+#else
+    if (cb)
+        cb(RESPONSE_NO_ERROR);
+#endif
+}
+
+/** Send `command', the returned future becomes ready when its response was
+ * received.  Someone needs to call Tick() for that to happen, so don't wait
+ * for the future on the thread which does.
+ */
+std::future<AntChannelEvent> AntStick::SendCommand(const AntMessage &command)
+{
+    auto promise = std::make_shared<std::promise<AntChannelEvent>>();
+    SendCommand(command, [promise](AntChannelEvent status) {
+        promise->set_value(status);
+    });
+    return promise->get_future();
+}
+
+/** Send `command' and wait for its response, calling Tick() meanwhile, so
+ * other messages are still delivered.  Throws an exception if the command
+ * fails.
+ */
+void AntStick::ExecuteCommand(const AntMessage &command)
+{
+    struct Result {
+        bool done;
+        AntChannelEvent status;
+    };
+    auto result = std::make_shared<Result>();
+    result->done = false;
+    result->status = RESPONSE_NO_ERROR;
+
+    SendCommand(command, [result](AntChannelEvent status) {
+        result->done = true;
+        result->status = status;
+    });
+
+    while (! result->done)
+        Tick();
+
+    if (result->status != RESPONSE_NO_ERROR)
+        throw std::runtime_error(
+            std::string("AntStick -- command failed: ") + ChannelEventAsString(result->status));
+}
+
+/** If `message' is the response to a command sent with SendCommand(),
+ * complete that command and return true.
+ */
+bool AntStick::MaybeCompleteCommand(const Buffer &message)
+{
+    // Message ID 1 marks channel events, which are not command responses.
+    if (message.size() < 6 || message[2] != CHANNEL_RESPONSE || message[4] == 1)
+        return false;
+
+    for (auto i = m_PendingCommands.begin(); i != m_PendingCommands.end(); ++i) {
+        if (i->channel == message[3] && i->message_id == message[4]) {
+            // The callback might send more commands, take it out first.
+            CommandCallback cb = std::move(i->callback);
+            m_PendingCommands.erase(i);
+            if (cb)
+                cb(static_cast<AntChannelEvent>(message[5]));
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Complete the commands which have not received a response in time with
+ * RESPONSE_TIMEOUT.
+ */
+void AntStick::CheckCommandTimeouts()
+{
+    if (m_PendingCommands.empty())
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+    std::vector<CommandCallback> expired;
+    for (auto i = m_PendingCommands.begin(); i != m_PendingCommands.end(); ) {
+        if (i->deadline <= now) {
+            expired.push_back(std::move(i->callback));
+            i = m_PendingCommands.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    for (auto &cb : expired) {
+        if (cb)
+            cb(RESPONSE_TIMEOUT);
+    }
+}
+
+/** Return the arrival time of the message just read from the transport, or
+ * the current time if the transport can't tell.
+ */
+uint64_t AntStick::LastArrival() const
+{
+    uint64_t arrival = m_Transport->GetLastArrival();
+    return arrival ? arrival : CurrentNanoseconds();
+}
+
+bool AntStick::MaybeProcessMessage(const Buffer &message, uint64_t arrival)
 {
     if (message.size() < 4)
         throw std::runtime_error("Process wrong message");
-    auto channel = message[3];
+
+    if (MaybeCompleteCommand(message))
+        return true;
+    unsigned channel = message[3];
 
     if (message[2] == BURST_TRANSFER_DATA)
         channel = message[3] & 0x1f;
 
-    for(auto i = m_Channels.begin(); i != m_Channels.end(); ++i) {
-        if ((*i)->m_ChannelNumber == channel)
-        {
-            (*i)->HandleMessage (&message[0], (int)message.size());
-            return true;
-        }
-    }
+    AntChannel *c = channel < m_Channels.size() ? m_Channels[channel] : nullptr;
+    if (c == nullptr)
+        return MaybeFinishClose(message);
 
-    return false;
+    c->HandleMessage (&message[0], (int)message.size(), arrival);
+    return true;
 }
 
-void AntStick::Tick()
+/** Process the next received message, waiting up to the read timeout for
+ * one.  Returns true if there was a message.
+ */
+bool AntStick::Tick()
 {
     if (m_DelayedMessages.empty())
     {
-        m_Reader->MaybeGetNextMessage(m_LastReadMessage);
+        m_Transport->MaybeGetNextMessage(m_LastReadMessage);
+        if (! m_LastReadMessage.empty())
+            m_LastReadArrival = LastArrival();
     }
     else
     {
-        m_LastReadMessage = m_DelayedMessages.front();
+        m_LastReadMessage.swap(m_DelayedMessages.front().data);
+        m_LastReadArrival = m_DelayedMessages.front().arrival;
         m_DelayedMessages.pop();
     }
 
-    if (m_LastReadMessage.empty()) return;
+    CheckCommandTimeouts();
+
+    if (m_LastReadMessage.empty()) return false;
 
-    if (! MaybeProcessMessage (m_LastReadMessage))
+    if (! MaybeProcessMessage (m_LastReadMessage, m_LastReadArrival))
     {
 #if defined DEBUG_DUMP
         std::cerr << "Unprocessed message:\n";
         DumpData (&m_LastReadMessage[0], m_LastReadMessage.size(), std::cerr);
 #endif
     }
+    return true;
+}
+
+/** Like Tick(), but only process a message the transport already has,
+ * without waiting for one.  AntStickPool uses this to serve all its sticks
+ * and wait for them at once.
+ */
+bool AntStick::Poll()
+{
+    unsigned timeout = m_Transport->GetReadTimeout();
+    m_Transport->SetReadTimeout(0);
+    bool received;
+    try {
+        received = Tick();
+    }
+    catch (...) {
+        m_Transport->SetReadTimeout(timeout);
+        throw;
+    }
+    m_Transport->SetReadTimeout(timeout);
+    return received;
+}
+
+/** Let the transport process pending I/O, see TickAntStick().
+ */
+void AntStick::HandleEvents()
+{
+    m_Transport->HandleEvents();
+}
+
+/** Put the transport in event driven mode.  See LibusbEventThread.
+ */
+void AntStick::SetEventDriven(bool event_driven)
+{
+    m_EventDriven = event_driven;
+    m_Transport->SetEventDriven(event_driven);
+}
+
+/** Set how long Tick() waits for a message, see
+ * AntTransport::SetReadTimeout().
+ */
+void AntStick::SetReadTimeout(unsigned milliseconds)
+{
+    m_Transport->SetReadTimeout(milliseconds);
+}
+
+/** See AntTransport::SetReceiveSignal().
+ */
+void AntStick::SetReceiveSignal(UpdateSignal *signal)
+{
+    m_Transport->SetReceiveSignal(signal);
+}
+
+/** Return the number of channels available for new AntChannel instances.
+ */
+int AntStick::GetFreeChannels() const
+{
+    int count = 0;
+    for (uint32_t word : m_FreeChannels) {
+        for (; word != 0; word &= word - 1)
+            count++;
+    }
+    return count;
+}
+
+void AntStick::Fail()
+{
+    if (m_Failed)
+        return;
+    m_Failed = true;
+
+    // No responses will arrive anymore.  The callbacks might unregister
+    // channels, take the commands out first.
+    std::deque<PendingCommand> pending;
+    pending.swap(m_PendingCommands);
+    for (auto &p : pending) {
+        if (p.callback)
+            p.callback(RESPONSE_TIMEOUT);
+    }
+
+    // Nor will the EVENT_CHANNEL_CLOSED of channels being closed.
+    for (size_t w = 0; w < m_ClosingChannels.size(); ++w) {
+        m_FreeChannels[w] |= m_ClosingChannels[w];
+        m_ClosingChannels[w] = 0;
+    }
+
+    for (auto c : m_Channels) {
+        if (c)
+            c->ChangeState(AntChannel::CH_CLOSED);
+    }
 }
 
 void TickAntStick(AntStick *s)
 {
     s->Tick();
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 1000;
-    int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
-    if (r < 0)
-        throw LibusbError("libusb_handle_events", r);
+    if (s->IsEventDriven())
+        return;                         // LibusbEventThread does this for us
+    s->HandleEvents();
+}
+
+// .................................................. LibusbEventThread ....
+
+LibusbEventThread::LibusbEventThread(libusb_context *ctx)
+    : m_Context(ctx),
+      m_StopRequested(0)
+{
+    m_Thread = std::thread(&LibusbEventThread::Run, this);
+}
+
+LibusbEventThread::~LibusbEventThread()
+{
+    Stop();
+}
+
+void LibusbEventThread::Stop()
+{
+    if (! m_Thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(m_StopLock);
+        m_StopRequested = 1;
+    }
+    m_StopSignal.notify_all();
+    libusb_interrupt_event_handler(m_Context);
+    m_Thread.join();
+}
+
+void LibusbEventThread::Run()
+{
+    // Stop() interrupts the event handler after setting the flag, so it is
+    // enough to check it each time libusb returns.
+    unsigned backoff = 0;
+    while (! m_StopRequested) {
+        int r = libusb_handle_events_completed(m_Context, nullptr);
+        if (r >= 0 || r == LIBUSB_ERROR_INTERRUPTED) {
+            backoff = 0;
+            continue;
+        }
+        LOG_MSG("%s\n", LibusbError("libusb_handle_events", r).what());
+        // Errors like LIBUSB_ERROR_NO_DEVICE or LIBUSB_ERROR_IO are likely
+        // to be returned again straight away.
+        backoff = (std::min)((std::max)(backoff * 2, 10u), unsigned(MAX_ERROR_BACKOFF));
+        std::unique_lock<std::mutex> lock(m_StopLock);
+        m_StopSignal.wait_for(lock, std::chrono::milliseconds(backoff),
+                              [this] { return m_StopRequested != 0; });
+    }
 }
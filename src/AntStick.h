@@ -18,11 +18,20 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <queue>
+#include <deque>
+#include <functional>
 #include <stdint.h>
 #include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <future>
 #include "Mock.h"
+#include "UpdateSignal.h"
 
 // TODO: move libusb in the C++ file
 #pragma warning (push)
@@ -36,6 +45,7 @@ typedef std::vector<uint8_t> Buffer;
 
 class AntMessageReader;
 class AntMessageWriter;
+class AntTransport;
 class AntStick;
 
 enum AntMessageId {
@@ -132,18 +142,88 @@ enum AntChannelEvent {
     NVM_WRITE_ERROR = 65,
     USB_STRING_WRITE_FAIL = 112,
     MESG_SERIAL_ERROR_ID = 174,
+    // Not sent by the stick: no response was received for a command, see
+    // AntStick::SendCommand()
+    RESPONSE_TIMEOUT = 0xfe,
     LAST_EVENT_ID = 0xff
 };
 
 const char *ChannelEventAsString(AntChannelEvent e);
 
 
+// ......................................................... AntMessage ....
+
+/**
+    * An ANT message sent to the stick: SYNC, LEN, MSGID, DATA and CHECKSUM.
+    * The messages we send have at most 9 data bytes, so they are stored inline
+    * and building or copying one does not allocate.  The constructor is
+    * constexpr, fixed messages can be built at compile time:
+    *
+    *     constexpr AntMessage reset(RESET_SYSTEM, 0);
+    */
+class AntMessage
+{
+public:
+    enum {
+        MAX_DATA_SIZE = 9,
+        MAX_SIZE = MAX_DATA_SIZE + 4
+    };
+
+    constexpr AntMessage()
+        : m_Bytes{}, m_Size(0)
+    {
+    }
+
+    template <typename... Data>
+    constexpr AntMessage(AntMessageId id, Data... data)
+        : m_Bytes{
+            static_cast<uint8_t>(SYNC_BYTE),
+            static_cast<uint8_t>(sizeof...(Data)),
+            static_cast<uint8_t>(id),
+            static_cast<uint8_t>(data)...,
+            Checksum(SYNC_BYTE, sizeof...(Data), id, data...) },
+          m_Size(static_cast<uint8_t>(sizeof...(Data) + 4))
+    {
+        static_assert(sizeof...(Data) <= MAX_DATA_SIZE, "ANT message too long");
+    }
+
+    constexpr const uint8_t *data() const { return m_Bytes; }
+    uint8_t *data() { return m_Bytes; }
+    constexpr unsigned size() const { return m_Size; }
+    constexpr const uint8_t *begin() const { return m_Bytes; }
+    constexpr const uint8_t *end() const { return m_Bytes + m_Size; }
+    constexpr const uint8_t& operator[] (unsigned i) const { return m_Bytes[i]; }
+
+private:
+    static constexpr uint8_t Checksum() { return 0; }
+
+    template <typename T, typename... Rest>
+    static constexpr uint8_t Checksum(T first, Rest... rest)
+    {
+        return static_cast<uint8_t>(static_cast<uint8_t>(first) ^ Checksum(rest...));
+    }
+
+    uint8_t m_Bytes[MAX_SIZE];
+    uint8_t m_Size;
+};
+
+
 // ......................................................... AntChannel ....
 
 enum TransmissionType {
     ANT_INDEPENDENT_CHANNEL = 0x01
 };
 
+/** Extended data appended to received data messages, enabled with LIB_CONFIG.
+    * The flag byte following the 8 byte payload has the bits set for the data
+    * which follows it, in this order.
+    */
+enum ExtendedDataFlags {
+    EXT_CHANNEL_ID = 0x80,      // device number (2 bytes), device type, transmission type
+    EXT_RSSI = 0x40,            // measurement type, RSSI in dBm, threshold
+    EXT_RX_TIMESTAMP = 0x20     // 2 byte rollover counter, 1/32768 seconds
+};
+
 /**
     * Represents an ANT communication channel managed by the AntStick class.
     * This class represents the "slave" endpoint, the master being the
@@ -160,6 +240,7 @@ class AntChannel
 public:
 
     friend class AntStick;
+    friend class AntScanChannel;
 
     /** The Channel ID identifies the master we want to pair up with. In ANT+
         * terminology, a master is the actual sensor sending data, like a Heart
@@ -208,22 +289,53 @@ public:
         uint8_t frequency);
     virtual ~AntChannel();
 
+    /** True if this channel is not assigned on a stick, but decodes messages
+        * passed to it by an AntScanChannel. */
+    bool IsDetached() const { return m_Stick == nullptr; }
+
     void RequestClose();
     void RequestUnassign();
     State ChannelState() const { return m_State; }
     Id ChannelId() const { return m_ChannelId; }
     std::condition_variable wasChannelOpen;
 
+    /** Notify `signal' each time the channel has decoded new readings, so
+        * other threads can wait for them instead of polling.  The signal
+        * can be shared by many channels and must outlive this one.
+        */
+    void SetUpdateSignal(UpdateSignal *signal) { m_UpdateSignal = signal; }
+
 protected:
     /* Derived classes can use these methods. */
 
+    /** How the channel is opened on the stick. */
+    enum OpenMode {
+        OPEN_TRACKING,          // OPEN_CHANNEL, pair up with a single master
+        OPEN_SCAN               // OPEN_RX_SCAN_MODE, receive from all masters
+    };
+
+    AntChannel(AntStick *stick,
+        Id channel_id,
+        unsigned period,
+        uint8_t timeout,
+        uint8_t frequency,
+        OpenMode open_mode);
+
+    /** Create a detached channel for the master identified by `channel_id'.
+        * It is not assigned on any stick and is considered open, an
+        * AntScanChannel passes it the messages received from that master.
+        * Detached channels cannot transmit, acknowledged data sent on them is
+        * discarded.
+        */
+    explicit AntChannel(Id channel_id);
+
     /** Send 'message' as an acknowledged message.  The actual message will
         * not be sent immediately (they can only be sent shortly after a
         * broadcast message is received).  OnAcknowledgedDataReply() will be
         * called with 'tag' and the result of the transmission.  If the
         * transmission fails, it will not be retried.
         */
-    void SendAcknowledgedData(int tag, const Buffer &message);
+    void SendAcknowledgedData(int tag, const uint8_t message[8]);
 
     /** Ask a master device to transmit data page identified by 'page_id'.
         * The master will only send some data pages are only sent when requested
@@ -236,6 +348,22 @@ protected:
         */
     void RequestDataPage(uint8_t page_id, int transmit_count = 4);
 
+    /** CurrentNanoseconds() when the message being handled arrived at the
+        * host, see AntTransport::GetLastArrival().  Valid in
+        * OnMessageReceived(), it is more accurate than reading the clock
+        * there, as messages can wait in the stick's queues.
+        */
+    uint64_t MessageArrival() const { return m_MessageArrival; }
+
+    /** Tell whoever waits on the update signal that new readings are
+        * available.  Call this after publishing them.
+        */
+    void NotifyUpdate()
+    {
+        if (m_UpdateSignal)
+            m_UpdateSignal->Notify();
+    }
+
 private:
     void InternalInit(AntStick *stick);
     /* Derived classes will need to override these methods */
@@ -275,10 +403,13 @@ private:
         * SendAcknowledgedData() queues them up.
         */
     struct AckDataItem {
-        AckDataItem(int t, const Buffer &d)
-            : tag(t), data(d) {}
+        AckDataItem(int t, const uint8_t d[8])
+            : tag(t)
+        {
+            std::copy(d, d + 8, data);
+        }
         int tag;
-        Buffer data;
+        uint8_t data[8];
     };
 
     /** Queue of ACKNOWLEDGE_DATA messages waiting to be sent.
@@ -295,13 +426,21 @@ private:
         */
     bool m_IdReqestOutstanding;
 
+    /** When true, the channel was (or is being) assigned on the stick and
+        * needs to be unassigned before its channel number can be reused. */
+    bool m_Assigned;
+
+    OpenMode m_OpenMode;
+    UpdateSignal *m_UpdateSignal;
+    uint64_t m_MessageArrival;
     AntStick *m_Stick;
     unsigned m_period;
     uint8_t m_timeout;
     uint8_t m_frequency;
 
     void Configure();
-    void HandleMessage(const uint8_t *data, int size);
+    void SendCommand(const AntMessage &command);
+    void HandleMessage(const uint8_t *data, int size, uint64_t arrival);
     void MaybeSendAckData();
     void OnChannelResponseMessage(const uint8_t *data, int size);
     void OnChannelIdMessage(const uint8_t *data, int size);
@@ -320,6 +459,57 @@ public:
 };
 
 
+// ....................................................... AntTransport ....
+
+/**
+    * Moves framed ANT messages between an AntStick and the device implementing
+    * the stick side of the protocol.  LibusbTransport talks to a real USB
+    * stick, other implementations allow running the whole stack without
+    * hardware.
+    */
+class AntTransport
+{
+public:
+    AntTransport() : m_ReadTimeout(TIMEOUT), m_LastArrival(0) {}
+    virtual ~AntTransport() {}
+
+    /** Send `message' to the stick, this must not block for long. */
+    virtual void WriteMessage(const AntMessage &message) = 0;
+
+    /** Fill `message' with the next available message.  If no message is
+        * received within the read timeout, an empty buffer is returned. */
+    virtual void MaybeGetNextMessage(Buffer &message) = 0;
+
+    /** Process pending I/O when nobody else does, called by TickAntStick()
+        * unless the transport is event driven. */
+    virtual void HandleEvents() {}
+
+    /** See AntStick::SetEventDriven() */
+    virtual void SetEventDriven(bool) {}
+
+    /** Notify `signal' whenever data arrives from the stick, so a caller
+        * polling several transports can sleep until one of them has
+        * something to read.  Transports which can't tell ignore this. */
+    virtual void SetReceiveSignal(UpdateSignal *) {}
+
+    void GetNextMessage(Buffer &message);
+
+    /** Set how long MaybeGetNextMessage() waits for a message, TIMEOUT
+        * milliseconds by default. */
+    void SetReadTimeout(unsigned milliseconds) { m_ReadTimeout = milliseconds; }
+    unsigned GetReadTimeout() const { return m_ReadTimeout; }
+
+    /** CurrentNanoseconds() when the message last returned by
+        * MaybeGetNextMessage() arrived, taken as close to the device as the
+        * transport can, or 0 if the transport does not know. */
+    uint64_t GetLastArrival() const { return m_LastArrival; }
+
+protected:
+    unsigned m_ReadTimeout;
+    uint64_t m_LastArrival;
+};
+
+
 /**
     * Represents the physical USB ANT Stick used to communicate with ANT+
     * devices.  An ANT Stick manages one or more AntChannel instances.  The
@@ -327,7 +517,13 @@ public:
     * messages and distribute them to the AntChannel instances.  In addition to
     * that, `libusb_handle_events_timeout_completed` or equivalent needs to be
     * called periodically to allow libusb to process messages.  See also
-    * `TickAntStick()`
+    * `TickAntStick()`.  Alternatively, libusb events can be processed by a
+    * LibusbEventThread, in which case SetEventDriven(true) needs to be called
+    * and Tick() will simply wait for the next message.
+    *
+    * Commands are sent with SendCommand() and their responses are matched as
+    * Tick() receives them, so many commands can be in flight while broadcast
+    * data keeps being delivered.  AntChannel sets itself up this way.
     *
     * @hint Don't forget to call libusb_init() somewhere in your program before
     * using this class.
@@ -338,6 +534,7 @@ class AntStick
 
 public:
     AntStick();
+    explicit AntStick(std::unique_ptr<AntTransport> transport);
     ~AntStick();
 
     void SetNetworkKey(uint8_t key[8]);
@@ -347,11 +544,38 @@ public:
     int GetMaxNetworks() const { return m_MaxNetworks; }
     int GetMaxChannels() const { return m_MaxChannels; }
     int GetNetwork() const { return m_Network; }
+    int GetFreeChannels() const;
 
-    void WriteMessage(const Buffer &b);
+    void WriteMessage(const AntMessage &m);
     const Buffer& ReadMessage();
 
-    void Tick();
+    bool Tick();
+    bool Poll();
+
+    /** Called with the status of the CHANNEL_RESPONSE received for a
+        * command, or with RESPONSE_TIMEOUT if none arrived in time. */
+    typedef std::function<void(AntChannelEvent status)> CommandCallback;
+
+    void SendCommand(const AntMessage &command, CommandCallback cb,
+                     AntChannel *owner = nullptr);
+    std::future<AntChannelEvent> SendCommand(const AntMessage &command);
+    void ExecuteCommand(const AntMessage &command);
+    void HandleEvents();
+
+    void SetEventDriven(bool event_driven);
+    bool IsEventDriven() const { return m_EventDriven; }
+
+    void SetReadTimeout(unsigned milliseconds);
+    void SetReceiveSignal(UpdateSignal *signal);
+
+    /** Mark the stick as failed, e.g. because it was unplugged.  All its
+        * channels are closed and outstanding commands complete with
+        * RESPONSE_TIMEOUT, writing messages throws an exception from now on.
+        * The AntStick must not be destroyed before its channels are. */
+    void Fail();
+    bool IsFailed() const { return m_Failed; }
+
+    AntTransport* GetTransport() const { return m_Transport.get(); }
 
     static uint8_t g_AntPlusNetworkKey[8];
 
@@ -360,13 +584,20 @@ private:
     void Reset();
     void QueryInfo();
     void RegisterChannel(AntChannel *c);
-    void UnregisterChannel(AntChannel *c);
+    void UnregisterChannel(AntChannel *c, bool close, bool unassign);
+    bool MaybeFinishClose(const Buffer &message);
+    void UnassignChannel(int n);
+    void ChannelUnassigned(int n, AntChannelEvent status);
+    void FreeChannelNumber(int n);
+    void InitChannelTable();
     int NextChannelId() const;
 
-    bool MaybeProcessMessage(const Buffer &message);
+    bool MaybeProcessMessage(const Buffer &message, uint64_t arrival);
+    uint64_t LastArrival() const;
+    bool MaybeCompleteCommand(const Buffer &message);
+    void CheckCommandTimeouts();
 
-    libusb_device *m_Device;
-    libusb_device_handle *m_DeviceHandle;
+    std::unique_ptr<AntTransport> m_Transport;
 
     unsigned m_SerialNumber;
     std::string m_Version;
@@ -374,99 +605,356 @@ private:
     int m_MaxChannels;
 
     int m_Network;
+    bool m_EventDriven;
+    bool m_Failed;
 
-    std::queue <Buffer> m_DelayedMessages;
-    Buffer m_LastReadMessage;
+    /** A received message and CurrentNanoseconds() when it arrived. */
+    struct ReceivedMessage {
+        Buffer data;
+        uint64_t arrival;
+    };
 
-    std::unique_ptr<AntMessageReader> m_Reader;
-    std::unique_ptr<AntMessageWriter> m_Writer;
+    std::queue <ReceivedMessage> m_DelayedMessages;
+
+    /** A command sent with SendCommand(), waiting for its CHANNEL_RESPONSE,
+        * which is matched by channel (the first data byte of the command) and
+        * message ID. */
+    struct PendingCommand {
+        uint8_t channel;
+        uint8_t message_id;
+        CommandCallback callback;
+        AntChannel *owner;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    /** Outstanding commands, in the order they were sent.  The stick
+        * processes commands in order, so the first match is the right one. */
+    std::deque<PendingCommand> m_PendingCommands;
+    Buffer m_LastReadMessage;
+    uint64_t m_LastReadArrival;
 
+    /** Registered channels indexed by channel number, nullptr for unused
+        * channel numbers.  Messages are dispatched with a single lookup. */
     std::vector<AntChannel*> m_Channels;
+
+    /** Bitmap with a bit set for each free channel number. */
+    std::vector<uint32_t> m_FreeChannels;
+
+    /** Bitmap of the channel numbers closed by UnregisterChannel(), which
+        * are unassigned once the stick reports EVENT_CHANNEL_CLOSED. */
+    std::vector<uint32_t> m_ClosingChannels;
+
     std::vector<int> m_ChannelsWaitingCraetion;
 };
 
-/** Read ANT messages from an USB device (the ANT stick) */
+/** Fixed capacity circular buffer holding the raw bytes received from the
+    * ANT stick.  Messages are framed and validated in place and only copied
+    * out once they are complete, so dropping garbage while looking for the
+    * sync byte, or consuming a message, just advances the read cursor.
+    */
+class AntMessageRing
+{
+public:
+    /** Must be a power of two, large enough to hold several USB transfers. */
+    enum { CAPACITY = 2048 };
+
+    enum FrameStatus {
+        FRAME_INCOMPLETE,       // not enough data for a full message yet
+        FRAME_OK,               // a valid message was copied out
+        FRAME_BAD_CHECKSUM      // message dropped, sync byte skipped
+    };
+
+    AntMessageRing();
+
+    unsigned Size() const { return m_Write - m_Read; }
+    unsigned Free() const { return CAPACITY - Size(); }
+
+    /** Append `size' bytes of `data', which arrived at `arrival'
+        * (CurrentNanoseconds()). */
+    void Append(const uint8_t *data, unsigned size, uint64_t arrival);
+
+    /** Copy out the next message, `arrival' is set to the time its last
+        * byte arrived. */
+    FrameStatus ExtractMessage(Buffer &message, uint64_t &arrival);
+
+private:
+    /** Track at most this many appends, after that, the latest appends are
+        * merged and their bytes get the time of the last one. */
+    enum { MAX_ARRIVALS = 64 };
+
+    uint8_t At(unsigned offset) const
+    {
+        return m_Data[(m_Read + offset) & (CAPACITY - 1)];
+    }
+
+    uint8_t m_Data[CAPACITY];
+    // Free running cursors, only masked when indexing m_Data.
+    unsigned m_Read;
+    unsigned m_Write;
+
+    /** The bytes up to the cursor `End' arrived at `Time'. */
+    struct Arrival {
+        unsigned End;
+        uint64_t Time;
+    };
+    Arrival m_Arrivals[MAX_ARRIVALS];
+    unsigned m_FirstArrival;
+    unsigned m_ArrivalCount;
+};
+
+/** Read ANT messages from an USB device (the ANT stick).  A pool of bulk
+    * transfers is kept submitted on the IN endpoint at all times, so the
+    * stick can deliver data while earlier reads are still being processed.
+    * Completed transfers are appended to the ring in submission order.
+    *
+    * In event driven mode (see LibusbEventThread), transfers are completed on
+    * another thread and readers just wait for data to arrive, otherwise
+    * readers process libusb events themselves.
+    */
 class AntMessageReader
 {
 public:
-    AntMessageReader(libusb_device_handle *dh, uint8_t endpoint);
+    enum { DEFAULT_TRANSFERS = 4 };
+
+    AntMessageReader(libusb_device_handle *dh, uint8_t endpoint,
+                     int num_transfers = DEFAULT_TRANSFERS);
 #if defined (FAKE_CALL)
     AntMessageReader(uint8_t endpoint)
-        :m_Endpoint(endpoint),
-         m_Transfer(nullptr),
-         m_Mark(0),
-         m_Active(false)
+        : AntMessageReader(nullptr, endpoint)
     {
-        m_Buffer.reserve(1024);
-        m_Transfer = libusb_alloc_transfer(0);
     }
 #endif
     ~AntMessageReader();
 
-    void MaybeGetNextMessage(Buffer &message);
+    void MaybeGetNextMessage(Buffer &message, unsigned timeout = TIMEOUT);
     void GetNextMessage(Buffer &message);
 
+    /** CurrentNanoseconds() when the USB transfer completing the message
+        * last returned by MaybeGetNextMessage() finished. */
+    uint64_t GetLastArrival() const { return m_LastArrival; }
+
+    void SetEventDriven(bool event_driven);
+
+    /** Notify `signal' each time a transfer completes, see
+        * AntTransport::SetReceiveSignal(). */
+    void SetReceiveSignal(UpdateSignal *signal);
+
 private:
 
-    void GetNextMessage1(Buffer &message);
+    enum { READ_SIZE = 128 };
+
+    enum TransferState {
+        TS_IDLE,                // can be submitted
+        TS_ACTIVE,              // submitted to libusb
+        TS_COMPLETED            // done, data not yet moved into the ring
+    };
+
+    struct UsbTransfer {
+        AntMessageReader *reader;
+        libusb_transfer *transfer;
+        TransferState state;
+        uint64_t arrival;       // CurrentNanoseconds() at completion
+        uint8_t data[READ_SIZE];
+    };
+
+    bool GetNextMessage1(Buffer &message);
 
     static void LIBUSB_CALL Trampoline(libusb_transfer *);
-    void SubmitUsbTransfer();
-    void CompleteUsbTransfer(const libusb_transfer *);
+    void SubmitUsbTransfers();
+    bool WaitForUsbTransfer(std::unique_lock<std::mutex> &lock,
+                            std::chrono::steady_clock::time_point deadline);
+    void CompleteUsbTransfer(UsbTransfer *);
+    void DeliverCompletedTransfers();
 
     libusb_device_handle *m_DeviceHandle;
     uint8_t m_Endpoint;
-    libusb_transfer *m_Transfer;
+
+    /** Transfer pool, never resized, as libusb holds pointers into it. */
+    std::vector<UsbTransfer> m_Transfers;
+    unsigned m_NextSubmit;      // index of the next transfer to submit
+    unsigned m_NextDeliver;     // index of the next transfer to deliver
+    unsigned m_Pending;         // submitted, but not delivered transfers
+
+    /** Status of the first failed transfer, reported by the next read.
+        * Transfers are not resubmitted after a failure. */
+    int m_TransferError;
+    bool m_Stopping;
+    bool m_EventDriven;
+
+    /** Protects the transfer pool and the ring, transfers complete on the
+        * libusb event thread in event driven mode. */
+    std::mutex m_Lock;
+    std::condition_variable m_DataReceived;
+    UpdateSignal *m_ReceiveSignal;
 
     /** Hold partial data received from the USB stick.  A single USB read
         * might not return an entire ANT message. */
-    Buffer m_Buffer;
-    unsigned m_Mark;            // buffer position up to where data is available
-    bool m_Active;              // is there a transfer active?
+    AntMessageRing m_Ring;
+
+    uint64_t m_LastArrival;
 };
 
-/** Write ANT messages to a USB device (the ANT stick). */
+/** Write ANT messages to a USB device (the ANT stick).  Writes never block:
+    * messages are queued and sent using a pool of OUT transfers, which are
+    * completed whenever libusb events are processed (for example by
+    * TickAntStick(), while reading messages or by a LibusbEventThread).
+    * Messages are written in the order they were queued.
+    */
 class AntMessageWriter
 {
 public:
-    AntMessageWriter(libusb_device_handle *dh, uint8_t endpoint);
+    enum {
+        DEFAULT_TRANSFERS = 4,
+        DEFAULT_QUEUE_SIZE = 64
+    };
+
+    /** Called from libusb event handling once `message' was written. */
+    typedef std::function<void(const AntMessage &message)> CompletionCallback;
+    /** Called from libusb event handling when writing `message' failed,
+        * `status' is the libusb_transfer_status.  Failed messages are not
+        * retried. */
+    typedef std::function<void(const AntMessage &message, int status)> ErrorCallback;
+
+    AntMessageWriter(libusb_device_handle *dh, uint8_t endpoint,
+                     int num_transfers = DEFAULT_TRANSFERS,
+                     unsigned max_queued = DEFAULT_QUEUE_SIZE);
 #if defined (FAKE_CALL)
     AntMessageWriter(uint8_t endpoint)
-        :m_Endpoint(endpoint),
-         m_Transfer(nullptr),
-         m_Active(false)
+        : AntMessageWriter(nullptr, endpoint)
     {
-        m_Transfer = libusb_alloc_transfer(0);
     }
 #endif
     ~AntMessageWriter();
 
-    void WriteMessage(const Buffer &message);
+    void WriteMessage(const AntMessage &message);
+    bool Flush(uint32_t timeout);
+    unsigned QueuedMessages();
+
+    void SetEventDriven(bool event_driven);
+
+    void SetCompletionCallback(CompletionCallback cb) { m_OnComplete = cb; }
+    void SetErrorCallback(ErrorCallback cb) { m_OnError = cb; }
 
 private:
 
+    struct UsbTransfer {
+        AntMessageWriter *writer;
+        libusb_transfer *transfer;
+        bool active;
+        AntMessage data;
+    };
+
     static void LIBUSB_CALL Trampoline(libusb_transfer *);
-    void SubmitUsbTransfer();
-    void CompleteUsbTransfer(const libusb_transfer *);
+    void SubmitUsbTransfers();
+    void CompleteUsbTransfer(UsbTransfer *);
 
     libusb_device_handle *m_DeviceHandle;
     uint8_t m_Endpoint;
-    libusb_transfer *m_Transfer;
 
-    Buffer m_Buffer;
-    bool m_Active;                      // is there a transfer active?
+    /** Transfer pool, never resized, as libusb holds pointers into it. */
+    std::vector<UsbTransfer> m_Transfers;
+    unsigned m_NextSubmit;      // index of the next transfer to submit
+    unsigned m_Active;          // number of transfers submitted to libusb
+
+    /** Messages waiting for a free transfer, a fixed size ring so queueing
+        * a message never allocates. */
+    std::vector<AntMessage> m_Queue;
+    unsigned m_QueueHead;       // index of the oldest queued message
+    unsigned m_Queued;          // number of queued messages
+
+    /** Status of the first failed transfer, reported by the next write. */
+    int m_TransferError;
+    bool m_EventDriven;
+
+    /** Protects the queue and the transfer pool, transfers complete on the
+        * libusb event thread in event driven mode. */
+    std::mutex m_Lock;
+    std::condition_variable m_DataSent;
+
+    CompletionCallback m_OnComplete;
+    ErrorCallback m_OnError;
+};
+
+/** Transport for an ANT stick plugged into an USB port.  The first stick
+    * found is used, AntStickNotFound is thrown if there is none.
+    */
+class LibusbTransport : public AntTransport
+{
+public:
+    LibusbTransport();
+    /** Open the ANT stick `device', we take over the reference the caller
+        * holds on it. */
+    explicit LibusbTransport(libusb_device *device);
+    ~LibusbTransport();
+
+    /** Open all attached ANT sticks.  Sticks which cannot be opened (e.g.
+        * because another program uses them) are skipped. */
+    static std::vector<std::unique_ptr<AntTransport>> OpenAll();
+
+    /** True if `device' is an ANT stick we know how to talk to. */
+    static bool IsAntStick(libusb_device *device);
+
+    libusb_device* GetDevice() const { return m_Device; }
+
+    void WriteMessage(const AntMessage &message) override;
+    void MaybeGetNextMessage(Buffer &message) override;
+    void HandleEvents() override;
+    void SetEventDriven(bool event_driven) override;
+    void SetReceiveSignal(UpdateSignal *signal) override;
+
+private:
+    void Close();
+
+    libusb_device *m_Device;
+    libusb_device_handle *m_DeviceHandle;
+
+    std::unique_ptr<AntMessageReader> m_Reader;
+    std::unique_ptr<AntMessageWriter> m_Writer;
 };
 
-/** Call libusb_handle_events_timeout_completed() than the AntStick's Tick()
-    * method.  This is an all-in-one function to get the AntStick to work, but it
-    * is only appropriate if the application communicates with a single USB
-    * device.
+/** Call the AntStick's Tick() method than let its transport process events
+    * (libusb_handle_events_timeout_completed() for USB sticks).  This is an
+    * all-in-one function to get the AntStick to work, but it is only
+    * appropriate if the application communicates with a single USB device.
     *
     * @hint Don't forget to call libusb_init() somewhere in your program before
     * using this function.
     */
 void TickAntStick(AntStick *s);
 
+/** Process libusb events on a dedicated thread, which blocks in libusb until
+    * USB transfers complete.  AntStick instances using this need to be put in
+    * event driven mode (AntStick::SetEventDriven()), their Tick() method will
+    * than wait for messages to arrive instead of polling libusb.
+    *
+    * @hint A single event thread serves all USB devices opened in the libusb
+    * context `ctx'.
+    */
+class LibusbEventThread
+{
+public:
+    enum {
+        /** Longest pause, in milliseconds, after libusb keeps failing to
+         * process events, so a persistent error does not spin the thread. */
+        MAX_ERROR_BACKOFF = 1000
+    };
+
+    LibusbEventThread(libusb_context *ctx = nullptr);
+    ~LibusbEventThread();
+
+    void Stop();
+
+private:
+    void Run();
+
+    libusb_context *m_Context;
+    std::atomic<int> m_StopRequested;
+    /** Ends the pause after an error when Stop() is called. */
+    std::mutex m_StopLock;
+    std::condition_variable m_StopSignal;
+    std::thread m_Thread;
+};
+
     class AntStickReader
     {
     public:
@@ -0,0 +1,934 @@
+/**
+ *  AntStickEmulator -- the stick side of the ANT protocol, in software
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntStickEmulator.h"
+#include "HeartRateMonitor.h"
+#include "FitnessEquipmentControl.h"
+
+#include <algorithm>
+#include <cmath>
+
+/** IMPLEMENTATION NOTE
+ *
+ * Stick behavior follows "ANT Message Protocol And Usage" (section 9.5), the
+ * data pages follow the ANT+ Heart Rate and Fitness Equipment device
+ * profiles, see HeartRateMonitor.cpp and FitnessEquipmentControl.cpp.
+ */
+
+namespace {
+
+enum {
+    ANT_PLUS_FREQUENCY = 57,
+    DEFAULT_CHANNEL_PERIOD = 8192,      // 4 Hz
+    DEFAULT_SEARCH_TIMEOUT = 10,        // 25 seconds
+    DEFAULT_FREQUENCY = 66,
+    INFINITE_SEARCH_TIMEOUT = 0xFF,
+
+    // Consecutive broadcasts missed before the channel drops to search.
+    MAX_MISSED_BROADCASTS = 8,
+
+    // STARTUP_MESSAGE reason
+    RESET_COMMAND = 0x20,
+
+    // SERIAL_ERROR_MESSAGE reasons
+    SERIAL_ERROR_NO_SYNC = 0x00,
+    SERIAL_ERROR_BAD_CHECKSUM = 0x02,
+
+    DP_DATA_PAGE_REQUEST = 0x46
+};
+
+Buffer MakeMessage(AntMessageId id, const Buffer &data)
+{
+    Buffer b;
+    b.reserve(data.size() + 4);
+    b.push_back(SYNC_BYTE);
+    b.push_back(static_cast<uint8_t>(data.size()));
+    b.push_back(static_cast<uint8_t>(id));
+    b.insert(b.end(), data.begin(), data.end());
+    uint8_t c = 0;
+    for (auto e : b)
+        c ^= e;
+    b.push_back(c);
+    return b;
+}
+
+};                                      // end anonymous namespace
+
+AntStickEmulator::AntStickEmulator(uint32_t serial_number, int max_channels)
+    : m_SerialNumber(serial_number),
+      m_Version("EMU1.00"),
+      m_MaxNetworks(8),
+      m_LibConfig(0),
+      m_LossRate(0),
+      m_CollisionRate(0),
+      m_DropToSearchRate(0),
+      m_Start(Clock::now())
+{
+    if (max_channels < 1 || max_channels > 255)
+        throw std::runtime_error("AntStickEmulator -- bad number of channels");
+    m_Channels.resize(max_channels);
+    Reset();
+    // Nobody asked for the startup message yet
+    m_Output.clear();
+}
+
+void AntStickEmulator::AddMaster(uint8_t device_type, uint32_t device_number)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+
+    Master m;
+    m.DeviceType = device_type;
+    m.DeviceNumber = device_number & 0xFFFFF;
+    // Low bits: independent channel, high nibble: top of the 20 bit device
+    // number.
+    m.TransmissionType = static_cast<uint8_t>(
+        ANT_INDEPENDENT_CHANNEL | ((device_number >> 12) & 0xF0));
+    m.Frequency = ANT_PLUS_FREQUENCY;
+    if (device_type == HRM::ANT_DEVICE_TYPE)
+        m.Period = HRM::CHANNEL_PERIOD;
+    else if (device_type == BIKE::ANT_DEVICE_TYPE)
+        m.Period = BIKE::CHANNEL_PERIOD;
+    else
+        m.Period = DEFAULT_CHANNEL_PERIOD;
+    m.Rssi = -50 - static_cast<int>(40 * u(m_Random));
+    m.TrackedBy = -1;
+    m.MessageCount = 0;
+    m.LastUpdate = Seconds(Clock::now());
+
+    m.HeartRate = 60 + 100 * u(m_Random);
+    m.LastBeat = m.LastUpdate;
+    m.PreviousBeat = m.LastUpdate;
+    m.NextBeat = m.LastUpdate + u(m_Random) * 60.0 / m.HeartRate;
+    m.BeatCount = 0;
+
+    m.Power = 100 + 150 * u(m_Random);
+    m.TargetPower = 0;
+    m.Cadence = 80 + 15 * u(m_Random);
+    m.Speed = 0;
+    m.Distance = 0;
+    m.EventCount = 0;
+    m.AccumulatedPower = 0;
+
+    m.RequestedPage = 0;
+    m.RequestedCount = 0;
+
+    m_Masters.push_back(m);
+}
+
+void AntStickEmulator::SetLossRate(double rate)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_LossRate = rate;
+}
+
+void AntStickEmulator::SetCollisionRate(double rate)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_CollisionRate = rate;
+}
+
+void AntStickEmulator::SetDropToSearchRate(double rate)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_DropToSearchRate = rate;
+}
+
+void AntStickEmulator::SetSeed(unsigned seed)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_Random.seed(seed);
+}
+
+/** Process a message sent to the stick.  Replies are queued immediately,
+ * like a real stick would send them right away.
+ */
+void AntStickEmulator::WriteMessage(const AntMessage &message)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+
+    if (message.size() < 4 || message[0] != SYNC_BYTE
+        || message.size() != message[1] + 4u)
+    {
+        Reply(SERIAL_ERROR_MESSAGE, Buffer(1, SERIAL_ERROR_NO_SYNC));
+        m_Wakeup.notify_all();
+        return;
+    }
+
+    uint8_t c = 0;
+    for (auto e : message)
+        c ^= e;
+    if (c != 0) {
+        Reply(SERIAL_ERROR_MESSAGE, Buffer(1, SERIAL_ERROR_BAD_CHECKSUM));
+        m_Wakeup.notify_all();
+        return;
+    }
+
+    uint8_t id = message[2];
+    const uint8_t *data = message.data() + 3;
+    int size = message[1];
+
+    switch (id) {
+    case RESET_SYSTEM:
+        Reset();
+        break;
+    case REQUEST_MESSAGE:
+        if (size >= 2)
+            HandleRequest(data[0], data[1]);
+        break;
+    case LIB_CONFIG:
+        // The first data byte is filler, the second one the flags.
+        m_LibConfig = size >= 2 ? data[1] : 0;
+        ChannelResponse(0, id, RESPONSE_NO_ERROR);
+        break;
+    case SET_NETWORK_KEY:
+        if (size == 9 && data[0] < m_MaxNetworks)
+            ChannelResponse(data[0], id, RESPONSE_NO_ERROR);
+        else
+            ChannelResponse(size > 0 ? data[0] : 0, id, INVALID_NETWORK_NUMBER);
+        break;
+    default:
+        HandleChannelMessage(id, data, size);
+        break;
+    }
+
+    m_Wakeup.notify_all();
+}
+
+/** Fill `message' with the next message from the stick, running the channel
+ * periods which are due while waiting.  If nothing happens within the read
+ * timeout, an empty message is returned.
+ */
+void AntStickEmulator::MaybeGetNextMessage(Buffer &message)
+{
+    message.clear();
+
+    std::unique_lock<std::mutex> lock(m_Lock);
+    auto deadline = Clock::now() + std::chrono::milliseconds(m_ReadTimeout);
+
+    for (;;) {
+        if (!m_Output.empty()) {
+            message.swap(m_Output.front());
+            m_Output.pop_front();
+            return;
+        }
+
+        auto now = Clock::now();
+        if (!m_Events.empty() && m_Events.top().Due <= now) {
+            Event e = m_Events.top();
+            m_Events.pop();
+            if (e.Master >= 0)
+                RunScanPeriod(e, now);
+            else if (e.Master == CLOSE_EVENT)
+                FinishClose(e);
+            else
+                RunChannelPeriod(e, now);
+            continue;
+        }
+
+        if (now >= deadline)
+            return;
+
+        auto wake = deadline;
+        if (!m_Events.empty())
+            wake = (std::min)(wake, m_Events.top().Due);
+        m_Wakeup.wait_until(lock, wake);
+    }
+}
+
+void AntStickEmulator::Reset()
+{
+    for (auto &m : m_Masters)
+        m.TrackedBy = -1;
+    m_LibConfig = 0;
+
+    for (auto &c : m_Channels) {
+        c.State = CS_UNASSIGNED;
+        c.Network = 0;
+        c.DeviceType = 0;
+        c.DeviceNumber = 0;
+        c.TransmissionType = 0;
+        c.Period = DEFAULT_CHANNEL_PERIOD;
+        c.SearchTimeout = DEFAULT_SEARCH_TIMEOUT;
+        c.Frequency = DEFAULT_FREQUENCY;
+        c.Master = -1;
+        c.MissedCount = 0;
+        c.AckPending = false;
+        c.AckData.clear();
+        c.Generation++;
+    }
+
+    m_Events = decltype(m_Events)();
+    m_Output.clear();
+    Reply(STARTUP_MESSAGE, Buffer(1, RESET_COMMAND));
+}
+
+void AntStickEmulator::HandleRequest(uint8_t channel, uint8_t message_id)
+{
+    switch (message_id) {
+    case RESPONSE_SERIAL_NUMBER: {
+        Buffer data;
+        for (int i = 0; i < 4; i++)
+            data.push_back(static_cast<uint8_t>((m_SerialNumber >> (8 * i)) & 0xFF));
+        Reply(RESPONSE_SERIAL_NUMBER, data);
+        break;
+    }
+    case RESPONSE_VERSION: {
+        Buffer data(m_Version.begin(), m_Version.end());
+        data.push_back(0);
+        Reply(RESPONSE_VERSION, data);
+        break;
+    }
+    case RESPONSE_CAPABILITIES: {
+        Buffer data(6, 0);
+        data[0] = static_cast<uint8_t>(m_Channels.size());
+        data[1] = static_cast<uint8_t>(m_MaxNetworks);
+        Reply(RESPONSE_CAPABILITIES, data);
+        break;
+    }
+    case RESPONSE_CHANNEL_ID: {
+        if (channel >= m_Channels.size()
+            || m_Channels[channel].State == CS_UNASSIGNED) {
+            ChannelResponse(channel, REQUEST_MESSAGE, CHANNEL_ID_NOT_SET);
+            break;
+        }
+        const Channel &c = m_Channels[channel];
+        uint32_t device_number = c.DeviceNumber;
+        uint8_t device_type = c.DeviceType;
+        uint8_t transmission_type = c.TransmissionType;
+        if (c.State == CS_TRACKING) {
+            const Master &m = m_Masters[c.Master];
+            device_number = m.DeviceNumber;
+            device_type = m.DeviceType;
+            transmission_type = m.TransmissionType;
+        }
+        Buffer data;
+        data.push_back(channel);
+        data.push_back(static_cast<uint8_t>(device_number & 0xFF));
+        data.push_back(static_cast<uint8_t>((device_number >> 8) & 0xFF));
+        data.push_back(device_type);
+        data.push_back(transmission_type);
+        Reply(RESPONSE_CHANNEL_ID, data);
+        break;
+    }
+    case RESPONSE_CHANNEL_STATUS: {
+        if (channel >= m_Channels.size()) {
+            ChannelResponse(channel, REQUEST_MESSAGE, INVALID_PARAMETER_PROVIDED);
+            break;
+        }
+        const Channel &c = m_Channels[channel];
+        // A scanning channel reports itself as tracking
+        uint8_t state = static_cast<uint8_t>(c.State == CS_SCANNING ? CS_TRACKING : c.State);
+        Buffer data;
+        data.push_back(channel);
+        data.push_back(static_cast<uint8_t>(state | (c.Network << 2)));
+        Reply(RESPONSE_CHANNEL_STATUS, data);
+        break;
+    }
+    default:
+        ChannelResponse(channel, REQUEST_MESSAGE, INVALID_MESSAGE);
+        break;
+    }
+}
+
+/** Handle configuration and control messages which apply to a channel, the
+ * channel number being the first data byte.
+ */
+void AntStickEmulator::HandleChannelMessage(uint8_t id, const uint8_t *data, int size)
+{
+    if (size < 1) {
+        ChannelResponse(0, id, INVALID_MESSAGE);
+        return;
+    }
+
+    uint8_t channel = data[0];
+    if (channel >= m_Channels.size()) {
+        ChannelResponse(channel, id, INVALID_PARAMETER_PROVIDED);
+        return;
+    }
+
+    Channel &c = m_Channels[channel];
+    bool is_open = (c.State == CS_SEARCHING || c.State == CS_TRACKING
+                    || c.State == CS_SCANNING);
+    // No other channel can be open while channel 0 is scanning
+    bool scanning = m_Channels[0].State == CS_SCANNING;
+
+    switch (id) {
+    case ASSIGN_CHANNEL:
+        if (size < 3) {
+            ChannelResponse(channel, id, INVALID_MESSAGE);
+        } else if (c.State != CS_UNASSIGNED) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else if (data[2] >= m_MaxNetworks) {
+            ChannelResponse(channel, id, INVALID_NETWORK_NUMBER);
+        } else {
+            c.State = CS_ASSIGNED;
+            c.Network = data[2];
+            c.DeviceType = 0;
+            c.DeviceNumber = 0;
+            c.TransmissionType = 0;
+            c.Period = DEFAULT_CHANNEL_PERIOD;
+            c.SearchTimeout = DEFAULT_SEARCH_TIMEOUT;
+            c.Frequency = DEFAULT_FREQUENCY;
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+        }
+        break;
+
+    case UNASSIGN_CHANNEL:
+        if (c.State != CS_ASSIGNED) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            c.State = CS_UNASSIGNED;
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+        }
+        break;
+
+    case SET_CHANNEL_ID:
+        if (size < 5) {
+            ChannelResponse(channel, id, INVALID_MESSAGE);
+        } else if (c.State == CS_UNASSIGNED) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            c.DeviceNumber = data[1] | (data[2] << 8) | ((data[4] & 0xF0) << 12);
+            c.DeviceType = data[3];
+            c.TransmissionType = data[4];
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+        }
+        break;
+
+    case SET_CHANNEL_PERIOD:
+        if (size < 3) {
+            ChannelResponse(channel, id, INVALID_MESSAGE);
+        } else if (c.State == CS_UNASSIGNED) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            c.Period = data[1] | (data[2] << 8);
+            if (c.Period == 0)
+                c.Period = DEFAULT_CHANNEL_PERIOD;
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+        }
+        break;
+
+    case SET_CHANNEL_SEARCH_TIMEOUT:
+    case SET_CHANNEL_RF_FREQ:
+        if (size < 2) {
+            ChannelResponse(channel, id, INVALID_MESSAGE);
+        } else if (c.State == CS_UNASSIGNED) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            if (id == SET_CHANNEL_SEARCH_TIMEOUT)
+                c.SearchTimeout = data[1];
+            else
+                c.Frequency = data[1];
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+        }
+        break;
+
+    case OPEN_CHANNEL:
+        if (c.State != CS_ASSIGNED || scanning) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+            c.Generation++;
+            auto now = Clock::now();
+            StartSearch(channel, now);
+            Schedule(channel, now);
+        }
+        break;
+
+    case OPEN_RX_SCAN_MODE:
+        if (channel != 0 || c.State != CS_ASSIGNED) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            OpenScanMode(channel);
+        }
+        break;
+
+    case CLOSE_CHANNEL:
+        if (!is_open) {
+            ChannelResponse(channel, id, CHANNEL_IN_WRONG_STATE);
+        } else {
+            ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+            BeginClose(channel);
+        }
+        break;
+
+    case ACKNOWLEDGE_DATA:
+        if (!is_open) {
+            ChannelResponse(channel, id, CHANNEL_NOT_OPENED);
+        } else if (c.AckPending) {
+            ChannelResponse(channel, id, TRANSFER_IN_PROGRESS);
+        } else {
+            // Sent after the next broadcast from the master, the result
+            // is reported as a channel event.
+            c.AckPending = true;
+            c.AckData.assign(data + 1, data + size);
+        }
+        break;
+
+    case BROADCAST_DATA:
+        // Slave channels don't transmit broadcast data, drop it.
+        break;
+
+    default:
+        // Accept other configuration messages, they don't change the
+        // behavior of the emulator.
+        ChannelResponse(channel, id, RESPONSE_NO_ERROR);
+        break;
+    }
+}
+
+/** One channel period has expired for a channel: pair up a searching channel
+ * with a master, or deliver the master's broadcast (or the radio event which
+ * prevented it).
+ */
+void AntStickEmulator::RunChannelPeriod(const Event &event, Clock::time_point now)
+{
+    Channel &c = m_Channels[event.Channel];
+    if (event.Generation != c.Generation)
+        return;                         // channel was closed or reopened
+
+    if (c.State == CS_SEARCHING) {
+        if (c.SearchTimeout != INFINITE_SEARCH_TIMEOUT
+            && now - c.SearchStarted >= std::chrono::milliseconds(2500 * c.SearchTimeout))
+        {
+            FinishAck(event.Channel, false);
+            ChannelResponse(event.Channel, 1, EVENT_RX_SEARCH_TIMEOUT);
+            CloseChannel(event.Channel);
+            return;
+        }
+
+        int m = Chance(m_LossRate) ? -1 : FindMaster(c);
+        if (m < 0) {
+            Schedule(event.Channel, event.Due);
+            return;
+        }
+        c.State = CS_TRACKING;
+        c.Master = m;
+        c.MissedCount = 0;
+        m_Masters[m].TrackedBy = event.Channel;
+    }
+
+    if (c.State != CS_TRACKING)
+        return;
+
+    if (Chance(m_DropToSearchRate)) {
+        FinishAck(event.Channel, false);
+        ChannelResponse(event.Channel, 1, EVENT_RX_FAIL_GO_TO_SEARCH);
+        StartSearch(event.Channel, now);
+    } else if (Chance(m_CollisionRate)) {
+        FinishAck(event.Channel, false);
+        ChannelResponse(event.Channel, 1, EVENT_CHANNEL_COLLISION);
+    } else if (Chance(m_LossRate)) {
+        FinishAck(event.Channel, false);
+        ChannelResponse(event.Channel, 1, EVENT_RX_FAIL);
+        if (++c.MissedCount >= MAX_MISSED_BROADCASTS) {
+            ChannelResponse(event.Channel, 1, EVENT_RX_FAIL_GO_TO_SEARCH);
+            StartSearch(event.Channel, now);
+        }
+    } else {
+        Master &m = m_Masters[c.Master];
+        c.MissedCount = 0;
+        Buffer data(9);
+        data[0] = static_cast<uint8_t>(event.Channel);
+        MakeBroadcast(m, Seconds(now), &data[1]);
+        AppendExtendedData(data, m, now);
+        Reply(BROADCAST_DATA, data);
+        if (c.AckPending)
+            ApplyAckData(m, c.AckData);
+        FinishAck(event.Channel, true);
+    }
+
+    Schedule(event.Channel, event.Due);
+}
+
+/** A master's channel period expired while scanning: deliver its broadcast
+ * on the scanning channel, unless it was lost.  There are no RX_FAIL events
+ * in scan mode, lost broadcasts are just not received.
+ */
+void AntStickEmulator::RunScanPeriod(const Event &event, Clock::time_point now)
+{
+    Channel &c = m_Channels[event.Channel];
+    if (event.Generation != c.Generation || c.State != CS_SCANNING)
+        return;
+
+    Master &m = m_Masters[event.Master];
+    if (!Chance(m_LossRate) && !Chance(m_CollisionRate)) {
+        Buffer data(9);
+        data[0] = static_cast<uint8_t>(event.Channel);
+        MakeBroadcast(m, Seconds(now), &data[1]);
+        AppendExtendedData(data, m, now);
+        Reply(BROADCAST_DATA, data);
+        // Acknowledged data goes to the master we last received from.
+        if (c.AckPending)
+            ApplyAckData(m, c.AckData);
+        FinishAck(event.Channel, true);
+    }
+
+    ScheduleScan(event.Channel, event.Master, event.Due);
+}
+
+/** Open `channel' in scan mode, where it receives from all masters matching
+ * its channel ID, on their own channel periods.
+ */
+void AntStickEmulator::OpenScanMode(int channel)
+{
+    for (int i = 0; i < static_cast<int>(m_Channels.size()); i++) {
+        const Channel &other = m_Channels[i];
+        if (i != channel && other.State != CS_UNASSIGNED && other.State != CS_ASSIGNED) {
+            ChannelResponse(static_cast<uint8_t>(channel), OPEN_RX_SCAN_MODE, CHANNEL_IN_WRONG_STATE);
+            return;
+        }
+    }
+
+    ChannelResponse(static_cast<uint8_t>(channel), OPEN_RX_SCAN_MODE, RESPONSE_NO_ERROR);
+    Channel &c = m_Channels[channel];
+    c.State = CS_SCANNING;
+    c.Generation++;
+
+    // Masters are not synchronized, start each one at a random point of
+    // its channel period.
+    auto now = Clock::now();
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    for (int i = 0; i < static_cast<int>(m_Masters.size()); i++) {
+        const Master &m = m_Masters[i];
+        if (!Matches(c, m))
+            continue;
+        auto offset = std::chrono::microseconds(
+            static_cast<long long>(u(m_Random) * m.Period * 1000000 / 32768));
+        Event e;
+        e.Due = now + offset;
+        e.Channel = channel;
+        e.Master = i;
+        e.Generation = c.Generation;
+        m_Events.push(e);
+    }
+}
+
+/** Schedule the next channel period after `due'.  If we fell behind (nobody
+ * read messages for a while), skip the periods we missed rather than
+ * delivering a burst of stale broadcasts.
+ */
+void AntStickEmulator::Schedule(int channel, Clock::time_point due)
+{
+    const Channel &c = m_Channels[channel];
+    auto period = std::chrono::microseconds(
+        static_cast<long long>(c.Period) * 1000000 / 32768);
+    auto next = due + period;
+    auto now = Clock::now();
+    if (next < now)
+        next = now + period;
+    Event e;
+    e.Due = next;
+    e.Channel = channel;
+    e.Master = -1;
+    e.Generation = c.Generation;
+    m_Events.push(e);
+}
+
+/** Schedule the next broadcast of `master' on the scanning `channel', see
+ * Schedule().
+ */
+void AntStickEmulator::ScheduleScan(int channel, int master, Clock::time_point due)
+{
+    auto period = std::chrono::microseconds(
+        static_cast<long long>(m_Masters[master].Period) * 1000000 / 32768);
+    auto next = due + period;
+    auto now = Clock::now();
+    if (next < now)
+        next = now + period;
+    Event e;
+    e.Due = next;
+    e.Channel = channel;
+    e.Master = master;
+    e.Generation = m_Channels[channel].Generation;
+    m_Events.push(e);
+}
+
+void AntStickEmulator::CloseChannel(int channel)
+{
+    Channel &c = m_Channels[channel];
+    FinishAck(channel, false);
+    ReleaseMaster(channel);
+    c.State = CS_ASSIGNED;
+    c.Generation++;
+    ChannelResponse(static_cast<uint8_t>(channel), 1, EVENT_CHANNEL_CLOSED);
+}
+
+/** Close `channel' like a real stick does after CLOSE_CHANNEL: it stops
+ * receiving right away, but only reports EVENT_CHANNEL_CLOSED one channel
+ * period later, and refuses to unassign the channel until then.
+ */
+void AntStickEmulator::BeginClose(int channel)
+{
+    Channel &c = m_Channels[channel];
+    FinishAck(channel, false);
+    ReleaseMaster(channel);
+    c.State = CS_CLOSING;
+    c.Generation++;
+
+    Event e;
+    e.Due = Clock::now() + std::chrono::microseconds(
+        static_cast<long long>(c.Period) * 1000000 / 32768);
+    e.Channel = channel;
+    e.Master = CLOSE_EVENT;
+    e.Generation = c.Generation;
+    m_Events.push(e);
+}
+
+void AntStickEmulator::FinishClose(const Event &event)
+{
+    Channel &c = m_Channels[event.Channel];
+    if (event.Generation != c.Generation || c.State != CS_CLOSING)
+        return;
+    c.State = CS_ASSIGNED;
+    ChannelResponse(static_cast<uint8_t>(event.Channel), 1, EVENT_CHANNEL_CLOSED);
+}
+
+void AntStickEmulator::StartSearch(int channel, Clock::time_point now)
+{
+    ReleaseMaster(channel);
+    Channel &c = m_Channels[channel];
+    c.State = CS_SEARCHING;
+    c.SearchStarted = now;
+    c.MissedCount = 0;
+}
+
+void AntStickEmulator::ReleaseMaster(int channel)
+{
+    Channel &c = m_Channels[channel];
+    if (c.Master >= 0 && m_Masters[c.Master].TrackedBy == channel)
+        m_Masters[c.Master].TrackedBy = -1;
+    c.Master = -1;
+}
+
+/** Report the result of an outstanding ACKNOWLEDGE_DATA message, if any. */
+void AntStickEmulator::FinishAck(int channel, bool success)
+{
+    Channel &c = m_Channels[channel];
+    if (!c.AckPending)
+        return;
+    c.AckPending = false;
+    c.AckData.clear();
+    ChannelResponse(static_cast<uint8_t>(channel), 1,
+                    success ? EVENT_TRANSFER_TX_COMPLETED : EVENT_TRANSFER_TX_FAILED);
+}
+
+/** Find a master, not tracked by another channel, matching the channel ID
+ * of `c'.  Zero fields in the channel ID are wildcards.  Returns -1 if there
+ * is none.
+ */
+int AntStickEmulator::FindMaster(const Channel &c)
+{
+    int count = static_cast<int>(m_Masters.size());
+    if (count == 0)
+        return -1;
+
+    // Start at a random master, so wildcard searches don't always pair up
+    // with the same ones.
+    int start = std::uniform_int_distribution<int>(0, count - 1)(m_Random);
+    for (int n = 0; n < count; n++) {
+        int i = (start + n) % count;
+        const Master &m = m_Masters[i];
+        if (m.TrackedBy == -1 && Matches(c, m))
+            return i;
+    }
+    return -1;
+}
+
+/** True if master `m' matches the frequency and channel ID of `c', zero
+ * fields in the channel ID are wildcards.
+ */
+bool AntStickEmulator::Matches(const Channel &c, const Master &m) const
+{
+    return m.Frequency == c.Frequency
+        && (c.DeviceType == 0 || c.DeviceType == m.DeviceType)
+        && (c.DeviceNumber == 0 || c.DeviceNumber == m.DeviceNumber)
+        && ((c.TransmissionType & 0x0F) == 0
+            || (c.TransmissionType & 0x0F) == (m.TransmissionType & 0x0F));
+}
+
+/** A master received an acknowledged data page.  We honor data page
+ * requests and the FE-C target power, other pages are accepted and ignored.
+ */
+void AntStickEmulator::ApplyAckData(Master &m, const Buffer &data)
+{
+    if (data.size() < 8)
+        return;
+
+    switch (data[0]) {
+    case DP_DATA_PAGE_REQUEST:
+        m.RequestedCount = data[5] & 0x7F;
+        m.RequestedPage = data[6];
+        break;
+    case BIKE::DP_TARGET_POWER:
+        if (m.DeviceType == BIKE::ANT_DEVICE_TYPE)
+            m.TargetPower = (data[6] | (data[7] << 8)) * 0.25;
+        break;
+    default:
+        break;
+    }
+}
+
+/** Advance the simulated state of master `m' to time `t' (seconds). */
+void AntStickEmulator::UpdateMaster(Master &m, double t)
+{
+    double dt = t - m.LastUpdate;
+    if (dt <= 0)
+        return;
+    m.LastUpdate = t;
+
+    std::normal_distribution<double> noise(0.0, 1.0);
+
+    if (m.DeviceType == HRM::ANT_DEVICE_TYPE) {
+        while (m.NextBeat <= t) {
+            m.PreviousBeat = m.LastBeat;
+            m.LastBeat = m.NextBeat;
+            m.BeatCount++;
+            m.HeartRate = (std::min)(190.0, (std::max)(45.0, m.HeartRate + 0.5 * noise(m_Random)));
+            m.NextBeat += 60.0 / m.HeartRate;
+        }
+    } else if (m.DeviceType == BIKE::ANT_DEVICE_TYPE) {
+        if (m.TargetPower > 0)
+            m.Power += (m.TargetPower - m.Power) * (std::min)(1.0, dt);
+        else
+            m.Power += 5.0 * noise(m_Random) * std::sqrt(dt);
+        m.Power = (std::min)(2000.0, (std::max)(0.0, m.Power));
+        m.Cadence = (std::min)(120.0, (std::max)(60.0, m.Cadence + noise(m_Random) * std::sqrt(dt)));
+        // Flat road, no wind: P ~ 0.25 * v^3
+        m.Speed = std::cbrt(m.Power / 0.25);
+        m.Distance += m.Speed * dt;
+    }
+}
+
+/** Produce the 8 byte data page `m' broadcasts at time `t'. */
+void AntStickEmulator::MakeBroadcast(Master &m, double t, uint8_t page[8])
+{
+    UpdateMaster(m, t);
+    std::fill(page, page + 8, 0);
+
+    unsigned n = m.MessageCount++;
+
+    if (m.DeviceType == HRM::ANT_DEVICE_TYPE) {
+        // Page 4, with the page toggle bit flipping every 4 messages.
+        uint16_t prev = static_cast<uint16_t>(std::fmod(m.PreviousBeat * 1024, 65536.0));
+        uint16_t last = static_cast<uint16_t>(std::fmod(m.LastBeat * 1024, 65536.0));
+        page[0] = static_cast<uint8_t>(0x04 | (((n / 4) & 1) << 7));
+        page[1] = 0xFF;
+        page[2] = static_cast<uint8_t>(prev & 0xFF);
+        page[3] = static_cast<uint8_t>(prev >> 8);
+        page[4] = static_cast<uint8_t>(last & 0xFF);
+        page[5] = static_cast<uint8_t>(last >> 8);
+        page[6] = m.BeatCount;
+        page[7] = static_cast<uint8_t>(m.HeartRate + 0.5);
+    } else if (m.DeviceType == BIKE::ANT_DEVICE_TYPE) {
+        const uint8_t FE_STATE_IN_USE = FitnessEquipmentControl::STATE_IN_USE << 4;
+        if (m.RequestedCount > 0 && m.RequestedPage == BIKE::DP_FE_CAPABILITIES) {
+            m.RequestedCount--;
+            uint16_t max_resistance = 2000;   // Newtons
+            page[0] = BIKE::DP_FE_CAPABILITIES;
+            std::fill(page + 1, page + 5, 0xFF);
+            page[5] = static_cast<uint8_t>(max_resistance & 0xFF);
+            page[6] = static_cast<uint8_t>(max_resistance >> 8);
+            page[7] = 0x07;               // resistance, power, simulation
+        } else if ((n & 2) == 0) {
+            uint16_t speed = static_cast<uint16_t>(m.Speed * 1000);
+            page[0] = BIKE::DP_GENERAL;
+            page[1] = FitnessEquipmentControl::ET_TRAINER;
+            page[2] = static_cast<uint8_t>(static_cast<unsigned>(t * 4) & 0xFF);
+            page[3] = static_cast<uint8_t>(static_cast<unsigned>(m.Distance) & 0xFF);
+            page[4] = static_cast<uint8_t>(speed & 0xFF);
+            page[5] = static_cast<uint8_t>(speed >> 8);
+            page[6] = 0xFF;               // no heart rate
+            page[7] = 0x04 | FE_STATE_IN_USE; // distance enabled
+        } else {
+            uint16_t power = static_cast<uint16_t>(m.Power + 0.5);
+            m.EventCount++;
+            m.AccumulatedPower += power;
+            page[0] = BIKE::DP_TRAINER_SPECIFIC;
+            page[1] = m.EventCount;
+            page[2] = static_cast<uint8_t>(m.Cadence + 0.5);
+            page[3] = static_cast<uint8_t>(m.AccumulatedPower & 0xFF);
+            page[4] = static_cast<uint8_t>(m.AccumulatedPower >> 8);
+            page[5] = static_cast<uint8_t>(power & 0xFF);
+            page[6] = static_cast<uint8_t>((power >> 8) & 0x0F);
+            page[7] = FE_STATE_IN_USE;
+        }
+    }
+}
+
+/** Append the flag byte and the extended data enabled with LIB_CONFIG to the
+ * data message `data', received from `m'.
+ */
+void AntStickEmulator::AppendExtendedData(
+    Buffer &data, const Master &m, Clock::time_point now) const
+{
+    const uint8_t RSSI_MEASUREMENT_TYPE = 0x20;
+    const int8_t RSSI_THRESHOLD = -96;
+
+    uint8_t flags = m_LibConfig & (EXT_CHANNEL_ID | EXT_RSSI | EXT_RX_TIMESTAMP);
+    if (flags == 0)
+        return;
+
+    data.push_back(flags);
+    if (flags & EXT_CHANNEL_ID) {
+        data.push_back(static_cast<uint8_t>(m.DeviceNumber & 0xFF));
+        data.push_back(static_cast<uint8_t>((m.DeviceNumber >> 8) & 0xFF));
+        data.push_back(m.DeviceType);
+        data.push_back(m.TransmissionType);
+    }
+    if (flags & EXT_RSSI) {
+        data.push_back(RSSI_MEASUREMENT_TYPE);
+        data.push_back(static_cast<uint8_t>(static_cast<int8_t>(m.Rssi)));
+        data.push_back(static_cast<uint8_t>(RSSI_THRESHOLD));
+    }
+    if (flags & EXT_RX_TIMESTAMP) {
+        auto ticks = static_cast<uint16_t>(
+            static_cast<long long>(Seconds(now) * 32768) & 0xFFFF);
+        data.push_back(static_cast<uint8_t>(ticks & 0xFF));
+        data.push_back(static_cast<uint8_t>(ticks >> 8));
+    }
+}
+
+void AntStickEmulator::Reply(AntMessageId id, const Buffer &data)
+{
+    m_Output.push_back(MakeMessage(id, data));
+}
+
+void AntStickEmulator::ChannelResponse(
+    uint8_t channel, uint8_t message_id, AntChannelEvent event)
+{
+    Buffer data;
+    data.push_back(channel);
+    data.push_back(message_id);
+    data.push_back(static_cast<uint8_t>(event));
+    Reply(CHANNEL_RESPONSE, data);
+}
+
+bool AntStickEmulator::Chance(double probability)
+{
+    if (probability <= 0)
+        return false;
+    return std::uniform_real_distribution<double>(0.0, 1.0)(m_Random) < probability;
+}
+
+double AntStickEmulator::Seconds(Clock::time_point t) const
+{
+    return std::chrono::duration<double>(t - m_Start).count();
+}
@@ -0,0 +1,217 @@
+/**
+ *  AntStickEmulator -- the stick side of the ANT protocol, in software
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+#include "AntStick.h"
+
+/** Transport which emulates an ANT USB stick together with any number of
+ * masters (sensors) in radio range.  The stick answers the reset, request
+ * and channel configuration messages sent by AntStick and AntChannel, and
+ * open channels pair with a matching master and receive its BROADCAST_DATA
+ * at the channel period.  Heart rate monitors (device type 0x78) and FE-C
+ * trainers (device type 0x11) broadcast realistic data pages, other device
+ * types broadcast empty pages.
+ *
+ * Radio conditions are simulated with a loss rate (EVENT_RX_FAIL), a
+ * collision rate (EVENT_CHANNEL_COLLISION) and a drop-to-search rate
+ * (EVENT_RX_FAIL_GO_TO_SEARCH), all of them probabilities applied to each
+ * channel period.
+ *
+ * Channel 0 can also be opened in continuous scan mode (OPEN_RX_SCAN_MODE),
+ * where it receives the broadcasts of all matching masters, each at its own
+ * channel period.  The extended data enabled with LIB_CONFIG is appended to
+ * received data messages, in scan mode and otherwise.
+ *
+ * Messages are generated in real time when MaybeGetNextMessage() is called,
+ * so the emulator needs no thread of its own.
+ */
+class AntStickEmulator : public AntTransport
+{
+public:
+    AntStickEmulator(uint32_t serial_number = 0x00454D55, int max_channels = 8);
+
+    /** Add a master which channels can pair with.  Masters transmit on the
+     * ANT+ frequency (57) with an independent channel transmission type. */
+    void AddMaster(uint8_t device_type, uint32_t device_number);
+
+    /** Probability that a broadcast is not received. */
+    void SetLossRate(double rate);
+
+    /** Probability of a channel collision in a channel period. */
+    void SetCollisionRate(double rate);
+
+    /** Probability that a tracking channel loses its master and goes back
+     * to search. */
+    void SetDropToSearchRate(double rate);
+
+    /** Reseed the random generator, for repeatable runs. */
+    void SetSeed(unsigned seed);
+
+    void WriteMessage(const AntMessage &message) override;
+    void MaybeGetNextMessage(Buffer &message) override;
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    enum { CLOSE_EVENT = -2 };
+
+    struct Master {
+        uint8_t DeviceType;
+        uint32_t DeviceNumber;
+        uint8_t TransmissionType;
+        uint8_t Frequency;
+        /** Channel period of the master's broadcasts, 1/32768 seconds */
+        unsigned Period;
+        /** Signal strength at the stick, in dBm */
+        int Rssi;
+
+        /** Channel tracking this master or -1 */
+        int TrackedBy;
+        unsigned MessageCount;
+        double LastUpdate;              // seconds since m_Start
+
+        // Heart rate monitor
+        double HeartRate;
+        double LastBeat;
+        double PreviousBeat;
+        double NextBeat;
+        uint8_t BeatCount;
+
+        // FE-C trainer
+        double Power;
+        double TargetPower;
+        double Cadence;
+        double Speed;
+        double Distance;
+        uint8_t EventCount;
+        uint16_t AccumulatedPower;
+
+        /** Data page requested with a 0x46 request and how many times it
+         * still has to be sent. */
+        uint8_t RequestedPage;
+        int RequestedCount;
+    };
+
+    enum ChannelState {
+        CS_UNASSIGNED,
+        CS_ASSIGNED,
+        CS_SEARCHING,
+        CS_TRACKING,
+        CS_SCANNING,
+        CS_CLOSING                      // EVENT_CHANNEL_CLOSED still to come
+    };
+
+    struct Channel {
+        ChannelState State;
+        uint8_t Network;
+        uint8_t DeviceType;
+        uint32_t DeviceNumber;
+        uint8_t TransmissionType;
+        unsigned Period;
+        uint8_t SearchTimeout;
+        uint8_t Frequency;
+
+        /** Index in m_Masters, -1 while searching */
+        int Master;
+        Clock::time_point SearchStarted;
+        int MissedCount;
+
+        bool AckPending;
+        Buffer AckData;
+
+        /** Incremented when the channel is opened or closed, so events
+         * scheduled before that are discarded. */
+        unsigned Generation;
+    };
+
+    /** Channel period expiring at `Due'.  For a scanning channel, each
+     * master has its own events. */
+    struct Event {
+        Clock::time_point Due;
+        int Channel;
+        /** Index in m_Masters for scan mode events, CLOSE_EVENT when a
+         * closing channel is done closing, -1 otherwise */
+        int Master;
+        unsigned Generation;
+        bool operator> (const Event &other) const { return Due > other.Due; }
+    };
+
+    void Reset();
+    void HandleRequest(uint8_t channel, uint8_t message_id);
+    void HandleChannelMessage(uint8_t id, const uint8_t *data, int size);
+    void RunChannelPeriod(const Event &event, Clock::time_point now);
+    void RunScanPeriod(const Event &event, Clock::time_point now);
+    void Schedule(int channel, Clock::time_point due);
+    void ScheduleScan(int channel, int master, Clock::time_point due);
+    void OpenScanMode(int channel);
+    void CloseChannel(int channel);
+    void BeginClose(int channel);
+    void FinishClose(const Event &event);
+    void StartSearch(int channel, Clock::time_point now);
+    void ReleaseMaster(int channel);
+    void FinishAck(int channel, bool success);
+    int FindMaster(const Channel &c);
+    bool Matches(const Channel &c, const Master &m) const;
+    void ApplyAckData(Master &m, const Buffer &data);
+    void MakeBroadcast(Master &m, double t, uint8_t page[8]);
+    void AppendExtendedData(Buffer &data, const Master &m, Clock::time_point now) const;
+    void UpdateMaster(Master &m, double t);
+
+    void Reply(AntMessageId id, const Buffer &data);
+    void ChannelResponse(uint8_t channel, uint8_t message_id, AntChannelEvent event);
+    bool Chance(double probability);
+    double Seconds(Clock::time_point t) const;
+
+    uint32_t m_SerialNumber;
+    std::string m_Version;
+    int m_MaxNetworks;
+    /** Extended data flags set with LIB_CONFIG */
+    uint8_t m_LibConfig;
+
+    std::vector<Channel> m_Channels;
+    std::vector<Master> m_Masters;
+
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_Events;
+    std::deque<Buffer> m_Output;
+
+    double m_LossRate;
+    double m_CollisionRate;
+    double m_DropToSearchRate;
+
+    std::mt19937 m_Random;
+    Clock::time_point m_Start;
+
+    std::mutex m_Lock;
+    std::condition_variable m_Wakeup;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
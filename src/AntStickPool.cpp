@@ -0,0 +1,437 @@
+/**
+ *  AntStickPool -- use all attached ANT sticks together
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntStickPool.h"
+#include "Tools.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <thread>
+
+#include "winsock2.h" // for struct timeval
+
+namespace {
+
+/** Put a RecordingTransport around `transport' if there is a `recorder'. */
+std::unique_ptr<AntTransport> MaybeRecord(
+    std::unique_ptr<AntTransport> transport, SessionRecorder *recorder)
+{
+    if (! recorder)
+        return transport;
+    uint16_t source = recorder->NewSource();
+    return std::unique_ptr<AntTransport>(
+        new RecordingTransport(std::move(transport), recorder, source));
+}
+
+/** Return the USB device of `stick', nullptr if it is not a USB stick. */
+libusb_device* StickDevice(const AntStick &stick)
+{
+    auto transport = stick.GetTransport();
+    if (auto r = dynamic_cast<RecordingTransport*>(transport))
+        transport = r->GetTransport();
+    auto t = dynamic_cast<LibusbTransport*>(transport);
+    return t ? t->GetDevice() : nullptr;
+}
+
+/** Return `device' with a new reference, if it is still an attached ANT
+ * stick, nullptr otherwise. */
+libusb_device* StillAttached(libusb_device *device)
+{
+#if !defined (FAKE_CALL)
+    libusb_device **devs;
+    ssize_t count = libusb_get_device_list(nullptr, &devs);
+    if (count < 0)
+        return nullptr;
+    // libusb keeps the same libusb_device for as long as it is attached
+    libusb_device *found = nullptr;
+    for (ssize_t i = 0; i < count; i++) {
+        if (devs[i] == device && LibusbTransport::IsAntStick(devs[i])) {
+            found = libusb_ref_device(devs[i]);
+            break;
+        }
+    }
+    libusb_free_device_list(devs, 1);
+    return found;
+#else
+    return nullptr;
+#endif
+}
+
+};                                      // end anonymous namespace
+
+AntStickPool::AntStickPool()
+    : m_HotplugEnabled(false),
+      m_HotplugHandle(0),
+      m_HasNetworkKey(false),
+      m_EventDriven(false),
+      m_SeenReceived(0),
+      m_WaitTimeout(TIMEOUT),
+      m_HasUsbSticks(false),
+      m_Recorder(nullptr)
+{
+    std::fill(m_NetworkKey, m_NetworkKey + 8, 0);
+}
+
+AntStickPool::~AntStickPool()
+{
+#if !defined (FAKE_CALL)
+    if (m_HotplugEnabled)
+        libusb_hotplug_deregister_callback(nullptr, m_HotplugHandle);
+#endif
+
+    // Sticks still being initialized are waited for and destroyed with
+    // their futures.
+    m_StartingSticks.clear();
+
+    std::lock_guard<std::mutex> guard(m_HotplugLock);
+    for (auto d : m_Attached)
+        libusb_unref_device(d);
+    for (auto d : m_Removed)
+        libusb_unref_device(d);
+}
+
+int AntStickPool::AddUsbSticks()
+{
+    auto transports = LibusbTransport::OpenAll();
+    if (transports.empty())
+        throw AntStickNotFound();
+
+    for (auto &t : transports)
+        AddStick(std::move(t));
+    return static_cast<int>(transports.size());
+}
+
+AntStick* AntStickPool::AddStick(std::unique_ptr<AntTransport> transport)
+{
+    std::unique_ptr<AntStick> stick(new AntStick(MaybeRecord(std::move(transport), m_Recorder)));
+    if (m_HasNetworkKey)
+        stick->SetNetworkKey(m_NetworkKey);
+    return Insert(std::move(stick));
+}
+
+bool AntStickPool::EnableHotplug()
+{
+#if !defined (FAKE_CALL)
+    if (m_HotplugEnabled)
+        return true;
+    if (! libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return false;
+    int r = libusb_hotplug_register_callback(
+        nullptr,
+        static_cast<libusb_hotplug_event>(
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+        static_cast<libusb_hotplug_flag>(0),
+        LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+        HotplugCallback, this, &m_HotplugHandle);
+    if (r != LIBUSB_SUCCESS) {
+        LOG_MSG("%s\n", LibusbError("libusb_hotplug_register_callback", r).what());
+        return false;
+    }
+    m_HotplugEnabled = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+int AntStickPool::GetMaxChannels() const
+{
+    int count = 0;
+    for (auto &s : m_Sticks)
+        count += s->GetMaxChannels();
+    return count;
+}
+
+int AntStickPool::GetFreeChannels() const
+{
+    int count = 0;
+    for (auto &s : m_Sticks) {
+        if (! s->IsFailed())
+            count += s->GetFreeChannels();
+    }
+    return count;
+}
+
+AntStick* AntStickPool::LeastLoadedStick() const
+{
+    AntStick *best = nullptr;
+    int best_used = 0;
+    for (auto &s : m_Sticks) {
+        if (s->IsFailed())
+            continue;
+        int free = s->GetFreeChannels();
+        int used = s->GetMaxChannels() - free;
+        if (free > 0 && (best == nullptr || used < best_used)) {
+            best = s.get();
+            best_used = used;
+        }
+    }
+    return best;
+}
+
+void AntStickPool::SetNetworkKey(uint8_t key[8])
+{
+    std::copy(key, key + 8, m_NetworkKey);
+    m_HasNetworkKey = true;
+    for (auto &s : m_Sticks)
+        s->SetNetworkKey(m_NetworkKey);
+}
+
+void AntStickPool::SetEventDriven(bool event_driven)
+{
+    m_EventDriven = event_driven;
+    for (auto &s : m_Sticks)
+        s->SetEventDriven(event_driven);
+}
+
+void AntStickPool::SetEventThread(std::shared_ptr<LibusbEventThread> thread)
+{
+    SetEventDriven(thread != nullptr);
+    m_EventThread = thread;
+}
+
+/** Take the messages each stick already has, then wait once for any of them
+ * to receive more.  Waiting on each stick in turn would let an idle stick
+ * hold up the messages of a busy one.
+ */
+void AntStickPool::Tick()
+{
+    WaitForMessages(ProcessMessages());
+}
+
+bool AntStickPool::ProcessMessages()
+{
+    ProcessHotplugEvents();
+
+    // Data arriving from now on ends WaitForMessages()
+    m_SeenReceived = m_Received.Count();
+
+    bool received = false;
+    for (auto &s : m_Sticks) {
+        if (s->IsFailed())
+            continue;
+        try {
+            for (int n = 0; n < POOL_MAX_MESSAGES && s->Poll(); n++)
+                received = true;
+        }
+        catch (LibusbError &e) {
+            // Most likely the stick was unplugged and we have not been told
+            // yet, either way, it is of no use anymore.
+            LOG_MSG("%s\n", e.what());
+            s->Fail();
+        }
+    }
+
+    RemoveFailedSticks();
+    return received;
+}
+
+void AntStickPool::Wake()
+{
+    m_Received.Notify();
+#if !defined (FAKE_CALL)
+    // Tick() might be processing libusb events itself
+    if (! m_EventDriven && (m_HasUsbSticks || m_HotplugEnabled))
+        libusb_interrupt_event_handler(nullptr);
+#endif
+}
+
+/** Called by libusb, on whichever thread processes its events, so we only
+ * queue up the device here.  Opening the device is not allowed from a
+ * hotplug callback anyway.
+ */
+int LIBUSB_CALL AntStickPool::HotplugCallback(
+    libusb_context *, libusb_device *device,
+    libusb_hotplug_event event, void *user_data)
+{
+    if (! LibusbTransport::IsAntStick(device))
+        return 0;
+
+    AntStickPool *pool = static_cast<AntStickPool*>(user_data);
+    std::lock_guard<std::mutex> guard(pool->m_HotplugLock);
+    libusb_ref_device(device);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        pool->m_Attached.push_back(device);
+    else
+        pool->m_Removed.push_back(device);
+    // Tick() waits on the signal when a LibusbEventThread calls us
+    pool->m_Received.Notify();
+    return 0;                           // keep the callback registered
+}
+
+/** Start the sticks which were attached and fail the ones which were removed.
+ * Starting a stick involves resetting it and waiting for its responses, which
+ * takes a few seconds, so this is done on a separate thread, and the stick
+ * is added to the pool once it is ready.
+ */
+void AntStickPool::ProcessHotplugEvents()
+{
+    std::vector<libusb_device*> attached, removed;
+    {
+        std::lock_guard<std::mutex> guard(m_HotplugLock);
+        attached.swap(m_Attached);
+        removed.swap(m_Removed);
+    }
+
+    auto OwnedBy = [](const std::unique_ptr<AntStick> &s, libusb_device *d) {
+        return StickDevice(*s) == d;
+    };
+
+    for (auto d : attached) {
+        bool owned = std::any_of(
+            m_Sticks.begin(), m_Sticks.end(),
+            [&](const std::unique_ptr<AntStick> &s) { return OwnedBy(s, d); });
+        if (owned) {
+            // Already opened by AddUsbSticks()
+            libusb_unref_device(d);
+            continue;
+        }
+
+        std::array<uint8_t, 8> key;
+        std::copy(m_NetworkKey, m_NetworkKey + 8, key.begin());
+        bool has_key = m_HasNetworkKey;
+        SessionRecorder *recorder = m_Recorder;
+        m_StartingSticks.push_back(std::async(std::launch::async, [d, key, has_key, recorder]() mutable {
+            // The transport takes over our reference to the device
+            std::unique_ptr<AntStick> stick(new AntStick(
+                MaybeRecord(std::unique_ptr<AntTransport>(new LibusbTransport(d)), recorder)));
+            if (has_key)
+                stick->SetNetworkKey(key.data());
+            return stick;
+        }));
+    }
+
+    for (auto d : removed) {
+        for (auto &s : m_Sticks) {
+            if (OwnedBy(s, d) && ! s->IsFailed()) {
+                LOG_MSG("AntStickPool: stick removed\n");
+                s->Fail();
+            }
+        }
+        libusb_unref_device(d);
+    }
+
+    for (auto f = m_StartingSticks.begin(); f != m_StartingSticks.end(); ) {
+        if (f->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            ++f;
+            continue;
+        }
+        try {
+            Insert(f->get());
+            LOG_MSG("AntStickPool: stick added\n");
+        }
+        catch (std::exception &e) {
+            LOG_MSG("%s\n", e.what());
+        }
+        f = m_StartingSticks.erase(f);
+    }
+}
+
+/** Destroy the failed sticks, once all their channels are gone.  The owners
+ * of these channels find them closed and will create new ones, on the
+ * remaining sticks.
+ *
+ * A USB stick which failed but is still attached had a transient error
+ * rather than being unplugged, it is started again like a newly attached
+ * one.
+ */
+void AntStickPool::RemoveFailedSticks()
+{
+    auto Kept = [](const std::unique_ptr<AntStick> &s) {
+        return ! s->IsFailed() || s->GetFreeChannels() != s->GetMaxChannels();
+    };
+    auto end = std::stable_partition(m_Sticks.begin(), m_Sticks.end(), Kept);
+    if (end == m_Sticks.end())
+        return;
+
+    std::vector<libusb_device*> restart;
+    for (auto s = end; s != m_Sticks.end(); ++s) {
+        libusb_device *d = StickDevice(**s);
+        if (d && (d = StillAttached(d)) != nullptr)
+            restart.push_back(d);
+    }
+
+    // Closes the devices, before they are opened again
+    m_Sticks.erase(end, m_Sticks.end());
+    UpdateWaitTimeout();
+
+    if (! restart.empty()) {
+        LOG_MSG("AntStickPool: restarting failed stick\n");
+        std::lock_guard<std::mutex> guard(m_HotplugLock);
+        m_Attached.insert(m_Attached.end(), restart.begin(), restart.end());
+    }
+}
+
+AntStick* AntStickPool::Insert(std::unique_ptr<AntStick> stick)
+{
+    if (m_EventDriven)
+        stick->SetEventDriven(true);
+    stick->SetReceiveSignal(&m_Received);
+    m_Sticks.push_back(std::move(stick));
+    UpdateWaitTimeout();
+    return m_Sticks.back().get();
+}
+
+/** USB sticks end the wait in Tick() as soon as they receive data, and so do
+ * hotplug events, other transports only produce messages when they are read,
+ * so with one of these Tick() needs to come around regularly.
+ */
+void AntStickPool::UpdateWaitTimeout()
+{
+    m_HasUsbSticks = false;
+    bool all_usb = true;
+    for (auto &s : m_Sticks) {
+        if (StickDevice(*s))
+            m_HasUsbSticks = true;
+        else
+            all_usb = false;
+    }
+    m_WaitTimeout = all_usb ? TIMEOUT : POOL_READ_TIMEOUT;
+}
+
+/** Wait for any stick to receive data, or for a stick to be attached or
+ * removed, unless the sticks already had messages, in which case libusb
+ * still gets to complete the transfers.  Without sticks, this only waits
+ * for hotplug events.  In event driven mode the USB sticks
+ * and HotplugCallback() notify m_Received, otherwise we process the libusb
+ * events, which returns once a transfer completed or a hotplug event was
+ * delivered.  libusb is only polled when no LibusbEventThread does it.
+ */
+void AntStickPool::WaitForMessages(bool received)
+{
+    unsigned timeout = received ? 0 : m_WaitTimeout;
+    if (m_EventDriven) {
+        if (timeout > 0)
+            m_SeenReceived = m_Received.Wait(m_SeenReceived, timeout);
+        return;
+    }
+#if !defined (FAKE_CALL)
+    if (m_HasUsbSticks || m_HotplugEnabled) {
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        int r = libusb_handle_events_timeout_completed(nullptr, &tv, nullptr);
+        if (r < 0)
+            LOG_MSG("%s\n", LibusbError("libusb_handle_events", r).what());
+        return;
+    }
+#endif
+    if (timeout > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+}
@@ -0,0 +1,171 @@
+/**
+ *  AntStickPool -- use all attached ANT sticks together
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "AntStick.h"
+#include "SessionRecording.h"
+
+/** A set of ANT sticks used as one: new channels are placed on the stick
+ * with the fewest channels in use, and Tick() processes the messages of all
+ * sticks, waiting for any of them to receive more.  A single stick only has a handful of channels (see
+ * AntStick::GetMaxChannels()), a pool has the channels of all attached sticks.
+ *
+ * With hotplug enabled, sticks attached later are initialized in the
+ * background and join the pool once ready.  A stick which is unplugged, or
+ * whose USB transfers fail, only closes its own channels: it is removed from
+ * the pool once they are all destroyed, the other sticks are not affected.
+ * A USB stick which failed while staying attached is started again.
+ *
+ * The pool owns its sticks, channels created on them need to be destroyed
+ * before the pool.
+ */
+class AntStickPool
+{
+public:
+    enum {
+        /** How long Tick() waits at most, when a stick can't wake it up,
+         * see UpdateWaitTimeout(). */
+        POOL_READ_TIMEOUT = 10,
+        /** Messages Tick() processes from one stick before moving on to the
+         * next one, so a busy stick does not hold up the others. */
+        POOL_MAX_MESSAGES = 32
+    };
+
+    AntStickPool();
+    ~AntStickPool();
+
+    /** Open all attached ANT sticks, return the number of sticks added.
+     * Throws AntStickNotFound if there are none. */
+    int AddUsbSticks();
+
+    /** Add a stick using `transport'.  The network key and event driven
+     * mode of the pool are applied to it. */
+    AntStick* AddStick(std::unique_ptr<AntTransport> transport);
+
+    /** Watch for ANT sticks being attached and removed, using libusb
+     * hotplug events.  These are delivered while libusb events are
+     * processed, by a LibusbEventThread or by Tick().  Returns false if
+     * hotplug is not supported on this platform. */
+    bool EnableHotplug();
+
+    int GetStickCount() const { return static_cast<int>(m_Sticks.size()); }
+    AntStick* GetStick(int n) const { return m_Sticks[n].get(); }
+
+    /** Channels of all sticks */
+    int GetMaxChannels() const;
+
+    /** Channels available for new AntChannel instances on all sticks */
+    int GetFreeChannels() const;
+
+    /** Return the stick with the fewest channels in use, which has at least
+     * one free channel, or nullptr if all sticks are full. */
+    AntStick* LeastLoadedStick() const;
+
+    void SetNetworkKey(uint8_t key[8]);
+
+    /** Record the messages of the sticks added from now on to `recorder',
+     * each stick as its own source.  The recorder must outlive the pool. */
+    void SetRecorder(SessionRecorder *recorder) { m_Recorder = recorder; }
+
+    void SetEventDriven(bool event_driven);
+    bool IsEventDriven() const { return m_EventDriven; }
+
+    /** Put the sticks in event driven mode, with `thread' processing the
+     * libusb events.  The pool keeps the thread running until its sticks are
+     * destroyed, so the owner can release it while the pool is still in
+     * use.  Passing nullptr goes back to polling. */
+    void SetEventThread(std::shared_ptr<LibusbEventThread> thread);
+
+    /** Process the messages all sticks have received, see AntStick::Poll(),
+     * and handle sticks being attached and removed.  If there were none,
+     * wait for any stick to receive more. */
+    void Tick();
+
+    /** The two halves of Tick(), for callers which need to hold a lock
+     * while channels change state, but not while waiting.
+     * ProcessMessages() returns true if any stick had messages, which
+     * WaitForMessages() needs to know. */
+    bool ProcessMessages();
+    void WaitForMessages(bool received);
+
+    /** Make a Tick() waiting on another thread return early. */
+    void Wake();
+
+    /** Notified by channels on the pool when they have new readings, if they
+     * were given this signal with AntChannel::SetUpdateSignal(). */
+    UpdateSignal* GetUpdateSignal() { return &m_UpdateSignal; }
+
+private:
+    static int LIBUSB_CALL HotplugCallback(
+        libusb_context *ctx, libusb_device *device,
+        libusb_hotplug_event event, void *user_data);
+
+    AntStick* Insert(std::unique_ptr<AntStick> stick);
+    void ProcessHotplugEvents();
+    void RemoveFailedSticks();
+    void UpdateWaitTimeout();
+
+    /** Declared before the sticks, so it is released after them. */
+    std::shared_ptr<LibusbEventThread> m_EventThread;
+
+    std::vector<std::unique_ptr<AntStick>> m_Sticks;
+
+    /** Sticks being initialized in the background. */
+    std::list<std::future<std::unique_ptr<AntStick>>> m_StartingSticks;
+
+    bool m_HotplugEnabled;
+    libusb_hotplug_callback_handle m_HotplugHandle;
+
+    /** Devices reported by HotplugCallback(), and failed sticks to restart,
+     * we hold a reference to each of them.  Protected by m_HotplugLock, as
+     * the callback runs on the libusb event thread. */
+    std::mutex m_HotplugLock;
+    std::vector<libusb_device*> m_Attached;
+    std::vector<libusb_device*> m_Removed;
+
+    /** Network key set on all sticks, including the ones added later. */
+    uint8_t m_NetworkKey[8];
+    bool m_HasNetworkKey;
+
+    bool m_EventDriven;
+
+    /** Notified by the USB sticks in event driven mode when they receive
+     * data, see AntStick::SetReceiveSignal(), and by HotplugCallback(). */
+    UpdateSignal m_Received;
+    uint32_t m_SeenReceived;
+
+    /** How long Tick() waits for messages, and whether it has USB sticks,
+     * whose transfers complete while it processes libusb events. */
+    unsigned m_WaitTimeout;
+    bool m_HasUsbSticks;
+
+    SessionRecorder *m_Recorder;
+
+    UpdateSignal m_UpdateSignal;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,158 @@
+/**
+ *  AntStreamTransport -- exchange ANT messages over files, pipes and ptys
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "AntStreamTransport.h"
+#include "Tools.h"
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <chrono>
+#include <system_error>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+
+int OpenOrThrow(const std::string &path, int flags)
+{
+    int fd = open(path.c_str(), flags | O_NOCTTY);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open(" + path + ")");
+    return fd;
+}
+
+};                                      // end anonymous namespace
+
+AntStreamTransport::AntStreamTransport(const std::string &path)
+    : m_ReadFd(-1),
+      m_WriteFd(-1),
+      m_OwnsFds(true)
+{
+    m_ReadFd = OpenOrThrow(path, O_RDWR);
+    m_WriteFd = m_ReadFd;
+}
+
+AntStreamTransport::AntStreamTransport(
+    const std::string &input, const std::string &output)
+    : m_ReadFd(-1),
+      m_WriteFd(-1),
+      m_OwnsFds(true)
+{
+    m_ReadFd = OpenOrThrow(input, O_RDONLY);
+    try {
+        m_WriteFd = OpenOrThrow(output, O_WRONLY);
+    }
+    catch (...) {
+        close(m_ReadFd);
+        throw;
+    }
+}
+
+AntStreamTransport::AntStreamTransport(int read_fd, int write_fd)
+    : m_ReadFd(read_fd),
+      m_WriteFd(write_fd),
+      m_OwnsFds(false)
+{
+    // empty
+}
+
+AntStreamTransport::~AntStreamTransport()
+{
+    if (m_OwnsFds) {
+        if (m_WriteFd != m_ReadFd)
+            close(m_WriteFd);
+        close(m_ReadFd);
+    }
+}
+
+void AntStreamTransport::WriteMessage(const AntMessage &message)
+{
+    size_t written = 0;
+    while (written < message.size()) {
+        ssize_t r = write(m_WriteFd, message.data() + written, message.size() - written);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category(), "AntStreamTransport -- write()");
+        }
+        written += r;
+    }
+}
+
+/** Fill `message' with the next available message, waiting up to the read
+ * timeout for data to arrive.  At the end of a file (or when the other end of a pipe
+ * is closed) this simply times out.
+ */
+void AntStreamTransport::MaybeGetNextMessage(Buffer &message)
+{
+    message.clear();
+
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(m_ReadTimeout);
+
+    for (;;) {
+        switch (m_Ring.ExtractMessage(message, m_LastArrival)) {
+        case AntMessageRing::FRAME_OK:
+            return;
+        case AntMessageRing::FRAME_BAD_CHECKSUM:
+            throw std::runtime_error("AntStreamTransport -- bad checksum");
+        default:
+            break;
+        }
+
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
+            return;
+
+        struct pollfd pfd;
+        pfd.fd = m_ReadFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int r = poll(&pfd, 1, static_cast<int>(remaining));
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category(), "AntStreamTransport -- poll()");
+        }
+        if (r == 0)
+            return;                     // timed out
+
+        uint8_t data[256];
+        ssize_t n = read(m_ReadFd, data, std::min<size_t>(sizeof(data), m_Ring.Free()));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            throw std::system_error(errno, std::generic_category(), "AntStreamTransport -- read()");
+        }
+        if (n == 0) {
+            // End of stream, no more messages will arrive.  Don't return
+            // early, callers would just spin calling us again.
+            std::this_thread::sleep_until(deadline);
+            return;
+        }
+        m_Ring.Append(data, static_cast<unsigned>(n), CurrentNanoseconds());
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ *  AntStreamTransport -- exchange ANT messages over files, pipes and ptys
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <string>
+#include "AntStick.h"
+
+#if !defined(_WIN32)
+
+/** Transport reading and writing raw, framed ANT byte streams from file
+ * descriptors instead of an USB device.  The other end is expected to behave
+ * like the stick: a recorded stream in a file, a pipe to a simulator or a
+ * pseudo-terminal.  This allows running AntStick (and everything above it)
+ * on a machine with no stick attached.
+ */
+class AntStreamTransport : public AntTransport
+{
+public:
+    /** Open `path' for both reading and writing, e.g. a pseudo-terminal or a
+     * FIFO. */
+    explicit AntStreamTransport(const std::string &path);
+
+    /** Read the stick side of the stream from `input' and write the
+     * messages we send to `output' (which can be /dev/null). */
+    AntStreamTransport(const std::string &input, const std::string &output);
+
+    /** Use already open file descriptors.  They are not closed by the
+     * transport. */
+    AntStreamTransport(int read_fd, int write_fd);
+
+    ~AntStreamTransport();
+
+    void WriteMessage(const AntMessage &message) override;
+    void MaybeGetNextMessage(Buffer &message) override;
+
+private:
+    int m_ReadFd;
+    int m_WriteFd;
+    bool m_OwnsFds;
+
+    /** Hold partial data read from the stream. */
+    AntMessageRing m_Ring;
+};
+
+#endif
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
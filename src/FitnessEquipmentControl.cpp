@@ -36,6 +36,18 @@ FitnessEquipmentControl::FitnessEquipmentControl(AntStick *stick, uint32_t devic
                  CHANNEL_PERIOD,
                  SEARCH_TIMEOUT,
                  CHANNEL_FREQUENCY)
+{
+    InitParameters();
+    LOG_MSG("Created instance of Bike Control\n");
+}
+
+FitnessEquipmentControl::FitnessEquipmentControl(const AntChannel::Id &id)
+    : AntChannel(id)
+{
+    InitParameters();
+}
+
+void FitnessEquipmentControl::InitParameters()
 {
     // Set some reasonable defaults for all parameters
     m_UpdateUserConfig = true;
@@ -66,18 +78,22 @@ FitnessEquipmentControl::FitnessEquipmentControl(AntStick *stick, uint32_t devic
     m_SpinDownCalibrationRequired = false;
     m_UserConfigurationRequired = false;
 
-    // Trainer output parameters
-    auto ts = CurrentMilliseconds();
-    m_InstantPowerTimestamp = ts;
+    // Trainer output parameters, nothing received yet
+    m_InstantPowerTimestamp = 0;
     m_InstantPower = 0;
-    m_InstantSpeedTimestamp = ts;
+    m_InstantSpeedTimestamp = 0;
     m_InstantSpeed = 0;
     m_InstantSpeedIsVirtual = false;
-    m_InstantCadenceTimestamp = ts;
+    m_InstantCadenceTimestamp = 0;
     m_InstantCadence = 0;
+    m_TrainerStateTimestamp = 0;
     m_TrainerState = STATE_RESERVED;
+    m_PowerArrival = 0;
+    m_SpeedArrival = 0;
     m_SimulationState = TS_AT_TARGET_POWER;
-    LOG_MSG("Created instance of Bike Control\n");
+    ResetPowerEvents();
+    m_PowerStats.EnableNormalizedPower();
+    PublishReadings();
 }
 
 double FitnessEquipmentControl::InstantPower() const
@@ -91,7 +107,7 @@ double FitnessEquipmentControl::InstantPower() const
 
 double FitnessEquipmentControl::InstantSpeed() const
 {
-    if ((CurrentMilliseconds() - m_InstantPowerTimestamp) > STALE_TIMEOUT) {
+    if ((CurrentMilliseconds() - m_InstantSpeedTimestamp) > STALE_TIMEOUT) {
         return 0;
     } else {
         return m_InstantSpeed;
@@ -105,13 +121,56 @@ bool FitnessEquipmentControl::InstantSpeedIsVirtual() const
 
 double FitnessEquipmentControl::InstantCadence() const
 {
-    if ((CurrentMilliseconds() - m_InstantPowerTimestamp) > STALE_TIMEOUT) {
+    if ((CurrentMilliseconds() - m_InstantCadenceTimestamp) > STALE_TIMEOUT) {
         return 0;
     } else {
         return m_InstantCadence;
     }
 }
 
+FitnessEquipmentControl::Readings FitnessEquipmentControl::LatestReadings() const
+{
+    Readings r = m_Readings.Load();
+    auto now = CurrentMilliseconds();
+    if ((now - r.PowerTimestamp) > STALE_TIMEOUT)
+        r.Power = 0;
+    if ((now - r.SpeedTimestamp) > STALE_TIMEOUT)
+        r.Speed = 0;
+    if ((now - r.CadenceTimestamp) > STALE_TIMEOUT)
+        r.Cadence = 0;
+    return r;
+}
+
+double FitnessEquipmentControl::AveragePower(const Readings &start, const Readings &end)
+{
+    uint32_t events = end.PowerEvents - start.PowerEvents;
+    if (events == 0)
+        return 0;
+    return double(end.AccumulatedPower - start.AccumulatedPower) / events;
+}
+
+void FitnessEquipmentControl::PublishReadings()
+{
+    Readings r;
+    r.Power = m_InstantPower;
+    r.Speed = m_InstantSpeed;
+    r.SpeedIsVirtual = m_InstantSpeedIsVirtual;
+    r.Cadence = m_InstantCadence;
+    r.State = m_TrainerState;
+    r.Simulation = m_SimulationState;
+    r.PowerTimestamp = m_InstantPowerTimestamp;
+    r.SpeedTimestamp = m_InstantSpeedTimestamp;
+    r.CadenceTimestamp = m_InstantCadenceTimestamp;
+    r.StateTimestamp = m_TrainerStateTimestamp;
+    r.PowerArrival = m_PowerArrival;
+    r.SpeedArrival = m_SpeedArrival;
+    r.AccumulatedPower = m_AccumulatedPower;
+    r.PowerEvents = m_PowerEvents;
+    r.EventPower = m_EventPower;
+    m_Readings.Store(r);
+    NotifyUpdate();
+}
+
 void FitnessEquipmentControl::SetUserParams(
     double user_weight,
     double bike_weight,
@@ -131,9 +190,11 @@ void FitnessEquipmentControl::OnMessageReceived(const uint8_t *data, int size)
     switch(data[4]) {
     case DP_GENERAL:
         ProcessGeneralPage(data + 4, size - 4);
+        PublishReadings();
         break;
     case DP_TRAINER_SPECIFIC:
         ProcessTrainerSpecificPage(data + 4, size - 4);
+        PublishReadings();
         break;
     case DP_FE_CAPABILITIES:
         ProcessCapabilitiesPage(data + 4, size - 4);
@@ -169,15 +230,16 @@ void FitnessEquipmentControl::SendUserConfigPage()
     // The 10 mm part of wheel size
     uint16_t ws1 = static_cast<uint16_t>(m_BikeWheelDiameter / 0.001) - ws * 10;
 
-    Buffer msg;
-    msg.push_back(DP_USER_CONFIG);
-    msg.push_back(uw & 0xFF);
-    msg.push_back((uw >> 8) & 0xFF);
-    msg.push_back(0xFF);            // reserved
-    msg.push_back((ws1 & 0x3) | ((bw | 0x03) << 4));
-    msg.push_back((bw >> 4) & 0xFF);
-    msg.push_back(ws & 0xFF);
-    msg.push_back(0x00);            // gear ratio -- we send invalid value
+    const uint8_t msg[8] = {
+        DP_USER_CONFIG,
+        static_cast<uint8_t>(uw & 0xFF),
+        static_cast<uint8_t>((uw >> 8) & 0xFF),
+        0xFF,                       // reserved
+        static_cast<uint8_t>((ws1 & 0x3) | ((bw | 0x03) << 4)),
+        static_cast<uint8_t>((bw >> 4) & 0xFF),
+        static_cast<uint8_t>(ws & 0xFF),
+        0x00                        // gear ratio -- we send invalid value
+    };
 
     SendAcknowledgedData(DP_USER_CONFIG, msg);
     m_UpdateUserConfig = false;
@@ -192,8 +254,11 @@ void FitnessEquipmentControl::ProcessGeneralPage(
     uint8_t speed_lsb = data[4];
     uint8_t speed_msb = data[5];
     m_InstantSpeedTimestamp = CurrentMilliseconds();
+    m_TrainerStateTimestamp = m_InstantSpeedTimestamp;
+    m_SpeedArrival = MessageArrival();
     m_InstantSpeed = ((speed_msb << 8) + speed_lsb) * 0.001;
     m_InstantSpeedIsVirtual = (capabilities & 0x3) != 0;
+    m_SpeedStats.Add(m_InstantSpeedTimestamp, m_InstantSpeed);
     m_EquipmentType = static_cast<EquipmentType>(data[1] & 0x1F);
 }
 
@@ -207,17 +272,57 @@ void FitnessEquipmentControl::ProcessTrainerSpecificPage(
     uint8_t power_lsb = data[5];
     uint8_t power_msb = data[6] & 0x0F;
     auto ts = CurrentMilliseconds();
+    AccumulatePower(data[1], static_cast<uint16_t>(data[3] | (data[4] << 8)), ts);
     m_InstantPowerTimestamp = ts;
+    m_PowerArrival = MessageArrival();
     m_InstantPower = (power_msb << 8) + power_lsb;
     m_SimulationState = static_cast<SimulationState>(flags & 0x03);
-    m_InstantPowerTimestamp = ts;
+    m_TrainerStateTimestamp = ts;
+    m_InstantCadenceTimestamp = ts;
     m_InstantCadence = data[2];
+    m_PowerStats.Add(ts, m_InstantPower);
+    m_CadenceStats.Add(ts, m_InstantCadence);
     m_ZeroOffsetCalibrationRequired = (trainer_status & 0x01) != 0;
     m_SpinDownCalibrationRequired = (trainer_status & 0x02) != 0;
     m_UserConfigurationRequired = (trainer_status & 0x04) != 0;
     m_UpdateUserConfig = m_UpdateUserConfig | m_UserConfigurationRequired;
 }
 
+/** Add the power events since the previous trainer specific page.  The event
+ * count rolls over after 256 events and the accumulated power after 65536
+ * watts, which is more than a trainer produces in a few seconds, so unless
+ * we have not heard from it for longer, the differences are exact.
+ */
+void FitnessEquipmentControl::AccumulatePower(
+    uint8_t event_count, uint16_t accumulated_power, uint32_t now)
+{
+    if (m_HavePowerEvent && (now - m_InstantPowerTimestamp) <= STALE_TIMEOUT) {
+        int events = (event_count - m_LastEventCount) & 0xFF;
+        if (events > 0) {
+            uint16_t power = static_cast<uint16_t>(accumulated_power - m_LastAccumulatedPower);
+            m_AccumulatedPower += power;
+            m_PowerEvents += events;
+            m_EventPower = double(power) / events;
+            if (m_PowerListener)
+                m_PowerListener(m_EventPower, events);
+        }
+    }
+    // After a long silence, we start counting again from this page.
+    m_HavePowerEvent = true;
+    m_LastEventCount = event_count;
+    m_LastAccumulatedPower = accumulated_power;
+}
+
+void FitnessEquipmentControl::ResetPowerEvents()
+{
+    m_HavePowerEvent = false;
+    m_LastEventCount = 0;
+    m_LastAccumulatedPower = 0;
+    m_AccumulatedPower = 0;
+    m_PowerEvents = 0;
+    m_EventPower = 0;
+}
+
 void FitnessEquipmentControl::ProcessCapabilitiesPage(
     const uint8_t *data, int size)
 {
@@ -248,9 +353,9 @@ void FitnessEquipmentControl::ProcessCapabilitiesPage(
         LOG_MSG("Got trainer capabilities:\n");
         LOG_MSG("Max Resistance: "); LOG_F(m_MaxResistance); LOG_MSG(" Newtons\n");
         LOG_MSG("\tControl Modes:  ");
-        LOG_MSG((m_BasicResistanceControl ? "Basic Resistance" : ""));
-        LOG_MSG((m_TargetPowerControl ? "; Target Power" : ""));
-        LOG_MSG((m_SimulationControl ? "; Simulation" : ""));
+        LOG_MSG("%s", (m_BasicResistanceControl ? "Basic Resistance" : ""));
+        LOG_MSG("%s", (m_TargetPowerControl ? "; Target Power" : ""));
+        LOG_MSG("%s", (m_SimulationControl ? "; Simulation" : ""));
         LOG_MSG("\n");
     }
 }
@@ -289,12 +394,23 @@ void FitnessEquipmentControl::OnStateChanged (
         m_UserConfigurationRequired = false;
 
         // Trainer output parameters
+        m_InstantPowerTimestamp = 0;
         m_InstantPower = 0;
+        m_InstantSpeedTimestamp = 0;
         m_InstantSpeed = 0;
         m_InstantSpeedIsVirtual = false;
+        m_InstantCadenceTimestamp = 0;
         m_InstantCadence = 0;
+        m_TrainerStateTimestamp = 0;
         m_TrainerState = STATE_RESERVED;
+        m_PowerArrival = 0;
+        m_SpeedArrival = 0;
         m_SimulationState = TS_AT_TARGET_POWER;
+        ResetPowerEvents();
+        m_PowerStats.Reset();
+        m_SpeedStats.Reset();
+        m_CadenceStats.Reset();
+        PublishReadings();
     }
 }
 
@@ -307,17 +423,18 @@ void FitnessEquipmentControl::SetSlope(double slope)
 
 void FitnessEquipmentControl::SendTrackResistanceDataPage()
 {
-    Buffer msg;
-    msg.push_back(DP_TRACK_RESISTANCE);
-    msg.push_back(0xFF);
-    msg.push_back(0xFF);
-    msg.push_back(0xFF);
-    msg.push_back(0xFF);
     uint16_t raw_slope = static_cast<uint16_t>((m_Slope + 200.0) / 0.01);
-    msg.push_back(raw_slope & 0xFF);
-    msg.push_back((raw_slope >> 8) & 0xFF);
     uint8_t raw_rr = static_cast<uint8_t>(m_RollingResistance * 5e5);
-    msg.push_back(raw_rr);
+    const uint8_t msg[8] = {
+        DP_TRACK_RESISTANCE,
+        0xFF,
+        0xFF,
+        0xFF,
+        0xFF,
+        static_cast<uint8_t>(raw_slope & 0xFF),
+        static_cast<uint8_t>((raw_slope >> 8) & 0xFF),
+        raw_rr
+    };
     SendAcknowledgedData(DP_TRACK_RESISTANCE, msg);
 }
 
@@ -18,6 +18,8 @@
 #pragma once
 
 #include "AntStick.h"
+#include "RollingAggregator.h"
+#include "SeqLock.h"
 
 namespace BIKE {
 
@@ -50,6 +52,12 @@ namespace BIKE {
 /** Read data and control resistance from an ANT+ FE-C capable trainer.
  * Currently, instant power, speed and cadence can be read, and the slope can
  * be set.
+ *
+ * Average power is derived from the accumulated power and update event count
+ * of the trainer specific page, rather than by averaging instant power
+ * values: both counters roll over, but as long as we receive one page every
+ * few seconds, the power of the events in between is exact, even if some
+ * pages were lost.
  */
 class FitnessEquipmentControl : public AntChannel
 {
@@ -83,12 +91,74 @@ public:
     };
 
     FitnessEquipmentControl(AntStick *stick, uint32_t device_number = 0);
+    /** Create a detached decoder for the trainer `id', see AntScanChannel.
+     * The trainer can be monitored, but not controlled. */
+    explicit FitnessEquipmentControl(const AntChannel::Id &id);
 
     double InstantPower() const;
     double InstantSpeed() const;
     bool InstantSpeedIsVirtual() const;
     double InstantCadence() const;
 
+    /** The latest values received from the trainer. */
+    struct Readings {
+        double Power;
+        double Speed;
+        bool SpeedIsVirtual;
+        double Cadence;
+        TrainerState State;
+        SimulationState Simulation;
+        /** CurrentMilliseconds() when each value was received, 0 if it was
+         * not received yet */
+        uint32_t PowerTimestamp;
+        uint32_t SpeedTimestamp;
+        uint32_t CadenceTimestamp;
+        uint32_t StateTimestamp;
+        /** CurrentNanoseconds() when the last trainer specific page (power,
+         * cadence) and general page (speed) arrived from the stick, 0 if
+         * none yet */
+        uint64_t PowerArrival;
+        uint64_t SpeedArrival;
+        /** Sum of the power of all power events since the channel opened,
+         * in watts, this does not roll over. */
+        uint64_t AccumulatedPower;
+        /** Number of power events since the channel opened */
+        uint32_t PowerEvents;
+        /** Average power of the events reported by the last page */
+        double EventPower;
+    };
+
+    /** Return the latest readings, stale values are 0.  Unlike the
+     * Instant*() methods, this can be called from any thread and never
+     * blocks the thread receiving messages. */
+    Readings LatestReadings() const;
+
+    /** Average power, in watts, over the power events between `start' and
+     * `end', two readings of the same trainer.  Returns 0 if there were no
+     * events in between. */
+    static double AveragePower(const Readings &start, const Readings &end);
+
+    /** Called for each trainer specific page which reports new power
+     * events, with the average `power' of these `events'.  When pages are
+     * lost, the next one covers the events of the lost ones, so the series
+     * has neither gaps nor spikes. */
+    typedef std::function<void(double power, int events)> PowerListener;
+
+    /** Set the listener for power events, it is called on the thread
+     * receiving messages.  Set it before the channel receives messages. */
+    void SetPowerListener(PowerListener listener) { m_PowerListener = listener; }
+
+    /** Set the upper limits of the power zones, in watts, for the time in
+     * zone statistics.  Set them before the channel receives messages. */
+    void SetPowerZones(const std::vector<double> &limits) { m_PowerStats.SetZones(limits); }
+
+    /** Rolling statistics since the channel opened, these can be called
+     * from any thread.  The power statistics include the normalized
+     * power. */
+    MetricAggregates PowerStats() const { return m_PowerStats.Latest(); }
+    MetricAggregates SpeedStats() const { return m_SpeedStats.Latest(); }
+    MetricAggregates CadenceStats() const { return m_CadenceStats.Latest(); }
+
     EquipmentType GetEquipmentType() const { return m_EquipmentType; }
 
     void SetUserParams(
@@ -100,13 +170,17 @@ public:
     
 private:
 
+    void InitParameters();
     void OnMessageReceived(const uint8_t *data, int size) override;
     void SendUserConfigPage();
     void ProcessGeneralPage(const uint8_t *data, int size);
     void ProcessTrainerSpecificPage(const uint8_t *data, int size);
     void ProcessCapabilitiesPage(const uint8_t *data, int size);
+    void AccumulatePower(uint8_t event_count, uint16_t accumulated_power, uint32_t now);
+    void ResetPowerEvents();
     void OnAcknowledgedDataReply(int tag, AntChannelEvent event);
     void OnStateChanged (AntChannel::State old_state, AntChannel::State new_state) override;
+    void PublishReadings();
 
     void SendTrackResistanceDataPage();
 
@@ -163,11 +237,30 @@ private:
     bool m_InstantSpeedIsVirtual;
     uint32_t m_InstantCadenceTimestamp;
     double m_InstantCadence;
+    uint32_t m_TrainerStateTimestamp;
     TrainerState m_TrainerState;
+    uint64_t m_PowerArrival;
+    uint64_t m_SpeedArrival;
+
+    // Power events, from the trainer specific page
+    bool m_HavePowerEvent;
+    uint8_t m_LastEventCount;
+    uint16_t m_LastAccumulatedPower;
+    uint64_t m_AccumulatedPower;
+    uint32_t m_PowerEvents;
+    double m_EventPower;
+    PowerListener m_PowerListener;
+
+    // Rolling statistics of the trainer output
+    RollingAggregator m_PowerStats;
+    RollingAggregator m_SpeedStats;
+    RollingAggregator m_CadenceStats;
 
     // Only used if we are in target power mode, otherwise it is 0 --
     // TS_AT_TARGET_POWER
     SimulationState m_SimulationState;
+
+    SeqLock<Readings> m_Readings;
 };
 
 const char *EquipmentTypeAsString (FitnessEquipmentControl::EquipmentType et);
@@ -33,30 +33,153 @@ HeartRateMonitor::HeartRateMonitor (AntStick *stick, uint32_t device_number)
     : AntChannel(
         stick, 
         AntChannel::Id(ANT_DEVICE_TYPE, device_number),
-        CHANNEL_PERIOD, SEARCH_TIMEOUT, CHANNEL_FREQUENCY)
+        CHANNEL_PERIOD, SEARCH_TIMEOUT, CHANNEL_FREQUENCY),
+      m_ShortHrv(HRV_SHORT_WINDOW),
+      m_LongHrv(HRV_LONG_WINDOW)
 {
-    m_LastMeasurementTime = 0;
-    m_MeasurementTime = 0;
-    m_HeartBeats = 0;
     m_InstantHeartRate = 0;
     m_InstantHeartRateTimestamp = 0;
+    m_InstantHeartRateArrival = 0;
+    InitBeats();
     LOG_MSG("Created instance of HR Monitor\n");
 }
 
+HeartRateMonitor::HeartRateMonitor (const AntChannel::Id &id)
+    : AntChannel(id),
+      m_ShortHrv(HRV_SHORT_WINDOW),
+      m_LongHrv(HRV_LONG_WINDOW)
+{
+    m_InstantHeartRate = 0;
+    m_InstantHeartRateTimestamp = 0;
+    m_InstantHeartRateArrival = 0;
+    InitBeats();
+}
+
+/** Forget the beats received so far, the next message starts over.
+ */
+void HeartRateMonitor::InitBeats()
+{
+    m_LastMeasurementTime = 0;
+    m_MeasurementTime = 0;
+    m_HeartBeats = 0;
+    m_HaveBeat = false;
+    m_HavePages = false;
+    m_PageToggle = 0;
+    m_FollowsPrevious = false;
+    m_LastRr = 0;
+    m_Beats = 0;
+    m_MissedBeats = 0;
+    m_ShortHrv.Reset();
+    m_LongHrv.Reset();
+}
+
 void HeartRateMonitor::OnMessageReceived(const unsigned char *data, int size)
 {
     LOG_MSG("OnMessageReceived for HRM\n");
     if (data[2] != BROADCAST_DATA)
         return;
 
-    // NOTE: the last 3 values in the payload are always the same regardless
+    // NOTE: the last 4 values in the payload are always the same regardless
     // of the data page.  Also for the data page, we need to observe the
     // highest bit toggle, as old HRM's don't have data pages.
-    m_LastMeasurementTime = m_MeasurementTime;
-    m_MeasurementTime = data[8] + (data[9] << 8);
-    m_HeartBeats = data[10];
+    int page_toggle = data[4] & 0x80;
+    if (m_HaveBeat && page_toggle != m_PageToggle)
+        m_HavePages = true;
+    m_PageToggle = page_toggle;
+
+    int event_time = data[8] + (data[9] << 8);
+    int heart_beats = data[10];
+    auto now = CurrentMilliseconds();
+
+    // The event time rolls over every 64 seconds and the beat count every
+    // 256 beats, after a long silence we can't tell how many beats we
+    // missed.
+    if (m_HaveBeat && (now - m_InstantHeartRateTimestamp) > STALE_TIMEOUT)
+        m_HaveBeat = false;
+
+    if (! m_HaveBeat) {
+        m_HaveBeat = true;
+        m_FollowsPrevious = false;
+        m_LastMeasurementTime = event_time;
+        m_MeasurementTime = event_time;
+        m_HeartBeats = heart_beats;
+    } else {
+        int beats = (heart_beats - m_HeartBeats) & 0xFF;
+        if (beats > 0) {
+            int previous_event_time = -1;
+            if (m_HavePages && (data[4] & 0x7F) == DP_PREVIOUS_HEART_BEAT)
+                previous_event_time = data[6] + (data[7] << 8);
+            ProcessBeats(beats, event_time, previous_event_time);
+            m_LastMeasurementTime = m_MeasurementTime;
+            m_MeasurementTime = event_time;
+            m_HeartBeats = heart_beats;
+        }
+    }
+
     m_InstantHeartRate = data[11];
-    m_InstantHeartRateTimestamp = CurrentMilliseconds();
+    m_InstantHeartRateTimestamp = now;
+    m_InstantHeartRateArrival = MessageArrival();
+    m_HeartRateStats.Add(now, m_InstantHeartRate);
+    PublishReadings();
+}
+
+/** Produce the R-R intervals for `beats' new beats, the last one at
+ * `event_time'.  If more than one beat is new, we missed some broadcasts and
+ * interpolate the intervals of the missed beats.  `previous_event_time' is
+ * the time of the beat before the last one, if the HRM sent it (-1
+ * otherwise), the last interval is exact then.
+ */
+void HeartRateMonitor::ProcessBeats(int beats, int event_time, int previous_event_time)
+{
+    int span = (event_time - m_MeasurementTime) & 0xFFFF;
+    if (beats == 1) {
+        AddRrInterval(span, false);
+        return;
+    }
+
+    m_MissedBeats += beats - 1;
+    int interpolated = beats;
+    int last_rr = 0;
+    if (previous_event_time >= 0) {
+        last_rr = (event_time - previous_event_time) & 0xFFFF;
+        if (last_rr < span) {
+            interpolated = beats - 1;
+            span -= last_rr;
+        }
+    }
+
+    // Spread the remainder, so the intervals add up to the span
+    for (int i = 0; i < interpolated; i++) {
+        int rr = span * (i + 1) / interpolated - span * i / interpolated;
+        AddRrInterval(rr, true);
+    }
+    if (interpolated < beats)
+        AddRrInterval(last_rr, false);
+}
+
+/** Record the R-R interval `rr', in 1/1024 seconds.  Interpolated intervals
+ * are passed on to the listener, but they would distort the HRV metrics, so
+ * these only use measured ones.
+ */
+void HeartRateMonitor::AddRrInterval(int rr, bool interpolated)
+{
+    m_Beats++;
+    if (rr < MIN_RR || rr > MAX_RR) {
+        m_FollowsPrevious = false;
+        return;
+    }
+
+    m_LastRr = rr * 1000.0 / 1024.0;
+    if (m_RrListener)
+        m_RrListener(m_LastRr, interpolated);
+
+    if (interpolated) {
+        m_FollowsPrevious = false;
+        return;
+    }
+    m_ShortHrv.Add(static_cast<uint16_t>(rr), m_FollowsPrevious);
+    m_LongHrv.Add(static_cast<uint16_t>(rr), m_FollowsPrevious);
+    m_FollowsPrevious = true;
 }
 
 double HeartRateMonitor::InstantHeartRate() const 
@@ -68,16 +191,44 @@ double HeartRateMonitor::InstantHeartRate() const
     }
 }
 
+HeartRateMonitor::Readings HeartRateMonitor::LatestReadings() const
+{
+    Readings r = m_Readings.Load();
+    if ((CurrentMilliseconds() - r.Timestamp) > STALE_TIMEOUT)
+        r.HeartRate = 0;
+    return r;
+}
+
+void HeartRateMonitor::PublishReadings()
+{
+    Readings r;
+    r.HeartRate = m_InstantHeartRate;
+    r.Timestamp = m_InstantHeartRateTimestamp;
+    r.Arrival = m_InstantHeartRateArrival;
+    r.LastRr = m_LastRr;
+    r.Beats = m_Beats;
+    r.MissedBeats = m_MissedBeats;
+    r.ShortHrv.Rmssd = m_ShortHrv.Rmssd();
+    r.ShortHrv.Sdnn = m_ShortHrv.Sdnn();
+    r.ShortHrv.Intervals = m_ShortHrv.Count();
+    r.LongHrv.Rmssd = m_LongHrv.Rmssd();
+    r.LongHrv.Sdnn = m_LongHrv.Sdnn();
+    r.LongHrv.Intervals = m_LongHrv.Count();
+    m_Readings.Store(r);
+    NotifyUpdate();
+}
+
 void HeartRateMonitor::OnStateChanged (
     AntChannel::State old_state, AntChannel::State new_state)
 {
     if (new_state == AntChannel::CH_OPEN) {
         LOG_MSG("Connected to HRM with serial "); LOG_D(ChannelId().DeviceNumber);
      } else {
-        m_LastMeasurementTime = 0;
-        m_MeasurementTime = 0;
-        m_HeartBeats = 0;
+        InitBeats();
         m_InstantHeartRate = 0;
         m_InstantHeartRateTimestamp = 0;
+        m_InstantHeartRateArrival = 0;
+        m_HeartRateStats.Reset();
+        PublishReadings();
      }
 }
@@ -18,6 +18,9 @@
 #pragma once
 
 #include "AntStick.h"
+#include "HeartRateVariability.h"
+#include "RollingAggregator.h"
+#include "SeqLock.h"
 
 namespace HRM {
 
@@ -33,29 +36,118 @@ namespace HRM {
         STALE_TIMEOUT = 5000
     };
 
+    enum {
+        DP_PREVIOUS_HEART_BEAT = 4,
+
+        // RR intervals outside 30 - 240 BPM, in 1/1024 seconds, are
+        // rejected as bad readings.
+        MIN_RR = 256,
+        MAX_RR = 2048,
+
+        // Sliding windows for the HRV metrics, in milliseconds
+        HRV_SHORT_WINDOW = 60 * 1000,
+        HRV_LONG_WINDOW = 5 * 60 * 1000
+    };
+
 };                                      // end anonymous namespace
 
 /** Receive data from an ANT+ heart rate monitor. 
  *
- * @warning At this time, only the InstantHeartRate() is received and there is
- * no mechanism implemented to provide average HR information when broadcasts
- * are missed (as described in the profile document), "correct" R-R interval
- * measurement is also not implemented.
+ * Besides the heart rate, beat to beat (R-R) intervals are reconstructed from
+ * the heart beat event time and count, which are in every message.  When
+ * broadcasts are missed, the interval of the last beat is still exact if the
+ * HRM sends the previous heart beat time (data page 4), the missed beats in
+ * between are interpolated.  The intervals feed the HRV metrics, RMSSD and
+ * SDNN over a short and a long sliding window, see LatestReadings().
+ *
+ * @warning There is no mechanism implemented to provide average HR
+ * information when broadcasts are missed (as described in the profile
+ * document).
  **/
 class HeartRateMonitor : public AntChannel
 {
 public:
 
     HeartRateMonitor(AntStick *stick, uint32_t device_number = 0);
+    /** Create a detached decoder for the HRM `id', see AntScanChannel. */
+    explicit HeartRateMonitor(const AntChannel::Id &id);
     double InstantHeartRate() const;
 
+    /** Called for each R-R interval, `rr' is in milliseconds, `interpolated'
+     * is true for the intervals of missed beats. */
+    typedef std::function<void(double rr, bool interpolated)> RrListener;
+
+    /** Set the listener for R-R intervals, it is called on the thread
+     * receiving messages.  Set it before the channel receives messages. */
+    void SetRrListener(RrListener listener) { m_RrListener = listener; }
+
+    /** HRV metrics over one sliding window, in milliseconds. */
+    struct HrvMetrics {
+        double Rmssd;
+        double Sdnn;
+        /** Number of R-R intervals in the window */
+        int Intervals;
+    };
+
+    /** The latest values received from the HRM. */
+    struct Readings {
+        double HeartRate;
+        /** CurrentMilliseconds() when they were received. */
+        uint32_t Timestamp;
+        /** CurrentNanoseconds() when the message arrived from the stick, 0
+         * if none yet */
+        uint64_t Arrival;
+        /** The last R-R interval, in milliseconds, 0 if none yet */
+        double LastRr;
+        /** Beats seen since the channel opened, including missed ones */
+        uint32_t Beats;
+        /** Missed beats, their intervals were interpolated */
+        uint32_t MissedBeats;
+        /** Over HRV_SHORT_WINDOW and HRV_LONG_WINDOW */
+        HrvMetrics ShortHrv;
+        HrvMetrics LongHrv;
+    };
+
+    /** Return the latest readings, with a heart rate of 0 if they are
+     * stale.  Unlike InstantHeartRate(), this can be called from any thread
+     * and never blocks the thread receiving messages. */
+    Readings LatestReadings() const;
+
+    /** Set the upper limits of the heart rate zones, in BPM, for the time
+     * in zone statistics.  Set them before the channel receives messages. */
+    void SetHeartRateZones(const std::vector<double> &limits) { m_HeartRateStats.SetZones(limits); }
+
+    /** Rolling statistics of the heart rate since the channel opened, can be
+     * called from any thread. */
+    MetricAggregates HeartRateStats() const { return m_HeartRateStats.Latest(); }
+
 private:
     void OnMessageReceived(const unsigned char *data, int size) override;
     void OnStateChanged (AntChannel::State old_state, AntChannel::State new_state) override;
+    void PublishReadings();
+    void InitBeats();
+    void ProcessBeats(int beats, int event_time, int previous_event_time);
+    void AddRrInterval(int rr, bool interpolated);
     
     int m_LastMeasurementTime;
     int m_MeasurementTime;
     int m_HeartBeats;
+
+    // R-R interval reconstruction
+    bool m_HaveBeat;                    // m_MeasurementTime is valid
+    bool m_HavePages;                   // the page toggle bit has changed
+    int m_PageToggle;
+    bool m_FollowsPrevious;             // no beats lost since the last interval
+    double m_LastRr;
+    uint32_t m_Beats;
+    uint32_t m_MissedBeats;
+    HrvWindow m_ShortHrv;
+    HrvWindow m_LongHrv;
+    RrListener m_RrListener;
+
     uint32_t m_InstantHeartRateTimestamp;
+    uint64_t m_InstantHeartRateArrival;
     double m_InstantHeartRate;
+    RollingAggregator m_HeartRateStats;
+    SeqLock<Readings> m_Readings;
 };
@@ -0,0 +1,120 @@
+/**
+ *  HeartRateVariability -- streaming HRV metrics from RR intervals
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "HeartRateVariability.h"
+#include <cmath>
+
+namespace {
+
+enum {
+    // Shortest interval we size the ring buffer for (240 BPM), shorter ones
+    // still fit, but push out the oldest ones early.
+    MIN_EXPECTED_RR_MS = 250
+};
+
+/** Convert a value in 1/1024 seconds to milliseconds. */
+double ToMilliseconds(double v)
+{
+    return v * 1000.0 / 1024.0;
+}
+
+};                                      // end anonymous namespace
+
+HrvWindow::HrvWindow(uint32_t window_ms)
+    : m_Window(static_cast<uint32_t>(uint64_t(window_ms) * 1024 / 1000)),
+      m_Ring(window_ms / MIN_EXPECTED_RR_MS + 1),
+      m_Head(0),
+      m_Count(0),
+      m_Duration(0),
+      m_SumSquares(0),
+      m_SumSquaredDiffs(0),
+      m_DiffCount(0)
+{
+}
+
+void HrvWindow::Add(uint16_t rr, bool follows_previous)
+{
+    if (m_Count == m_Ring.size())
+        DropOldest();
+
+    if (m_Count > 0 && follows_previous) {
+        const Entry &last = m_Ring[(m_Head + m_Count - 1) % m_Ring.size()];
+        int64_t diff = int64_t(rr) - int64_t(last.Rr);
+        m_SumSquaredDiffs += diff * diff;
+        m_DiffCount++;
+    }
+
+    Entry &e = m_Ring[(m_Head + m_Count) % m_Ring.size()];
+    e.Rr = rr;
+    e.FollowsPrevious = (m_Count > 0 && follows_previous);
+    m_Count++;
+    m_Duration += rr;
+    m_SumSquares += uint64_t(rr) * rr;
+
+    // Keep the newest interval, even if it is longer than the window
+    while (m_Count > 1 && m_Duration > m_Window)
+        DropOldest();
+}
+
+/** Remove the oldest interval, along with its difference to the next one.
+ */
+void HrvWindow::DropOldest()
+{
+    const Entry &oldest = m_Ring[m_Head];
+    m_Duration -= oldest.Rr;
+    m_SumSquares -= uint64_t(oldest.Rr) * oldest.Rr;
+    m_Head = (m_Head + 1) % m_Ring.size();
+    m_Count--;
+
+    if (m_Count > 0) {
+        Entry &next = m_Ring[m_Head];
+        if (next.FollowsPrevious) {
+            int64_t diff = int64_t(next.Rr) - int64_t(oldest.Rr);
+            m_SumSquaredDiffs -= diff * diff;
+            m_DiffCount--;
+            next.FollowsPrevious = false;
+        }
+    }
+}
+
+void HrvWindow::Reset()
+{
+    m_Head = 0;
+    m_Count = 0;
+    m_Duration = 0;
+    m_SumSquares = 0;
+    m_SumSquaredDiffs = 0;
+    m_DiffCount = 0;
+}
+
+double HrvWindow::Rmssd() const
+{
+    if (m_DiffCount == 0)
+        return 0;
+    return ToMilliseconds(std::sqrt(double(m_SumSquaredDiffs) / m_DiffCount));
+}
+
+double HrvWindow::Sdnn() const
+{
+    if (m_Count < 2)
+        return 0;
+    // Sample variance, n * sum(x^2) - sum(x)^2 is exact in integers.
+    uint64_t n = m_Count;
+    uint64_t spread = n * m_SumSquares - m_Duration * m_Duration;
+    return ToMilliseconds(std::sqrt(double(spread) / double(n * (n - 1))));
+}
@@ -0,0 +1,77 @@
+/**
+ *  HeartRateVariability -- streaming HRV metrics from RR intervals
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+/** RMSSD and SDNN of the RR intervals received in the last `window'
+ * milliseconds of beats.  Intervals are kept in a ring buffer together with
+ * running sums, so adding one and dropping the ones which fall out of the
+ * window costs O(1), regardless of the window size.
+ *
+ * Intervals are in 1/1024 seconds, as sent by the HRM, and the sums are kept
+ * as integers, so they don't drift no matter how long the window runs.
+ */
+class HrvWindow
+{
+public:
+    HrvWindow(uint32_t window_ms);
+
+    /** Add the RR interval `rr', in 1/1024 seconds.  `follows_previous' is
+     * false if there were beats missed or rejected between the previous
+     * interval and this one, their difference is not used for RMSSD then. */
+    void Add(uint16_t rr, bool follows_previous);
+
+    void Reset();
+
+    /** Number of intervals in the window */
+    int Count() const { return static_cast<int>(m_Count); }
+
+    /** Root mean square of successive differences, in milliseconds, 0 if
+     * there are not enough intervals. */
+    double Rmssd() const;
+
+    /** Standard deviation of the intervals, in milliseconds, 0 if there are
+     * not enough intervals. */
+    double Sdnn() const;
+
+private:
+    struct Entry {
+        uint16_t Rr;
+        bool FollowsPrevious;
+    };
+
+    void DropOldest();
+
+    uint32_t m_Window;                  // in 1/1024 seconds
+    std::vector<Entry> m_Ring;
+    size_t m_Head;                      // index of the oldest entry
+    size_t m_Count;
+
+    uint64_t m_Duration;                // sum of the intervals
+    uint64_t m_SumSquares;              // sum of the squared intervals
+    uint64_t m_SumSquaredDiffs;         // sum of squared successive differences
+    uint32_t m_DiffCount;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
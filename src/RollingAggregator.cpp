@@ -0,0 +1,205 @@
+/**
+ *  RollingAggregator -- rolling statistics of a telemetry metric
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "RollingAggregator.h"
+#include <algorithm>
+#include <cmath>
+
+/** IMPLEMENTATION NOTE
+ *
+ * Normalized power is the fourth root of the mean of the fourth powers of
+ * the 30 second rolling average power (see "Training and Racing with a Power
+ * Meter", Allen and Coggan).  The rolling average is taken at each sample
+ * rather than once a second, which is the same for a trainer reporting at a
+ * steady rate.
+ */
+
+RollingAggregator::RollingAggregator()
+    : RollingAggregator(std::vector<uint32_t>{ 3 * 1000, 10 * 1000, 30 * 1000, 5 * 60 * 1000 })
+{
+}
+
+RollingAggregator::RollingAggregator(const std::vector<uint32_t> &windows)
+    : m_NormalizedPower(false)
+{
+    for (auto length : windows) {
+        if (length > 0 && m_Windows.size() < AGGREGATE_WINDOWS) {
+            Window w;
+            w.Length = length;
+            m_Windows.push_back(w);
+        }
+    }
+    m_NormalizedWindow.Length = NORMALIZED_POWER_WINDOW;
+
+    // The normalized power window is always allocated, so it can be enabled
+    // later without reallocating.
+    uint32_t longest = NORMALIZED_POWER_WINDOW;
+    for (auto &w : m_Windows)
+        longest = (std::max)(longest, w.Length);
+    size_t capacity = static_cast<size_t>(uint64_t(longest) * MAX_SAMPLE_RATE / 1000) + 1;
+
+    m_Samples.resize(capacity);
+    for (auto &w : m_Windows)
+        w.MaxQueue.resize(capacity);
+    m_NormalizedWindow.MaxQueue.resize(capacity);
+
+    Reset();
+}
+
+void RollingAggregator::SetZones(const std::vector<double> &limits)
+{
+    m_ZoneLimits.assign(limits.begin(),
+                        limits.begin() + (std::min)(limits.size(), size_t(AGGREGATE_ZONES - 1)));
+    std::fill(m_ZoneTime, m_ZoneTime + AGGREGATE_ZONES, 0);
+}
+
+void RollingAggregator::EnableNormalizedPower()
+{
+    if (m_NormalizedPower)
+        return;
+    // The window is left alone while disabled, start it at the next sample
+    m_NormalizedWindow.First = m_Next;
+    m_NormalizedWindow.Sum = 0;
+    m_NormalizedWindow.MaxHead = 0;
+    m_NormalizedWindow.MaxCount = 0;
+    m_NormalizedPower = true;
+}
+
+void RollingAggregator::Reset()
+{
+    m_Next = 0;
+    for (auto &w : m_Windows) {
+        w.First = 0;
+        w.Sum = 0;
+        w.MaxHead = 0;
+        w.MaxCount = 0;
+    }
+    m_NormalizedWindow.First = 0;
+    m_NormalizedWindow.Sum = 0;
+    m_NormalizedWindow.MaxHead = 0;
+    m_NormalizedWindow.MaxCount = 0;
+    m_SumFourthPowers = 0;
+    m_NormalizedCount = 0;
+    std::fill(m_ZoneTime, m_ZoneTime + AGGREGATE_ZONES, 0);
+    Publish();
+}
+
+void RollingAggregator::Add(uint32_t timestamp, double value)
+{
+    // The previous sample counts towards its zone until now
+    if (m_Next > 0) {
+        const Sample &previous = At(m_Next - 1);
+        uint32_t held = (std::min)(timestamp - previous.Timestamp, uint32_t(MAX_ZONE_HOLD));
+        m_ZoneTime[Zone(previous.Value)] += held;
+    }
+
+    // If samples come faster than MAX_SAMPLE_RATE, the buffer fills up
+    // before the samples fall out of the window, the oldest one is
+    // overwritten then.
+    for (auto &w : m_Windows) {
+        if (m_Next - w.First == m_Samples.size())
+            EvictOldest(w);
+    }
+    if (m_NormalizedPower && m_Next - m_NormalizedWindow.First == m_Samples.size())
+        EvictOldest(m_NormalizedWindow);
+
+    uint32_t sequence = m_Next++;
+    Sample &s = m_Samples[sequence % m_Samples.size()];
+    s.Timestamp = timestamp;
+    s.Value = value;
+
+    for (auto &w : m_Windows) {
+        Push(w, sequence, value);
+        Evict(w, timestamp);
+    }
+
+    if (m_NormalizedPower) {
+        Push(m_NormalizedWindow, sequence, value);
+        Evict(m_NormalizedWindow, timestamp);
+        double average = Mean(m_NormalizedWindow, m_Next);
+        m_SumFourthPowers += average * average * average * average;
+        m_NormalizedCount++;
+    }
+
+    Publish();
+}
+
+void RollingAggregator::Push(Window &w, uint32_t sequence, double value)
+{
+    w.Sum += value;
+    size_t capacity = w.MaxQueue.size();
+    while (w.MaxCount > 0
+           && At(w.MaxQueue[(w.MaxHead + w.MaxCount - 1) % capacity]).Value <= value)
+        w.MaxCount--;
+    w.MaxQueue[(w.MaxHead + w.MaxCount) % capacity] = sequence;
+    w.MaxCount++;
+}
+
+/** Drop the samples which are older than the window, the newest sample
+ * always stays.
+ */
+void RollingAggregator::Evict(Window &w, uint32_t now)
+{
+    while (m_Next - w.First > 1 && now - At(w.First).Timestamp >= w.Length)
+        EvictOldest(w);
+}
+
+void RollingAggregator::EvictOldest(Window &w)
+{
+    w.Sum -= At(w.First).Value;
+    if (w.MaxCount > 0 && w.MaxQueue[w.MaxHead] == w.First) {
+        w.MaxHead = (w.MaxHead + 1) % w.MaxQueue.size();
+        w.MaxCount--;
+    }
+    w.First++;
+}
+
+double RollingAggregator::Mean(const Window &w, uint32_t next)
+{
+    uint32_t count = next - w.First;
+    return count > 0 ? w.Sum / count : 0;
+}
+
+double RollingAggregator::Max(const Window &w) const
+{
+    return w.MaxCount > 0 ? At(w.MaxQueue[w.MaxHead]).Value : 0;
+}
+
+int RollingAggregator::Zone(double value) const
+{
+    int zone = 0;
+    while (zone < static_cast<int>(m_ZoneLimits.size()) && value >= m_ZoneLimits[zone])
+        zone++;
+    return zone;
+}
+
+void RollingAggregator::Publish()
+{
+    MetricAggregates a;
+    for (size_t i = 0; i < m_Windows.size(); i++) {
+        a.window[i] = m_Windows[i].Length;
+        a.mean[i] = Mean(m_Windows[i], m_Next);
+        a.peak[i] = Max(m_Windows[i]);
+    }
+    std::copy(m_ZoneTime, m_ZoneTime + AGGREGATE_ZONES, a.zone_time);
+    if (m_NormalizedCount > 0)
+        a.normalized = std::pow(m_SumFourthPowers / m_NormalizedCount, 0.25);
+    a.samples = m_Next;
+    a.last_time = m_Next > 0 ? At(m_Next - 1).Timestamp : 0;
+    m_Published.Store(a);
+}
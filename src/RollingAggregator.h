@@ -0,0 +1,124 @@
+/**
+ *  RollingAggregator -- rolling statistics of a telemetry metric
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "structures.h"
+#include "SeqLock.h"
+
+/** Maintain the mean and maximum of a metric over several sliding time
+ * windows (3 seconds, 10 seconds, 30 seconds and 5 minutes by default), the
+ * time spent in each zone and optionally the normalized power.
+ *
+ * All windows share one ring buffer holding the samples of the longest
+ * window, each window keeps a running sum and a monotonic queue of the
+ * candidates for its maximum, so adding a sample costs O(1) (amortized for
+ * the maximum), regardless of the window lengths.  The buffers are allocated
+ * up front, for at most MAX_SAMPLE_RATE samples per second.
+ *
+ * Samples are added by the thread receiving messages, the statistics are
+ * published after each sample and Latest() can be called from any thread.
+ * Everything else must be called on the receiving thread, or before the
+ * channel receives messages.
+ */
+class RollingAggregator
+{
+public:
+    enum {
+        MAX_SAMPLE_RATE = 8,            // samples per second
+
+        // Normalized power uses the 30 second rolling average
+        NORMALIZED_POWER_WINDOW = 30 * 1000,
+
+        // A sample counts towards its zone until the next one, but no
+        // longer than this many milliseconds.
+        MAX_ZONE_HOLD = 5000
+    };
+
+    /** Create an aggregator with the default windows. */
+    RollingAggregator();
+
+    /** Create an aggregator with `windows', their lengths in milliseconds.
+     * At most AGGREGATE_WINDOWS are used. */
+    explicit RollingAggregator(const std::vector<uint32_t> &windows);
+
+    /** Set the upper limits of the zones, in increasing order.  With N
+     * limits there are N + 1 zones, at most AGGREGATE_ZONES. */
+    void SetZones(const std::vector<double> &limits);
+
+    /** Also compute normalized power, for a power metric. */
+    void EnableNormalizedPower();
+
+    /** Add `value', sampled at `timestamp' (CurrentMilliseconds()). */
+    void Add(uint32_t timestamp, double value);
+
+    /** Forget all samples and statistics, the configuration is kept. */
+    void Reset();
+
+    /** The statistics as of the last sample, can be called from any
+     * thread. */
+    MetricAggregates Latest() const { return m_Published.Load(); }
+
+private:
+    struct Sample {
+        uint32_t Timestamp;
+        double Value;
+    };
+
+    /** A sliding window over the shared sample buffer. */
+    struct Window {
+        uint32_t Length;                // in milliseconds
+        uint32_t First;                 // sequence number of its oldest sample
+        double Sum;
+        // Sequence numbers of the samples which can still become the
+        // maximum, their values are decreasing.
+        std::vector<uint32_t> MaxQueue;
+        size_t MaxHead;
+        size_t MaxCount;
+    };
+
+    const Sample& At(uint32_t sequence) const { return m_Samples[sequence % m_Samples.size()]; }
+    void Push(Window &w, uint32_t sequence, double value);
+    void Evict(Window &w, uint32_t now);
+    void EvictOldest(Window &w);
+    static double Mean(const Window &w, uint32_t next);
+    double Max(const Window &w) const;
+    int Zone(double value) const;
+    void Publish();
+
+    std::vector<Sample> m_Samples;      // ring buffer, sized for the longest window
+    uint32_t m_Next;                    // sequence number of the next sample
+
+    std::vector<Window> m_Windows;
+    Window m_NormalizedWindow;
+    bool m_NormalizedPower;
+    double m_SumFourthPowers;
+    uint32_t m_NormalizedCount;
+
+    std::vector<double> m_ZoneLimits;
+    uint32_t m_ZoneTime[AGGREGATE_ZONES];
+
+    SeqLock<MetricAggregates> m_Published;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -20,74 +20,161 @@
 #include "Tools.h"
 #include "HeartRateMonitor.h"
 #include "FitnessEquipmentControl.h"
+#include <set>
 
 
-SearchService::SearchService(AntStick *stick, std::mutex & guard) :
-    m_AntStick(stick),
+SearchService::SearchService(AntStickPool *pool, std::mutex & guard) :
+    m_AntSticks(pool),
     m_NumDevices(0),
     m_guard(guard)
 {
     std::lock_guard<std::mutex> Guard(m_guard);
     LOG_MSG("Create search service");
-    m_pDevices.resize(m_AntStick->GetMaxChannels());
+    m_pDevices.resize(m_AntSticks->GetMaxChannels());
+    m_DeviceTypes.resize(m_pDevices.size(), 0);
 }
 SearchService::~SearchService()
 {
     std::lock_guard<std::mutex> Guard(m_guard);
     LOG_MSG("Destroy search service");
     //TODO add cloasing channels
-    delete m_AntStick;
-    m_AntStick = nullptr;
+    delete m_AntSticks;
+    m_AntSticks = nullptr;
     for (auto & it : m_pDevices)
         it.release();
     m_pDevices.shrink_to_fit();
     m_pDevices.clear();
 }
+/** Receive messages and keep the channels going.  Only this thread touches
+ * the sticks and channels, but processing messages changes the state and ID
+ * of channels which other threads look at, so it happens under the guard.
+ * The guard is never held while waiting for USB I/O, so other threads
+ * reading the published readings of a channel are not held up.
+ */
 void SearchService::Tick()
 {
-    std::lock_guard<std::mutex> Guard(m_guard);
-    TickAntStick(m_AntStick);
-    CheckActiveDevices();
+    bool received;
+    {
+        std::lock_guard<std::mutex> Guard(m_guard);
+        received = m_AntSticks->ProcessMessages();
+        CheckActiveDevices();
+    }
+    m_AntSticks->WaitForMessages(received);
+}
+void SearchService::Wake()
+{
+    m_AntSticks->Wake();
 }
 const std::vector<std::unique_ptr<AntChannel>>& SearchService::GetDevices() const
 {
     // non block call, so no mutex protection
     return m_pDevices;
 }
+/** Reserve a slot searching for a device of `type'.  The channel is created
+ * by the next Tick(), on the thread which processes the stick messages.
+ */
 int SearchService::AddDeviceForSearch(AntDeviceType type)
 {
     std::lock_guard<std::mutex> Guard(m_guard);
     if (m_NumDevices >= m_pDevices.size())
         return -1;
 
+    uint8_t device_type = 0;
     switch (type)
     {
     case HRM_Type:
-        m_pDevices[m_NumDevices].reset(new HeartRateMonitor(m_AntStick));
+        device_type = HRM::ANT_DEVICE_TYPE;
         break;
     case BIKE_Type:
-        m_pDevices[m_NumDevices].reset(new FitnessEquipmentControl(m_AntStick));
+        device_type = BIKE::ANT_DEVICE_TYPE;
         break;
     case NONE_Type:
     default:
         return -1;
     }
+    m_DeviceTypes[m_NumDevices] = device_type;
     m_NumDevices++;
+    return 0;
+}
+
+int SearchService::SetZones(AntDeviceType type, const std::vector<double> &limits)
+{
+    if (limits.size() > AGGREGATE_ZONES - 1)
+        return -1;
+    for (size_t i = 1; i < limits.size(); i++) {
+        if (!(limits[i - 1] < limits[i]))
+            return -1;
+    }
+
+    std::lock_guard<std::mutex> Guard(m_guard);
+    switch (type)
+    {
+    case HRM_Type:
+        m_HeartRateZones = limits;
+        break;
+    case BIKE_Type:
+        m_PowerZones = limits;
+        break;
+    case NONE_Type:
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+/** Create a searching channel for `device_type' on the least loaded stick,
+ * return nullptr if all sticks are full.
+ */
+AntChannel* SearchService::CreateChannel(uint8_t device_type)
+{
+    AntStick *stick = m_AntSticks->LeastLoadedStick();
+    if (stick == nullptr)
+        return nullptr;
+
+    // The zones are set before the channel receives messages
+    AntChannel *channel = nullptr;
+    if (device_type == HRM::ANT_DEVICE_TYPE) {
+        HeartRateMonitor *hrm = new HeartRateMonitor(stick);
+        hrm->SetHeartRateZones(m_HeartRateZones);
+        channel = hrm;
+    }
+    else if (device_type == BIKE::ANT_DEVICE_TYPE) {
+        FitnessEquipmentControl *fec = new FitnessEquipmentControl(stick);
+        fec->SetPowerZones(m_PowerZones);
+        channel = fec;
+    }
+    if (channel)
+        channel->SetUpdateSignal(m_AntSticks->GetUpdateSignal());
+    return channel;
 }
 void SearchService::CheckActiveDevices()
 {
-    for (auto & it : m_pDevices)
+    // Channel IDs of the open channels, sticks searching at the same time can
+    // pair up with the same device.
+    std::set<std::pair<uint8_t, uint32_t>> open_devices;
+
+    for (size_t i = 0; i < m_pDevices.size(); i++)
     {
-        if (it.get() && it->ChannelState() == AntChannel::CH_CLOSED) {
-            if (it->ChannelId().DeviceType == HRM::ANT_DEVICE_TYPE)
+        auto & it = m_pDevices[i];
+        // The closed channel is destroyed first, its channel number becomes
+        // free once the stick has unassigned it.  If all sticks are full
+        // until then, we try again on the next tick.
+        if (it.get() && it->ChannelState() == AntChannel::CH_CLOSED)
+            it.reset();
+        if (it.get() && it->ChannelState() == AntChannel::CH_OPEN)
+        {
+            auto id = std::make_pair(it->ChannelId().DeviceType, it->ChannelId().DeviceNumber);
+            if (!open_devices.insert(id).second)
             {
-                LOG_MSG("Re Creating HRM channel");
-                it.reset(new HeartRateMonitor(m_AntStick));
+                LOG_MSG("Device paired twice, searching again\n");
+                it.reset();
             }
-            else if (it->ChannelId().DeviceType ==  BIKE::ANT_DEVICE_TYPE)
-            {
-                LOG_MSG("Re Creating bike channel");
-                it.reset(new FitnessEquipmentControl(m_AntStick));
+        }
+        if (!it.get() && m_DeviceTypes[i] != 0)
+        {
+            it.reset(CreateChannel(m_DeviceTypes[i]));
+            if (it.get()) {
+                LOG_MSG("Re Creating channel");
             }
         }
     }
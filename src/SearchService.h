@@ -19,24 +19,38 @@
 #include <iostream>
 #include <mutex>
 #include "structures.h"
-#include "AntStick.h"
+#include "AntStickPool.h"
 
+/** Search for devices on all sticks of a pool.  Channels are placed on the
+ * least loaded stick, GetDevices() returns the channels of all sticks.
+ */
 class SearchService {
 public:
-    SearchService(AntStick *stick, std::mutex & guard);
+    SearchService(AntStickPool *pool, std::mutex & guard);
     ~SearchService();
 
     void Tick();
+    /** Make a Tick() waiting on another thread return early. */
+    void Wake();
     const std::vector<std::unique_ptr<AntChannel>>& GetDevices() const;
     int AddDeviceForSearch(AntDeviceType type);
+    /** Set the upper limits of the heart rate (BPM) or power (watts) zones,
+     * in increasing order, for the channels of `type' created from now on.
+     * Return -1 if `type' has no zones or the limits are not increasing. */
+    int SetZones(AntDeviceType type, const std::vector<double> &limits);
 
 private:
 
     void CheckActiveDevices();
+    AntChannel* CreateChannel(uint8_t device_type);
 
-    AntStick *m_AntStick;
+    AntStickPool *m_AntSticks;
     std::vector<std::unique_ptr<AntChannel>> m_pDevices;
+    /** Device type searched for in each slot of m_pDevices, 0 if unused */
+    std::vector<uint8_t> m_DeviceTypes;
     unsigned int m_NumDevices;
+    std::vector<double> m_HeartRateZones;
+    std::vector<double> m_PowerZones;
 
     std::mutex & m_guard;
 };
\ No newline at end of file
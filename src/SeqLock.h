@@ -0,0 +1,104 @@
+/**
+ *  SeqLock -- publish a value from one thread to many without locking
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/** Hold the latest version of a value written by a single thread, which any
+ * number of threads can read without blocking the writer or each other.
+ *
+ * Store() bumps a sequence number to an odd value, copies the value in and
+ * bumps it to even again.  Load() copies the value out and retries if the
+ * sequence number was odd or has changed meanwhile, so readers always get a
+ * complete value, never a mix of two versions.  The writer never waits, a
+ * reader only retries while a Store() overlaps its copy, which takes a few
+ * nanoseconds.
+ *
+ * The value is kept as relaxed atomic words, so concurrent reads and writes
+ * are not a data race.  `T' must be trivially copyable.  There must be only
+ * one writer at a time.
+ */
+template <typename T>
+class SeqLock
+{
+public:
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SeqLock values are copied byte by byte");
+
+    explicit SeqLock(const T &value = T())
+        : m_Sequence(0)
+    {
+        Store(value);
+    }
+
+    SeqLock(const SeqLock&) = delete;
+    SeqLock& operator=(const SeqLock&) = delete;
+
+    void Store(const T &value)
+    {
+        uint64_t words[WORDS] = {};
+        std::memcpy(words, &value, sizeof(T));
+
+        uint32_t sequence = m_Sequence.load(std::memory_order_relaxed);
+        m_Sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < WORDS; i++)
+            m_Words[i].store(words[i], std::memory_order_relaxed);
+        m_Sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    T Load() const
+    {
+        uint64_t words[WORDS];
+        uint32_t before, after;
+        do {
+            before = m_Sequence.load(std::memory_order_acquire);
+            for (int i = 0; i < WORDS; i++)
+                words[i] = m_Words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = m_Sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) != 0 || before != after);
+
+        T value;
+        std::memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+    /** Number of Store() calls so far, including the one for the initial
+     * value.  Readers can use this to find out if the value has changed
+     * since they last looked. */
+    uint32_t Version() const
+    {
+        return m_Sequence.load(std::memory_order_acquire) / 2;
+    }
+
+private:
+    enum { WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+    std::atomic<uint32_t> m_Sequence;
+    std::atomic<uint64_t> m_Words[WORDS];
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,405 @@
+/**
+ *  SessionRecording -- binary recording and replay of ANT sessions
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "SessionRecording.h"
+#include "Tools.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char RECORDING_MAGIC[8] = { 'A', 'N', 'T', 'R', 'E', 'C', 0, 0 };
+
+enum {
+    // stdio buffer of the recorder, about 800 records
+    RECORDER_BUFFER_SIZE = 64 * 1024,
+
+    // Milliseconds a replay waits for the application to send the message
+    // which comes next in the recording.
+    REPLAY_WRITE_WAIT = 10
+};
+
+};                                      // end anonymous namespace
+
+// .................................................... SessionRecorder ....
+
+SessionRecorder::SessionRecorder(const std::string &path)
+    : m_File(nullptr),
+      m_FileBuffer(RECORDER_BUFFER_SIZE),
+      m_Start(Clock::now()),
+      m_Sequence(0),
+      m_NextSource(0)
+{
+    m_File = fopen(path.c_str(), "wb");
+    if (! m_File)
+        throw std::runtime_error("SessionRecorder -- cannot create " + path);
+    setvbuf(m_File, m_FileBuffer.data(), _IOFBF, m_FileBuffer.size());
+
+    RecordingHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, RECORDING_MAGIC, sizeof(h.magic));
+    h.version = RECORDING_VERSION;
+    h.record_size = RECORD_SIZE;
+    h.start_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if (fwrite(&h, sizeof(h), 1, m_File) != 1) {
+        fclose(m_File);
+        throw std::runtime_error("SessionRecorder -- cannot write " + path);
+    }
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    fclose(m_File);
+}
+
+uint16_t SessionRecorder::NewSource()
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_NextSource++;
+}
+
+void SessionRecorder::RecordFrame(
+    uint16_t source, RecordKind kind, const uint8_t *frame, size_t size, uint64_t arrival)
+{
+    if (size > RECORD_PAYLOAD_SIZE) {
+        LOG_MSG("SessionRecorder: message too long, not recorded\n");
+        return;
+    }
+    Append(source, kind, frame, size, arrival);
+}
+
+void SessionRecorder::RecordTelemetry(uint16_t source, const Telemetry &t)
+{
+    Append(source, RK_TELEMETRY, &t, sizeof(t), 0);
+}
+
+void SessionRecorder::Append(
+    uint16_t source, RecordKind kind, const void *data, size_t size, uint64_t arrival)
+{
+    SessionRecord r;
+    memset(&r, 0, sizeof(r));
+    r.source = source;
+    r.kind = static_cast<uint8_t>(kind);
+    r.size = static_cast<uint8_t>(size);
+    memcpy(r.payload, data, size);
+
+    // CurrentNanoseconds() uses the same clock as we do.
+    Clock::time_point when = Clock::now();
+    if (arrival != 0) {
+        when = Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+                                     std::chrono::nanoseconds(arrival)));
+    }
+
+    std::lock_guard<std::mutex> guard(m_Lock);
+    r.time = when > m_Start
+        ? std::chrono::duration_cast<std::chrono::nanoseconds>(when - m_Start).count()
+        : 0;
+    r.sequence = m_Sequence;
+    if (fwrite(&r, sizeof(r), 1, m_File) != 1)
+        throw std::runtime_error("SessionRecorder -- write failed");
+    m_Sequence++;
+}
+
+void SessionRecorder::Flush()
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    fflush(m_File);
+}
+
+uint32_t SessionRecorder::Count() const
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_Sequence;
+}
+
+// ................................................. RecordingTransport ....
+
+RecordingTransport::RecordingTransport(
+    std::unique_ptr<AntTransport> transport, SessionRecorder *recorder, uint16_t source)
+    : m_Transport(std::move(transport)),
+      m_Recorder(recorder),
+      m_Source(source)
+{
+    m_ReadTimeout = m_Transport->GetReadTimeout();
+}
+
+void RecordingTransport::WriteMessage(const AntMessage &message)
+{
+    // Recorded before it is sent, so the response can't come first.
+    m_Recorder->RecordFrame(m_Source, RK_SENT_FRAME, message.data(), message.size());
+    m_Transport->WriteMessage(message);
+}
+
+void RecordingTransport::MaybeGetNextMessage(Buffer &message)
+{
+    m_Transport->SetReadTimeout(m_ReadTimeout);
+    m_Transport->MaybeGetNextMessage(message);
+    m_LastArrival = m_Transport->GetLastArrival();
+    if (! message.empty()) {
+        m_Recorder->RecordFrame(m_Source, RK_RECEIVED_FRAME,
+                                message.data(), message.size(), m_LastArrival);
+    }
+}
+
+// ...................................................... SessionReader ....
+
+SessionReader::SessionReader(const std::string &path)
+    : m_Data(nullptr),
+      m_Size(0),
+#if defined(_WIN32)
+      m_File(INVALID_HANDLE_VALUE),
+      m_Mapping(NULL),
+#endif
+      m_Header(nullptr),
+      m_Records(nullptr),
+      m_Count(0)
+{
+#if defined(_WIN32)
+    m_File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_File == INVALID_HANDLE_VALUE)
+        throw Win32Error("SessionReader -- CreateFile");
+    LARGE_INTEGER size;
+    if (! GetFileSizeEx(m_File, &size)) {
+        Win32Error e("SessionReader -- GetFileSizeEx");
+        Unmap();
+        throw e;
+    }
+    m_Size = static_cast<size_t>(size.QuadPart);
+    // An empty file can't be mapped
+    if (m_Size < sizeof(RecordingHeader)) {
+        Unmap();
+        throw std::runtime_error("SessionReader -- not a recording: " + path);
+    }
+    m_Mapping = CreateFileMapping(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_Mapping == NULL) {
+        Win32Error e("SessionReader -- CreateFileMapping");
+        Unmap();
+        throw e;
+    }
+    m_Data = MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_Data == NULL) {
+        Win32Error e("SessionReader -- MapViewOfFile");
+        Unmap();
+        throw e;
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "open(" + path + ")");
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int e = errno;
+        close(fd);
+        throw std::system_error(e, std::generic_category(), "fstat(" + path + ")");
+    }
+    m_Size = static_cast<size_t>(st.st_size);
+    // An empty file can't be mapped
+    if (m_Size < sizeof(RecordingHeader)) {
+        close(fd);
+        throw std::runtime_error("SessionReader -- not a recording: " + path);
+    }
+    void *data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int e = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+        throw std::system_error(e, std::generic_category(), "mmap(" + path + ")");
+    m_Data = data;
+#endif
+
+    try {
+        Validate();
+    }
+    catch (...) {
+        Unmap();
+        throw;
+    }
+}
+
+SessionReader::~SessionReader()
+{
+    Unmap();
+}
+
+void SessionReader::Validate()
+{
+    m_Header = static_cast<const RecordingHeader*>(m_Data);
+    if (memcmp(m_Header->magic, RECORDING_MAGIC, sizeof(RECORDING_MAGIC)) != 0)
+        throw std::runtime_error("SessionReader -- not a recording");
+    if (m_Header->version != RECORDING_VERSION || m_Header->record_size != RECORD_SIZE)
+        throw std::runtime_error("SessionReader -- unsupported recording version");
+    m_Records = reinterpret_cast<const SessionRecord*>(
+        static_cast<const char*>(m_Data) + sizeof(RecordingHeader));
+    m_Count = (m_Size - sizeof(RecordingHeader)) / sizeof(SessionRecord);
+}
+
+void SessionReader::Unmap()
+{
+#if defined(_WIN32)
+    if (m_Data)
+        UnmapViewOfFile(m_Data);
+    if (m_Mapping)
+        CloseHandle(m_Mapping);
+    if (m_File != INVALID_HANDLE_VALUE)
+        CloseHandle(m_File);
+    m_Mapping = NULL;
+    m_File = INVALID_HANDLE_VALUE;
+#else
+    if (m_Data)
+        munmap(m_Data, m_Size);
+#endif
+    m_Data = nullptr;
+}
+
+std::vector<uint16_t> SessionReader::FrameSources() const
+{
+    std::vector<uint16_t> sources;
+    for (size_t n = 0; n < m_Count; n++) {
+        const SessionRecord &r = m_Records[n];
+        if (r.kind != RK_RECEIVED_FRAME && r.kind != RK_SENT_FRAME)
+            continue;
+        if (std::find(sources.begin(), sources.end(), r.source) == sources.end())
+            sources.push_back(r.source);
+    }
+    return sources;
+}
+
+Telemetry SessionReader::TelemetryAt(size_t n) const
+{
+    const SessionRecord &r = m_Records[n];
+    if (r.kind != RK_TELEMETRY || r.size != sizeof(Telemetry))
+        throw std::runtime_error("SessionReader -- not a telemetry record");
+    Telemetry t;
+    memcpy(&t, r.payload, sizeof(t));
+    return t;
+}
+
+// .................................................... ReplayTransport ....
+
+ReplayTransport::ReplayTransport(
+    std::shared_ptr<SessionReader> reader, uint16_t source, double speed)
+    : m_Reader(reader),
+      m_Source(source),
+      m_Speed(speed),
+      m_FirstTime(0),
+      m_End(0),
+      m_Start(Clock::now()),
+      m_Next(0),
+      m_Written(0)
+{
+    bool first = true;
+    for (size_t n = 0; n < m_Reader->Count(); n++) {
+        const SessionRecord &r = m_Reader->At(n);
+        if (r.source != m_Source)
+            continue;
+        if (first && (r.kind == RK_RECEIVED_FRAME || r.kind == RK_SENT_FRAME)) {
+            m_FirstTime = r.time;
+            first = false;
+        }
+        if (r.kind == RK_RECEIVED_FRAME)
+            m_End = n + 1;
+    }
+}
+
+void ReplayTransport::WriteMessage(const AntMessage &)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        m_Written++;
+    }
+    m_WriteDone.notify_all();
+}
+
+/** Return the next recorded message once it is due, and the messages sent
+ * before it were written.  If that does not happen within the read timeout,
+ * an empty buffer is returned.
+ */
+void ReplayTransport::MaybeGetNextMessage(Buffer &message)
+{
+    message.clear();
+    auto deadline = Clock::now() + std::chrono::milliseconds(m_ReadTimeout);
+
+    std::unique_lock<std::mutex> guard(m_Lock);
+    for (;;) {
+        // Skip the records of other sources and the sent messages matched by
+        // a write.
+        while (m_Next < m_End) {
+            const SessionRecord &r = m_Reader->At(m_Next);
+            if (r.source == m_Source && r.kind == RK_RECEIVED_FRAME)
+                break;
+            if (r.source == m_Source && r.kind == RK_SENT_FRAME) {
+                if (m_Written == 0)
+                    break;
+                m_Written--;
+            }
+            m_Next++;
+        }
+
+        if (m_Next < m_End && m_Reader->At(m_Next).kind == RK_RECEIVED_FRAME) {
+            const SessionRecord &r = m_Reader->At(m_Next);
+            auto due = DueTime(r);
+            if (due > deadline)
+                break;
+            // Writes don't matter any more, only the time does.
+            while (Clock::now() < due)
+                m_WriteDone.wait_until(guard, due);
+            message.assign(r.payload, r.payload + r.size);
+            m_Next++;
+            return;
+        }
+
+        // Waiting for the application to send a message, or at the end.  The
+        // message is usually sent by the thread reading, after we return,
+        // so don't hold it up for the whole read timeout.
+        auto limit = (std::min)(deadline, Clock::now() + std::chrono::milliseconds(REPLAY_WRITE_WAIT));
+        if (m_WriteDone.wait_until(guard, limit) == std::cv_status::timeout)
+            return;
+    }
+
+    // The next message is not due before the deadline
+    while (Clock::now() < deadline)
+        m_WriteDone.wait_until(guard, deadline);
+}
+
+bool ReplayTransport::AtEnd() const
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_Next >= m_End;
+}
+
+ReplayTransport::Clock::time_point ReplayTransport::DueTime(const SessionRecord &r) const
+{
+    if (m_Speed <= 0)
+        return m_Start;
+    std::chrono::duration<double, std::nano> offset((r.time - m_FirstTime) / m_Speed);
+    return m_Start + std::chrono::duration_cast<Clock::duration>(offset);
+}
@@ -0,0 +1,245 @@
+/**
+ *  SessionRecording -- binary recording and replay of ANT sessions
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "AntStick.h"
+#include "structures.h"
+
+/** A recording is a file header followed by fixed size records, in the order
+ * they were written, all of them little endian.  The file is only ever
+ * appended to, and being an array of records, it can be memory mapped and
+ * indexed directly.  A record truncated by a crash is ignored by the reader.
+ */
+enum {
+    RECORDING_VERSION = 1,
+    RECORD_SIZE = 80,
+    RECORD_PAYLOAD_SIZE = 64
+};
+
+enum RecordKind {
+    RK_RECEIVED_FRAME = 1,              // ANT message received from a stick
+    RK_SENT_FRAME = 2,                  // ANT message sent to a stick
+    RK_TELEMETRY = 3                    // Telemetry published by a server
+};
+
+/** The first RECORD_SIZE bytes of the file. */
+struct RecordingHeader
+{
+    char magic[8];                      // "ANTREC\0\0"
+    uint32_t version;                   // RECORDING_VERSION
+    uint32_t record_size;               // RECORD_SIZE
+    /** Wall clock time the recording started, in milliseconds since the
+     * Unix epoch, record times are relative to it. */
+    uint64_t start_time;
+    uint8_t reserved[56];
+};
+
+struct SessionRecord
+{
+    /** Nanoseconds since the recording started (steady clock).  Received
+     * messages have the time they arrived, which can be slightly before
+     * the time of the record preceding them. */
+    uint64_t time;
+    /** Numbers the records of the recording, starting at 0 */
+    uint32_t sequence;
+    /** The stick or server the record comes from, see
+     * SessionRecorder::NewSource() */
+    uint16_t source;
+    uint8_t kind;                       // RecordKind
+    uint8_t size;                       // bytes used in payload
+    /** A framed ANT message (sync byte to checksum) or a Telemetry */
+    uint8_t payload[RECORD_PAYLOAD_SIZE];
+};
+
+static_assert(sizeof(RecordingHeader) == RECORD_SIZE, "RecordingHeader layout is fixed");
+static_assert(sizeof(SessionRecord) == RECORD_SIZE, "SessionRecord layout is fixed");
+static_assert(sizeof(Telemetry) <= RECORD_PAYLOAD_SIZE, "Telemetry fits in a record");
+
+/** Append records to a recording file.  Records are buffered, they reach the
+ * file when the buffer fills up, on Flush() and when the recorder is
+ * destroyed.  All methods can be called from any thread.
+ */
+class SessionRecorder
+{
+public:
+    /** Create (or truncate) the recording `path'.  Throws std::runtime_error
+     * if it can't be opened. */
+    explicit SessionRecorder(const std::string &path);
+    ~SessionRecorder();
+
+    SessionRecorder(const SessionRecorder&) = delete;
+    SessionRecorder& operator=(const SessionRecorder&) = delete;
+
+    /** Return a new source number, to tell apart the records of different
+     * sticks and servers. */
+    uint16_t NewSource();
+
+    /** Record the ANT message `frame', `size' bytes long, of `kind'
+     * RK_RECEIVED_FRAME or RK_SENT_FRAME.  If `arrival' is not 0, it is the
+     * CurrentNanoseconds() the message arrived, and is used as the record
+     * time instead of the current time.  Messages too long for a record
+     * are dropped. */
+    void RecordFrame(uint16_t source, RecordKind kind,
+                     const uint8_t *frame, size_t size, uint64_t arrival = 0);
+
+    void RecordTelemetry(uint16_t source, const Telemetry &t);
+
+    void Flush();
+
+    /** Records written so far */
+    uint32_t Count() const;
+
+private:
+    void Append(uint16_t source, RecordKind kind,
+                const void *data, size_t size, uint64_t arrival);
+
+    typedef std::chrono::steady_clock Clock;
+
+    FILE *m_File;
+    std::vector<char> m_FileBuffer;
+    Clock::time_point m_Start;
+    mutable std::mutex m_Lock;
+    uint32_t m_Sequence;
+    uint16_t m_NextSource;
+};
+
+/** Transport which records the messages going through another transport.
+ * Put it between the stick and its transport from the start, so the
+ * recording contains the messages of the reset as well, and can be replayed
+ * by ReplayTransport.
+ */
+class RecordingTransport : public AntTransport
+{
+public:
+    RecordingTransport(std::unique_ptr<AntTransport> transport,
+                       SessionRecorder *recorder, uint16_t source);
+
+    void WriteMessage(const AntMessage &message) override;
+    void MaybeGetNextMessage(Buffer &message) override;
+    void HandleEvents() override { m_Transport->HandleEvents(); }
+    void SetEventDriven(bool event_driven) override { m_Transport->SetEventDriven(event_driven); }
+    void SetReceiveSignal(UpdateSignal *signal) override { m_Transport->SetReceiveSignal(signal); }
+
+    AntTransport* GetTransport() const { return m_Transport.get(); }
+    uint16_t GetSource() const { return m_Source; }
+
+private:
+    std::unique_ptr<AntTransport> m_Transport;
+    SessionRecorder *m_Recorder;
+    uint16_t m_Source;
+};
+
+/** Read a recording, which is mapped into memory rather than read, so
+ * opening even a long one is fast.  Throws an exception if the file can't
+ * be opened or is not a recording.
+ */
+class SessionReader
+{
+public:
+    explicit SessionReader(const std::string &path);
+    ~SessionReader();
+
+    SessionReader(const SessionReader&) = delete;
+    SessionReader& operator=(const SessionReader&) = delete;
+
+    const RecordingHeader& Header() const { return *m_Header; }
+
+    /** Number of complete records */
+    size_t Count() const { return m_Count; }
+    const SessionRecord& At(size_t n) const { return m_Records[n]; }
+
+    /** Sources which have frame records, in the order they first appear. */
+    std::vector<uint16_t> FrameSources() const;
+
+    /** Return the telemetry of record `n', which must be an RK_TELEMETRY
+     * record. */
+    Telemetry TelemetryAt(size_t n) const;
+
+private:
+    void Validate();
+    void Unmap();
+
+    void *m_Data;
+    size_t m_Size;
+#if defined(_WIN32)
+    void *m_File;
+    void *m_Mapping;
+#endif
+    const RecordingHeader *m_Header;
+    const SessionRecord *m_Records;
+    size_t m_Count;
+};
+
+/** Transport which plays back the messages a stick sent in a recording.
+ * Like AntStreamTransport, this allows running AntStick (and everything
+ * above it, up to the TelemetryServer) on a machine with no stick attached.
+ *
+ * The messages written to the transport are not checked, but they are
+ * counted: a recorded message is only returned once as many messages were
+ * written as had been sent to the stick before it was received, so
+ * responses never arrive before their command.  The channels receive the
+ * recorded messages on the channel numbers they had when recording, so the
+ * replay is faithful when the application sets up its channels in the same
+ * order.
+ *
+ * With a `speed' of 1 the messages are returned at the time they were
+ * received, with 2 twice as fast, and with 0 as fast as they are read.  At
+ * the end of the recording, reads time out.
+ */
+class ReplayTransport : public AntTransport
+{
+public:
+    ReplayTransport(std::shared_ptr<SessionReader> reader, uint16_t source, double speed = 1.0);
+
+    void WriteMessage(const AntMessage &message) override;
+    void MaybeGetNextMessage(Buffer &message) override;
+
+    /** True once all messages of the source were returned. */
+    bool AtEnd() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point DueTime(const SessionRecord &r) const;
+
+    std::shared_ptr<SessionReader> m_Reader;
+    uint16_t m_Source;
+    double m_Speed;
+    uint64_t m_FirstTime;               // time of the first record of m_Source
+    size_t m_End;                       // after the last record received by m_Source
+    Clock::time_point m_Start;
+
+    mutable std::mutex m_Lock;
+    std::condition_variable m_WriteDone;
+    size_t m_Next;                      // next record to look at
+    uint32_t m_Written;                 // messages written, not yet matched
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,265 @@
+/**
+ *  SharedTelemetry -- publish telemetry to other processes through shared memory
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "SharedTelemetry.h"
+
+#include <new>
+#include <stdexcept>
+#include <string.h>
+#include <system_error>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** IMPLEMENTATION NOTE
+ *
+ * The writer stores a record in its ring slot, then advances `written', so
+ * a reader which sees `written' past a position finds the record of that
+ * position in its slot, unless the writer went around the ring and
+ * overwrote it meanwhile.  Each record holds its own position, so the
+ * reader can tell, and skips ahead to the oldest record still in the ring.
+ *
+ * A writer replaces the segment of a previous writer which crashed, readers
+ * of the old one keep reading it, but see no new records (WriterClosed()
+ * is only set by a writer exiting normally).
+ *
+ * Readers map the segment read-write although they never store to it: on
+ * 32-bit x86, a lock-free load of a 64-bit atomic is a cmpxchg8b, which
+ * writes to the location and faults on a read-only page.
+ */
+
+namespace {
+
+const char SHARED_TELEMETRY_MAGIC[8] = { 'A', 'N', 'T', 'S', 'H', 'M', 0, 0 };
+
+#if defined(_WIN32)
+void ThrowLastError(const std::string &who)
+{
+    throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), who);
+}
+#else
+void ThrowErrno(const std::string &who)
+{
+    throw std::system_error(errno, std::generic_category(), who);
+}
+#endif
+
+};                                      // end anonymous namespace
+
+#if defined(_WIN32)
+const char *SharedTelemetryWriter::DEFAULT_NAME = "Local\\trainer-telemetry";
+#else
+const char *SharedTelemetryWriter::DEFAULT_NAME = "/trainer-telemetry";
+#endif
+
+SharedTelemetrySegment::SharedTelemetrySegment()
+    : version(0),
+      closed(0),
+      sources(0),
+      written(0)
+{
+    memcpy(magic, SHARED_TELEMETRY_MAGIC, sizeof(magic));
+}
+
+SharedTelemetryMapping::SharedTelemetryMapping(const std::string &name, bool create)
+    : m_Name(name),
+      m_Created(create),
+      m_Segment(nullptr)
+{
+    const size_t size = sizeof(SharedTelemetrySegment);
+    void *data = nullptr;
+
+#if defined(_WIN32)
+    if (create) {
+        m_Mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                       0, static_cast<DWORD>(size), name.c_str());
+        if (m_Mapping == NULL)
+            ThrowLastError("CreateFileMapping(" + name + ")");
+        if (GetLastError() == ERROR_ALREADY_EXISTS) {
+            // The mapping goes away with its last handle, so another writer
+            // is still running.
+            CloseHandle(m_Mapping);
+            throw std::system_error(ERROR_ALREADY_EXISTS, std::system_category(),
+                                    "CreateFileMapping(" + name + ")");
+        }
+    }
+    else {
+        m_Mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+        if (m_Mapping == NULL)
+            ThrowLastError("OpenFileMapping(" + name + ")");
+    }
+    data = MapViewOfFile(m_Mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (data == NULL) {
+        DWORD error = GetLastError();
+        CloseHandle(m_Mapping);
+        throw std::system_error(static_cast<int>(error), std::system_category(),
+                                "MapViewOfFile(" + name + ")");
+    }
+#else
+    int fd;
+    if (create) {
+        // Left over by a writer which crashed
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            ThrowErrno("shm_open(" + name + ")");
+        if (ftruncate(fd, size) < 0) {
+            int error = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            throw std::system_error(error, std::generic_category(), "ftruncate(" + name + ")");
+        }
+    }
+    else {
+        fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            ThrowErrno("shm_open(" + name + ")");
+        struct stat st;
+        if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < size) {
+            close(fd);
+            throw std::runtime_error("SharedTelemetryMapping: " + name + " is not a telemetry segment");
+        }
+    }
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);                          // the mapping stays
+    if (data == MAP_FAILED) {
+        if (create)
+            shm_unlink(name.c_str());
+        throw std::system_error(error, std::generic_category(), "mmap(" + name + ")");
+    }
+#endif
+
+    if (create)
+        m_Segment = new (data) SharedTelemetrySegment();
+    else
+        m_Segment = static_cast<SharedTelemetrySegment*>(data);
+}
+
+SharedTelemetryMapping::~SharedTelemetryMapping()
+{
+    if (m_Created)
+        m_Segment->closed.store(1, std::memory_order_release);
+#if defined(_WIN32)
+    UnmapViewOfFile(m_Segment);
+    CloseHandle(m_Mapping);
+#else
+    munmap(m_Segment, sizeof(SharedTelemetrySegment));
+    if (m_Created)
+        shm_unlink(m_Name.c_str());
+#endif
+}
+
+SharedTelemetryWriter::SharedTelemetryWriter(const std::string &name)
+    : m_Mapping(name, true),
+      m_Segment(m_Mapping.Segment()),
+      m_NextSource(0)
+{
+    m_Segment->version.store(SHARED_TELEMETRY_VERSION, std::memory_order_release);
+}
+
+SharedTelemetryWriter::~SharedTelemetryWriter()
+{
+}
+
+uint16_t SharedTelemetryWriter::NewSource()
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    uint16_t source = m_NextSource++;
+    if (source < SHARED_TELEMETRY_SOURCES)
+        m_Segment->sources.store(source + 1, std::memory_order_release);
+    return source;
+}
+
+void SharedTelemetryWriter::Publish(uint16_t source, const Telemetry &t)
+{
+    if (source >= SHARED_TELEMETRY_SOURCES)
+        return;
+
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_Segment->latest[source].Store(t);
+
+    SharedTelemetryRecord r;
+    r.position = m_Segment->written.load(std::memory_order_relaxed);
+    r.source = source;
+    r.telemetry = t;
+    m_Segment->ring[r.position % SHARED_TELEMETRY_RING_SIZE].Store(r);
+    m_Segment->written.store(r.position + 1, std::memory_order_release);
+}
+
+SharedTelemetryReader::SharedTelemetryReader(const std::string &name)
+    : m_Mapping(name, false),
+      m_Segment(m_Mapping.Segment()),
+      m_Position(0),
+      m_Started(false),
+      m_Lost(0)
+{
+    if (memcmp(m_Segment->magic, SHARED_TELEMETRY_MAGIC, sizeof(SHARED_TELEMETRY_MAGIC)) != 0
+        || m_Segment->version.load(std::memory_order_acquire) != SHARED_TELEMETRY_VERSION)
+        throw std::runtime_error("SharedTelemetryReader: " + name + " is not a telemetry segment");
+}
+
+uint16_t SharedTelemetryReader::Sources() const
+{
+    return static_cast<uint16_t>(m_Segment->sources.load(std::memory_order_acquire));
+}
+
+Telemetry SharedTelemetryReader::Latest(uint16_t source) const
+{
+    if (source >= SHARED_TELEMETRY_SOURCES)
+        return Telemetry();
+    return m_Segment->latest[source].Load();
+}
+
+bool SharedTelemetryReader::Next(SharedTelemetryRecord &record)
+{
+    uint64_t written = m_Segment->written.load(std::memory_order_acquire);
+    if (! m_Started) {
+        m_Position = written > SHARED_TELEMETRY_RING_SIZE ? written - SHARED_TELEMETRY_RING_SIZE : 0;
+        m_Started = true;
+    }
+
+    while (m_Position < written) {
+        if (written - m_Position > SHARED_TELEMETRY_RING_SIZE) {
+            uint64_t oldest = written - SHARED_TELEMETRY_RING_SIZE;
+            m_Lost += oldest - m_Position;
+            m_Position = oldest;
+        }
+        record = m_Segment->ring[m_Position % SHARED_TELEMETRY_RING_SIZE].Load();
+        if (record.position == m_Position) {
+            m_Position++;
+            return true;
+        }
+        // Overwritten since we looked at `written', which has moved on by
+        // at least a whole ring.
+        written = m_Segment->written.load(std::memory_order_acquire);
+    }
+    return false;
+}
+
+bool SharedTelemetryReader::WriterClosed() const
+{
+    return m_Segment->closed.load(std::memory_order_acquire) != 0;
+}
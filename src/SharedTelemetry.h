@@ -0,0 +1,169 @@
+/**
+ *  SharedTelemetry -- publish telemetry to other processes through shared memory
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include "SeqLock.h"
+#include "structures.h"
+#include "TelemetrySink.h"
+
+/** The shared memory segment holds the latest telemetry of each source and
+ * a ring of the last SHARED_TELEMETRY_RING_SIZE telemetry records of all
+ * sources, in the order they were published.  There is one writer, the
+ * process running the TelemetryServer instances, and any number of readers,
+ * which never block the writer or each other: both the latest values and
+ * the ring slots are SeqLock instances, whose lock-free atomics work across
+ * processes.
+ *
+ * Readers only need this header, SeqLock.h, structures.h and
+ * SharedTelemetry.cpp, not the DLL.
+ */
+enum {
+    SHARED_TELEMETRY_VERSION = 1,
+    SHARED_TELEMETRY_SOURCES = 64,
+    SHARED_TELEMETRY_RING_SIZE = 1024
+};
+
+/** A telemetry record of the ring */
+struct SharedTelemetryRecord
+{
+    SharedTelemetryRecord() : position(0), source(0), reserved() {}
+    uint64_t position;                  // number of records published before it
+    uint16_t source;
+    uint16_t reserved[3];
+    Telemetry telemetry;
+};
+
+static_assert(sizeof(SharedTelemetryRecord) == 80, "SharedTelemetryRecord layout is fixed");
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory needs lock-free atomics");
+
+/** Layout of the segment.  The writer sets `version' last, once the
+ * segment is initialized. */
+struct SharedTelemetrySegment
+{
+    SharedTelemetrySegment();
+
+    char magic[8];                      // "ANTSHM\0\0"
+    std::atomic<uint32_t> version;      // SHARED_TELEMETRY_VERSION
+    std::atomic<uint32_t> closed;       // 1 once the writer has gone
+    std::atomic<uint32_t> sources;      // sources in use
+    std::atomic<uint64_t> written;      // records published to the ring
+    SeqLock<Telemetry> latest[SHARED_TELEMETRY_SOURCES];
+    SeqLock<SharedTelemetryRecord> ring[SHARED_TELEMETRY_RING_SIZE];
+};
+
+/** Map a shared memory segment named `name', creating it or opening an
+ * existing one.  On POSIX systems, this is a shm_open() name, such as
+ * "/trainer-telemetry", on Windows a file mapping name, such as
+ * "Local\trainer-telemetry".  Readers map it read-write as well, so they
+ * must run as the user of the writer.  Throws std::system_error if the
+ * segment can't be mapped.
+ */
+class SharedTelemetryMapping
+{
+public:
+    SharedTelemetryMapping(const std::string &name, bool create);
+    ~SharedTelemetryMapping();
+
+    SharedTelemetryMapping(const SharedTelemetryMapping&) = delete;
+    SharedTelemetryMapping& operator=(const SharedTelemetryMapping&) = delete;
+
+    SharedTelemetrySegment* Segment() const { return m_Segment; }
+
+private:
+    std::string m_Name;
+    bool m_Created;
+    SharedTelemetrySegment *m_Segment;
+#if defined(_WIN32)
+    void *m_Mapping;
+#endif
+};
+
+/** Publish the telemetry of TelemetryServer instances to a new shared
+ * memory segment, which is removed again when the writer is destroyed.
+ * Publish() doesn't make system calls, it takes an uncontended mutex only
+ * to keep the ring single producer when several servers run on different
+ * threads.
+ */
+class SharedTelemetryWriter : public TelemetrySink
+{
+public:
+    static const char *DEFAULT_NAME;
+
+    explicit SharedTelemetryWriter(const std::string &name = DEFAULT_NAME);
+    ~SharedTelemetryWriter();
+
+    /** TelemetrySink interface.  At most SHARED_TELEMETRY_SOURCES sources
+     * are published, the telemetry of the others is dropped. */
+    uint16_t NewSource() override;
+    void Publish(uint16_t source, const Telemetry &t) override;
+
+private:
+    SharedTelemetryMapping m_Mapping;
+    SharedTelemetrySegment *m_Segment;
+    std::mutex m_Lock;
+    uint16_t m_NextSource;
+};
+
+/** Read the telemetry of a SharedTelemetryWriter from another process (or
+ * the same one).  A reader is used by one thread, create one reader per
+ * thread.
+ */
+class SharedTelemetryReader
+{
+public:
+    /** Open the segment `name', throws std::system_error if it doesn't
+     * exist and std::runtime_error if it is not a telemetry segment. */
+    explicit SharedTelemetryReader(const std::string &name = SharedTelemetryWriter::DEFAULT_NAME);
+
+    /** Number of sources, valid source numbers are below it. */
+    uint16_t Sources() const;
+
+    /** The latest telemetry of `source' */
+    Telemetry Latest(uint16_t source) const;
+
+    /** Return the next record of the ring in `record', false if there is no
+     * new one.  The first call returns the oldest record still in the ring.
+     * Records which were overwritten before they were read are skipped, see
+     * Lost(). */
+    bool Next(SharedTelemetryRecord &record);
+
+    /** Records skipped by Next() because the reader fell behind */
+    uint64_t Lost() const { return m_Lost; }
+
+    /** True once the writer closed the segment, open a new reader to
+     * follow a new writer. */
+    bool WriterClosed() const;
+
+private:
+    SharedTelemetryMapping m_Mapping;
+    const SharedTelemetrySegment *m_Segment;
+    uint64_t m_Position;                // next record to read
+    bool m_Started;
+    uint64_t m_Lost;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
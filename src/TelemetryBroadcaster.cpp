@@ -0,0 +1,521 @@
+/**
+ *  TelemetryBroadcaster -- send telemetry to TCP clients
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "TelemetryBroadcaster.h"
+#include "Tools.h"
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <string.h>
+#include <system_error>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/** IMPLEMENTATION NOTE
+ *
+ * All descriptors are registered once, edge-triggered, for everything we
+ * are interested in, so there are no epoll_ctl() calls after a client is
+ * accepted.  With edge triggering each event must be handled until the call
+ * would block: the listening socket is accepted from and the clients are
+ * read from until EAGAIN, and a client with pending output is written to
+ * until its buffer is empty or EAGAIN, in which case EPOLLOUT tells us when
+ * to continue.
+ *
+ * A client dropped while handling a batch of events can still have events
+ * later in the same batch, so it is only closed (its Fd set to -1) and freed
+ * after the batch.
+ *
+ * The output buffer of a client is its queue.  Frames are discarded from
+ * it (QP_DROP_OLDEST) at frame boundaries, starting at `Whole': the frame
+ * being sent, part of which is already on its way, can't be taken back.
+ */
+
+namespace {
+
+void ThrowErrno(const char *who)
+{
+    throw std::system_error(errno, std::generic_category(), who);
+}
+
+};                                      // end anonymous namespace
+
+TelemetryBroadcaster::TelemetryBroadcaster(int port, QueuePolicy policy, size_t queue_size)
+    : m_ListenFd(-1),
+      m_WakeFd(-1),
+      m_EpollFd(-1),
+      m_Port(port),
+      m_Policy(policy),
+      m_QueueSize(queue_size),
+      m_Stop(false),
+      m_WakePending(false),
+      m_ResyncPending(false),
+      m_ClientCount(0),
+      m_FramesDropped(0),
+      m_ClientsDisconnected(0),
+      m_QueuedBytes(0),
+      m_MaxQueuedBytes(0)
+{
+    if (queue_size < MAX_TELEMETRY_FRAME) {
+        throw std::system_error(EINVAL, std::generic_category(),
+                                "TelemetryBroadcaster: client queue smaller than a frame");
+    }
+
+    try {
+        m_ListenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (m_ListenFd < 0)
+            ThrowErrno("socket()");
+
+        int reuse_addr = 1;
+        if (setsockopt(m_ListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr)) < 0)
+            ThrowErrno("setsockopt(SO_REUSEADDR)");
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (bind(m_ListenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+            ThrowErrno("bind()");
+        if (listen(m_ListenFd, SOMAXCONN) < 0)
+            ThrowErrno("listen()");
+
+        socklen_t len = sizeof(addr);
+        if (getsockname(m_ListenFd, (struct sockaddr*)&addr, &len) < 0)
+            ThrowErrno("getsockname()");
+        m_Port = ntohs(addr.sin_port);
+
+        m_WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_WakeFd < 0)
+            ThrowErrno("eventfd()");
+
+        m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_EpollFd < 0)
+            ThrowErrno("epoll_create1()");
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &m_ListenFd;
+        if (epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_ListenFd, &ev) < 0)
+            ThrowErrno("epoll_ctl()");
+        ev.data.ptr = &m_WakeFd;
+        if (epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, m_WakeFd, &ev) < 0)
+            ThrowErrno("epoll_ctl()");
+    }
+    catch (...) {
+        if (m_EpollFd >= 0) close(m_EpollFd);
+        if (m_WakeFd >= 0) close(m_WakeFd);
+        if (m_ListenFd >= 0) close(m_ListenFd);
+        throw;
+    }
+}
+
+TelemetryBroadcaster::~TelemetryBroadcaster()
+{
+    for (auto &c : m_Clients) {
+        if (c->Fd >= 0)
+            close(c->Fd);
+    }
+    close(m_EpollFd);
+    close(m_WakeFd);
+    close(m_ListenFd);
+}
+
+uint16_t TelemetryBroadcaster::NewSource()
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    m_Latest.push_back(Telemetry());
+    m_Changed.push_back(0);
+    return static_cast<uint16_t>(m_Latest.size() - 1);
+}
+
+void TelemetryBroadcaster::Publish(uint16_t source, const Telemetry &t)
+{
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        if (source >= m_Latest.size())
+            return;
+        m_Latest[source] = t;
+        m_Changed[source] = 1;
+        wake = !m_WakePending;
+        m_WakePending = true;
+    }
+    // Only the first telemetry after the loop collected them wakes it up.
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t r = write(m_WakeFd, &one, sizeof(one));
+        (void)r;                        // can only fail if already signaled
+    }
+}
+
+void TelemetryBroadcaster::Stop()
+{
+    m_Stop = true;
+    uint64_t one = 1;
+    ssize_t r = write(m_WakeFd, &one, sizeof(one));
+    (void)r;
+}
+
+void TelemetryBroadcaster::Run()
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (! m_Stop) {
+        int n = epoll_wait(m_EpollFd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ThrowErrno("epoll_wait()");
+        }
+
+        bool wake = false;
+        for (int i = 0; i < n; i++) {
+            void *p = events[i].data.ptr;
+            if (p == &m_ListenFd) {
+                AcceptClients();
+            }
+            else if (p == &m_WakeFd) {
+                uint64_t count;
+                ssize_t r = read(m_WakeFd, &count, sizeof(count));
+                (void)r;
+                wake = true;
+            }
+            else {
+                Client *c = static_cast<Client*>(p);
+                if (c->Fd >= 0 && (events[i].events & (EPOLLERR | EPOLLHUP)))
+                    DropClient(c);
+                if (c->Fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+                    ReadClient(c);
+                if (c->Fd >= 0 && (events[i].events & EPOLLOUT))
+                    FlushClient(c);
+            }
+        }
+
+        // Sent after the clients of this batch were accepted, so they
+        // start with the keyframes of the latest telemetry.
+        if (wake)
+            SendPublished();
+        if (m_ResyncPending)
+            ResyncClients();
+
+        RemoveDroppedClients();
+    }
+}
+
+void TelemetryBroadcaster::AcceptClients()
+{
+    while (true) {
+        int fd = accept4(m_ListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Most likely out of file descriptors, the client stays in
+                // the backlog until the next connection wakes us up.
+                LOG_MSG("TelemetryBroadcaster: accept() failed\n");
+            }
+            return;
+        }
+
+        // Disable send delay, like tcp_accept()
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        std::unique_ptr<Client> c(new Client);
+        c->Fd = fd;
+        c->Index = m_Clients.size();
+        c->Buffer.reset(new uint8_t[m_QueueSize]);
+        c->Head = c->Whole = c->Tail = 0;
+        c->NeedsKeyframe.assign(m_Encoders.size(), 1);
+        c->Resync = true;
+        m_ResyncPending = true;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c.get();
+        if (epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOG_MSG("TelemetryBroadcaster: epoll_ctl() failed\n");
+            close(fd);
+            continue;
+        }
+        m_Clients.push_back(std::move(c));
+        m_ClientCount = m_Clients.size();
+    }
+}
+
+/** Clients are not expected to send anything, we read only to find out
+ * when they disconnect. */
+void TelemetryBroadcaster::ReadClient(Client *c)
+{
+    uint8_t discard[512];
+    while (true) {
+        ssize_t r = recv(c->Fd, discard, sizeof(discard), 0);
+        if (r > 0)
+            continue;
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        DropClient(c);                  // closed or failed
+        return;
+    }
+}
+
+void TelemetryBroadcaster::FlushClient(Client *c)
+{
+    do {
+        while (c->Head < c->Tail) {
+            ssize_t r = send(c->Fd, c->Buffer.get() + c->Head, c->Tail - c->Head, MSG_NOSIGNAL);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    DropClient(c);
+                return;                 // EPOLLOUT will tell when to continue
+            }
+            c->Head += r;
+            size_t frame_size;
+            uint16_t source;
+            while (c->Whole < c->Head
+                   && PeekTelemetryFrame(c->Buffer.get() + c->Whole, c->Tail - c->Whole, frame_size, source))
+                c->Whole += frame_size;
+        }
+        c->Head = c->Whole = c->Tail = 0;
+        // Keyframes which didn't fit before go out as soon as the queue
+        // drained, not after the next batch of events.
+    } while (c->Resync && QueueKeyframes(c));
+}
+
+void TelemetryBroadcaster::DropClient(Client *c)
+{
+    close(c->Fd);                       // also removes it from the epoll set
+    c->Fd = -1;
+    m_Dropped.push_back(c);
+}
+
+void TelemetryBroadcaster::RemoveDroppedClients()
+{
+    for (auto c : m_Dropped) {
+        // Move the last client in its place
+        size_t index = c->Index;
+        if (index != m_Clients.size() - 1) {
+            m_Clients[index] = std::move(m_Clients.back());
+            m_Clients[index]->Index = index;
+        }
+        m_Clients.pop_back();
+    }
+    m_Dropped.clear();
+    m_ClientCount = m_Clients.size();
+}
+
+void TelemetryBroadcaster::SendPublished()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        m_WakePending = false;
+        m_Outgoing.clear();
+        for (size_t i = 0; i < m_Latest.size(); i++) {
+            if (m_Changed[i]) {
+                m_Outgoing.push_back(std::make_pair(static_cast<uint16_t>(i), m_Latest[i]));
+                m_Changed[i] = 0;
+            }
+        }
+        // Clients are resynchronized with Snapshot(), so no periodic
+        // keyframes are needed.
+        while (m_Encoders.size() < m_Latest.size())
+            m_Encoders.push_back(TelemetryEncoder(static_cast<uint16_t>(m_Encoders.size()), 0));
+    }
+    m_Snapshots.resize(m_Encoders.size() * MAX_TELEMETRY_FRAME);
+    m_SnapshotSizes.resize(m_Encoders.size());
+    m_SnapshotStale.resize(m_Encoders.size(), 1);
+
+    for (auto &o : m_Outgoing) {
+        uint8_t frame[MAX_TELEMETRY_FRAME];
+        size_t source = o.first;
+        size_t size = m_Encoders[source].Encode(o.second, frame);
+        m_SnapshotStale[source] = 1;
+        for (auto &c : m_Clients) {
+            if (c->Fd < 0)
+                continue;
+            if (m_Policy == QP_DROP_OLDEST)
+                DropOldest(c.get(), MAX_TELEMETRY_FRAME);
+
+            // A client which missed frames of the source gets this one as
+            // a keyframe, the deltas would be of no use to it.
+            if (source < c->NeedsKeyframe.size() && c->NeedsKeyframe[source]) {
+                size_t keyframe_size;
+                const uint8_t *keyframe = Keyframe(source, keyframe_size);
+                if (Queue(c.get(), keyframe, keyframe_size))
+                    c->NeedsKeyframe[source] = 0;
+                else
+                    m_FramesDropped++;
+                continue;
+            }
+
+            if (Queue(c.get(), frame, size))
+                continue;
+            m_FramesDropped++;
+            if (m_Policy == QP_DISCONNECT) {
+                LOG_MSG("TelemetryBroadcaster: disconnecting a client which doesn't keep up\n");
+                m_ClientsDisconnected++;
+                DropClient(c.get());
+            }
+            else {
+                NeedKeyframe(c.get(), source);
+            }
+        }
+    }
+
+    size_t queued = 0, max_queued = 0;
+    for (auto &c : m_Clients) {
+        if (c->Fd >= 0)
+            FlushClient(c.get());
+        if (c->Fd >= 0) {
+            queued += c->Tail - c->Head;
+            max_queued = (std::max)(max_queued, c->Tail - c->Head);
+        }
+    }
+    m_QueuedBytes = queued;
+    m_MaxQueuedBytes = max_queued;
+}
+
+/** Send the clients which missed frames a keyframe of the latest
+ * telemetry of those sources.  Clients without room for all of them get the
+ * rest once their queue drained, see FlushClient().
+ */
+void TelemetryBroadcaster::ResyncClients()
+{
+    m_ResyncPending = false;
+    for (auto &c : m_Clients) {
+        if (c->Fd < 0 || ! c->Resync)
+            continue;
+        QueueKeyframes(c.get());
+        FlushClient(c.get());
+    }
+}
+
+/** Queue the keyframes `c' needs, as many as fit.  Return true if any of
+ * them was queued. */
+bool TelemetryBroadcaster::QueueKeyframes(Client *c)
+{
+    bool queued = false;
+    c->Resync = false;
+    for (size_t i = 0; i < c->NeedsKeyframe.size() && i < m_Encoders.size(); i++) {
+        if (! c->NeedsKeyframe[i])
+            continue;
+        size_t size;
+        const uint8_t *keyframe = Keyframe(i, size);
+        if (m_Policy == QP_DROP_OLDEST)
+            DropOldest(c, size);
+        // Nothing encoded yet means the first frame will be a keyframe
+        if (size == 0) {
+            c->NeedsKeyframe[i] = 0;
+        }
+        else if (Queue(c, keyframe, size)) {
+            c->NeedsKeyframe[i] = 0;
+            queued = true;
+        }
+        else {
+            c->Resync = true;
+            m_ResyncPending = true;
+            break;
+        }
+    }
+    return queued;
+}
+
+/** Keyframe of the latest telemetry of `source', encoded again only after
+ * SendPublished() encoded more. */
+const uint8_t* TelemetryBroadcaster::Keyframe(size_t source, size_t &size)
+{
+    uint8_t *keyframe = &m_Snapshots[source * MAX_TELEMETRY_FRAME];
+    if (m_SnapshotStale[source]) {
+        m_SnapshotSizes[source] = m_Encoders[source].Snapshot(keyframe);
+        m_SnapshotStale[source] = 0;
+    }
+    size = m_SnapshotSizes[source];
+    return keyframe;
+}
+
+/** Add data to the output buffer of `c', unless it doesn't fit: clients
+ * always receive complete frames.  Return true if it was added. */
+bool TelemetryBroadcaster::Queue(Client *c, const uint8_t *data, size_t size)
+{
+    if (c->Tail + size > m_QueueSize && c->Head > 0) {
+        memmove(c->Buffer.get(), c->Buffer.get() + c->Head, c->Tail - c->Head);
+        c->Whole -= c->Head;
+        c->Tail -= c->Head;
+        c->Head = 0;
+    }
+    if (c->Tail + size > m_QueueSize)
+        return false;
+    memcpy(c->Buffer.get() + c->Tail, data, size);
+    c->Tail += size;
+    return true;
+}
+
+/** Discard the oldest frames queued for `c', which weren't sent in part,
+ * until there is room for `size' bytes.  The client then needs a keyframe
+ * of their sources. */
+void TelemetryBroadcaster::DropOldest(Client *c, size_t size)
+{
+    if (c->Tail - c->Head + size <= m_QueueSize)
+        return;
+    size_t end = c->Whole;
+    while (end < c->Tail && c->Tail - c->Head - (end - c->Whole) + size > m_QueueSize) {
+        size_t frame_size;
+        uint16_t source;
+        if (! PeekTelemetryFrame(c->Buffer.get() + end, c->Tail - end, frame_size, source))
+            break;
+        NeedKeyframe(c, source);
+        m_FramesDropped++;
+        end += frame_size;
+    }
+    memmove(c->Buffer.get() + c->Whole, c->Buffer.get() + end, c->Tail - end);
+    c->Tail -= end - c->Whole;
+}
+
+void TelemetryBroadcaster::NeedKeyframe(Client *c, size_t source)
+{
+    if (c->NeedsKeyframe.size() <= source)
+        c->NeedsKeyframe.resize(m_Encoders.size(), 0);
+    c->NeedsKeyframe[source] = 1;
+    c->Resync = true;
+    m_ResyncPending = true;
+}
+
+TelemetryBroadcaster::Counters TelemetryBroadcaster::GetCounters() const
+{
+    Counters counters;
+    counters.FramesDropped = m_FramesDropped.load();
+    counters.ClientsDisconnected = m_ClientsDisconnected.load();
+    counters.QueuedBytes = m_QueuedBytes.load();
+    counters.MaxQueuedBytes = m_MaxQueuedBytes.load();
+    return counters;
+}
+
+#endif
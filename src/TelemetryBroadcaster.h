@@ -0,0 +1,163 @@
+/**
+ *  TelemetryBroadcaster -- send telemetry to TCP clients
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "TelemetryProtocol.h"
+#include "TelemetrySink.h"
+
+#if defined(__linux__)
+
+/** Accept TCP clients and send them the telemetry of one or more
+ * TelemetryServer instances, as a stream of TelemetryProtocol frames, the
+ * frame source being the one returned by NewSource().  Each telemetry is
+ * encoded once, for all clients.  A client starts with a keyframe of each
+ * source, then receives deltas.
+ *
+ * Run() is an edge-triggered epoll loop, all sockets are non-blocking, so a
+ * slow client never holds up the others: each client has a bounded output
+ * queue, CLIENT_BUFFER_SIZE bytes by default, and the QueuePolicy decides
+ * what happens to a frame which doesn't fit in it.  A client which missed
+ * frames of a source receives a keyframe of that source once there is room.
+ * Telemetry published while the loop is busy is coalesced, only the latest
+ * one of each source is sent.  Apart from accepting clients and adding
+ * sources, the loop doesn't allocate memory.
+ */
+class TelemetryBroadcaster : public TelemetrySink
+{
+public:
+    enum {
+        DEFAULT_PORT = 7500,
+        CLIENT_BUFFER_SIZE = 8 * 1024,
+        MAX_EVENTS = 64                 // handled per epoll_wait() call
+    };
+
+    /** What to do when the queue of a client is full */
+    enum QueuePolicy {
+        QP_KEEP_LATEST,                 // skip new frames, send the latest telemetry once there is room
+        QP_DROP_OLDEST,                 // discard the oldest queued frames, so the queue never lags
+        QP_DISCONNECT                   // disconnect the client
+    };
+
+    struct Counters {
+        uint64_t FramesDropped;         // skipped or discarded from a client queue
+        uint64_t ClientsDisconnected;   // by QP_DISCONNECT
+        size_t QueuedBytes;             // in all client queues
+        size_t MaxQueuedBytes;          // in the fullest client queue
+    };
+
+    /** Listen on `port', 0 picks a free one, see GetPort(), and give each
+     * client a queue of `queue_size' bytes, handled with `policy'.  Throws
+     * std::system_error if the socket can't be set up or `queue_size' is
+     * smaller than MAX_TELEMETRY_FRAME. */
+    explicit TelemetryBroadcaster(int port = DEFAULT_PORT,
+                                  QueuePolicy policy = QP_KEEP_LATEST,
+                                  size_t queue_size = CLIENT_BUFFER_SIZE);
+    ~TelemetryBroadcaster();
+
+    TelemetryBroadcaster(const TelemetryBroadcaster&) = delete;
+    TelemetryBroadcaster& operator=(const TelemetryBroadcaster&) = delete;
+
+    /** TelemetrySink interface, can be called from any thread. */
+    uint16_t NewSource() override;
+    void Publish(uint16_t source, const Telemetry &t) override;
+
+    /** Serve clients until Stop() is called. */
+    void Run();
+
+    /** Make Run() return, can be called from any thread. */
+    void Stop();
+
+    int GetPort() const { return m_Port; }
+
+    /** Clients currently connected, as seen by the Run() thread. */
+    size_t ClientCount() const { return m_ClientCount.load(); }
+
+    /** Drop and disconnect counts since the start, and the queue depths as
+     * of the last telemetry sent, can be called from any thread. */
+    Counters GetCounters() const;
+
+private:
+    struct Client {
+        int Fd;                         // -1 once dropped
+        size_t Index;                   // in m_Clients
+        std::unique_ptr<uint8_t[]> Buffer;
+        size_t Head;                    // next byte to send
+        size_t Whole;                   // first frame none of which was sent
+        size_t Tail;                    // end of the data to send
+        // Sources which need a keyframe before more deltas, indexed by
+        // source, missing entries don't.
+        std::vector<uint8_t> NeedsKeyframe;
+        bool Resync;                    // some entry of NeedsKeyframe is set
+    };
+
+    void AcceptClients();
+    void ReadClient(Client *c);
+    void FlushClient(Client *c);
+    void DropClient(Client *c);
+    void RemoveDroppedClients();
+    void SendPublished();
+    void ResyncClients();
+    bool QueueKeyframes(Client *c);
+    const uint8_t* Keyframe(size_t source, size_t &size);
+    bool Queue(Client *c, const uint8_t *data, size_t size);
+    void DropOldest(Client *c, size_t size);
+    void NeedKeyframe(Client *c, size_t source);
+
+    int m_ListenFd;
+    int m_WakeFd;                       // eventfd, signaled by Publish() and Stop()
+    int m_EpollFd;
+    int m_Port;
+    QueuePolicy m_Policy;
+    size_t m_QueueSize;
+    std::atomic<bool> m_Stop;
+
+    // Latest telemetry of each source, guarded by m_Lock
+    std::mutex m_Lock;
+    std::vector<Telemetry> m_Latest;
+    std::vector<uint8_t> m_Changed;
+    bool m_WakePending;
+
+    // Used by the Run() thread only
+    std::vector<std::unique_ptr<Client>> m_Clients;
+    std::vector<Client*> m_Dropped;
+    std::vector<std::pair<uint16_t, Telemetry>> m_Outgoing;
+    std::vector<TelemetryEncoder> m_Encoders;   // one per source
+    std::vector<uint8_t> m_Snapshots;   // keyframe of each source, see Keyframe()
+    std::vector<size_t> m_SnapshotSizes;
+    std::vector<uint8_t> m_SnapshotStale;       // encoded more since the keyframe
+    bool m_ResyncPending;
+    std::atomic<size_t> m_ClientCount;
+    std::atomic<uint64_t> m_FramesDropped;
+    std::atomic<uint64_t> m_ClientsDisconnected;
+    std::atomic<size_t> m_QueuedBytes;
+    std::atomic<size_t> m_MaxQueuedBytes;
+};
+
+#endif
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,159 @@
+/**
+ *  TelemetryMulticaster -- send telemetry to a UDP multicast group
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "TelemetryMulticaster.h"
+#include "Tools.h"
+
+#if defined(__linux__)
+
+#include <string.h>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+void ThrowErrno(const char *who)
+{
+    throw std::system_error(errno, std::generic_category(), who);
+}
+
+};                                      // end anonymous namespace
+
+const char *TelemetryMulticaster::DEFAULT_GROUP = "239.255.75.0";
+
+TelemetryMulticaster::TelemetryMulticaster(
+    const std::string &group, int port, int ttl, const std::string &interface)
+    : m_Socket(-1),
+      m_LastSnapshot(0),
+      m_Sent(0),
+      m_Dropped(0)
+{
+    memset(&m_Group, 0, sizeof(m_Group));
+    m_Group.sin_family = AF_INET;
+    m_Group.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, group.c_str(), &m_Group.sin_addr) != 1
+        || ! IN_MULTICAST(ntohl(m_Group.sin_addr.s_addr))) {
+        throw std::system_error(EINVAL, std::generic_category(),
+                                "TelemetryMulticaster: bad multicast group " + group);
+    }
+    struct in_addr interface_address;
+    interface_address.s_addr = htonl(INADDR_ANY);
+    if (! interface.empty() && inet_pton(AF_INET, interface.c_str(), &interface_address) != 1) {
+        throw std::system_error(EINVAL, std::generic_category(),
+                                "TelemetryMulticaster: bad interface address " + interface);
+    }
+
+    m_Socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (m_Socket < 0)
+        ThrowErrno("socket()");
+
+    unsigned char multicast_ttl = static_cast<unsigned char>(ttl);
+    unsigned char loop = 1;
+    if (setsockopt(m_Socket, IPPROTO_IP, IP_MULTICAST_TTL, &multicast_ttl, sizeof(multicast_ttl)) < 0
+        || setsockopt(m_Socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+        || (! interface.empty()
+            && setsockopt(m_Socket, IPPROTO_IP, IP_MULTICAST_IF,
+                          &interface_address, sizeof(interface_address)) < 0)) {
+        int error = errno;
+        close(m_Socket);
+        throw std::system_error(error, std::generic_category(), "setsockopt(IP_MULTICAST)");
+    }
+}
+
+TelemetryMulticaster::~TelemetryMulticaster()
+{
+    close(m_Socket);
+}
+
+uint16_t TelemetryMulticaster::NewSource()
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    uint16_t source = static_cast<uint16_t>(m_Encoders.size());
+    m_Encoders.push_back(TelemetryEncoder(source));
+    return source;
+}
+
+void TelemetryMulticaster::Publish(uint16_t source, const Telemetry &t)
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    if (source >= m_Encoders.size())
+        return;
+    uint8_t frame[MAX_TELEMETRY_FRAME];
+    size_t size = m_Encoders[source].Encode(t, frame);
+    Send(frame, size);
+
+    if (CurrentMilliseconds() - m_LastSnapshot >= SNAPSHOT_INTERVAL)
+        SendSnapshotLocked();
+}
+
+void TelemetryMulticaster::SendSnapshot()
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    SendSnapshotLocked();
+}
+
+void TelemetryMulticaster::SendSnapshotLocked()
+{
+    uint8_t datagram[MAX_DATAGRAM];
+    size_t size = 0;
+    for (auto &e : m_Encoders) {
+        if (size + MAX_TELEMETRY_FRAME > sizeof(datagram)) {
+            Send(datagram, size);
+            size = 0;
+        }
+        size += e.Snapshot(datagram + size);
+    }
+    if (size > 0)
+        Send(datagram, size);
+    m_LastSnapshot = CurrentMilliseconds();
+}
+
+void TelemetryMulticaster::Send(const uint8_t *data, size_t size)
+{
+    ssize_t r;
+    do {
+        r = sendto(m_Socket, data, size, MSG_DONTWAIT,
+                   (const struct sockaddr*)&m_Group, sizeof(m_Group));
+    } while (r < 0 && errno == EINTR);
+
+    // Errors other than a full buffer (e.g. no route while the network is
+    // down) are not ours to handle either, receivers resync once the
+    // datagrams get through again.
+    if (r < 0)
+        m_Dropped++;
+    else
+        m_Sent++;
+}
+
+uint32_t TelemetryMulticaster::Sent() const
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_Sent;
+}
+
+uint32_t TelemetryMulticaster::Dropped() const
+{
+    std::lock_guard<std::mutex> guard(m_Lock);
+    return m_Dropped;
+}
+
+#endif
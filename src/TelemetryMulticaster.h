@@ -0,0 +1,100 @@
+/**
+ *  TelemetryMulticaster -- send telemetry to a UDP multicast group
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "TelemetryProtocol.h"
+#include "TelemetrySink.h"
+
+#if defined(__linux__)
+
+#include <netinet/in.h>
+
+/** Send the telemetry of one or more TelemetryServer instances to a UDP
+ * multicast group, as TelemetryProtocol frames.  Each telemetry is sent
+ * once, in its own datagram, no matter how many receivers joined the group.
+ *
+ * UDP can lose datagrams and receivers can join at any time, so besides the
+ * keyframe every TelemetryEncoder::DEFAULT_KEYFRAME_INTERVAL frames of a
+ * source, a snapshot (a keyframe of every source, packed into as few
+ * datagrams as possible) is sent every SNAPSHOT_INTERVAL milliseconds, as
+ * long as telemetry is being published.
+ *
+ * Sending never blocks: when the socket buffer is full, the datagram is
+ * dropped, like the network would.
+ */
+class TelemetryMulticaster : public TelemetrySink
+{
+public:
+    enum {
+        DEFAULT_PORT = 7501,
+        SNAPSHOT_INTERVAL = 1000,       // milliseconds
+        MAX_DATAGRAM = 1400             // stays below the Ethernet MTU
+    };
+
+    static const char *DEFAULT_GROUP;   // 239.255.75.0, administratively scoped
+
+    /** Send to `group':`port', with a multicast TTL of `ttl', 1 keeps the
+     * datagrams on the local network.  `interface' is the address of the
+     * interface to send from, e.g. 127.0.0.1 for receivers on this host
+     * only, by default the system picks one.  Datagrams are looped back, so
+     * receivers on this host get them either way.  Throws
+     * std::system_error if the socket can't be set up. */
+    explicit TelemetryMulticaster(const std::string &group = DEFAULT_GROUP,
+                                  int port = DEFAULT_PORT, int ttl = 1,
+                                  const std::string &interface = "");
+    ~TelemetryMulticaster();
+
+    TelemetryMulticaster(const TelemetryMulticaster&) = delete;
+    TelemetryMulticaster& operator=(const TelemetryMulticaster&) = delete;
+
+    /** TelemetrySink interface, can be called from any thread. */
+    uint16_t NewSource() override;
+    void Publish(uint16_t source, const Telemetry &t) override;
+
+    /** Send a snapshot now, e.g. when a receiver asks for one out of band. */
+    void SendSnapshot();
+
+    /** Datagrams sent, and dropped because the socket buffer was full */
+    uint32_t Sent() const;
+    uint32_t Dropped() const;
+
+private:
+    void Send(const uint8_t *data, size_t size);
+    void SendSnapshotLocked();
+
+    int m_Socket;
+    struct sockaddr_in m_Group;
+
+    mutable std::mutex m_Lock;
+    std::vector<TelemetryEncoder> m_Encoders; // one per source
+    uint32_t m_LastSnapshot;            // CurrentMilliseconds()
+    uint32_t m_Sent;
+    uint32_t m_Dropped;
+};
+
+#endif
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
@@ -0,0 +1,312 @@
+/**
+ *  TelemetryProtocol -- compact binary encoding of telemetry streams
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "stdafx.h"
+#include "TelemetryProtocol.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+/** IMPLEMENTATION NOTE
+ *
+ * The encoder and decoder convert a Telemetry to and from the same array of
+ * integer fields, and the encoder computes the deltas from the integers it
+ * sent last, not from the previous Telemetry, so rounding errors don't
+ * accumulate on the receiving side: a decoded telemetry is always within
+ * half a fixed point unit of the one that was encoded.
+ *
+ * All arithmetic on the fields is done modulo 2^64, so the 32 bit timestamps
+ * wrapping around produce a large delta, which the decoder undoes when
+ * truncating the field back to 32 bits.
+ */
+
+namespace {
+
+const double HR_SCALE = 100.0;
+const double PWR_SCALE = 100.0;
+const double SPD_SCALE = 1000.0;
+const double CAD_SCALE = 100.0;
+
+// Maximum size of an encoded 64 bit varint
+const size_t MAX_VARINT = 10;
+
+int64_t ToFixed(double value, double scale)
+{
+    return static_cast<int64_t>(std::llround(value * scale));
+}
+
+void ToFields(const Telemetry &t, int64_t *f)
+{
+    f[TFI_HR] = ToFixed(t.hr, HR_SCALE);
+    f[TFI_PWR] = ToFixed(t.pwr, PWR_SCALE);
+    f[TFI_SPD] = ToFixed(t.spd, SPD_SCALE);
+    f[TFI_CAD] = ToFixed(t.cad, CAD_SCALE);
+    f[TFI_HR_TIME] = t.hr_time;
+    f[TFI_PWR_TIME] = t.pwr_time;
+    f[TFI_SPD_TIME] = t.spd_time;
+    f[TFI_CAD_TIME] = t.cad_time;
+    f[TFI_STATE_TIME] = t.state_time;
+    f[TFI_SEQUENCE] = t.sequence;
+    f[TFI_VALID] = t.valid;
+    f[TFI_TRAINER_STATE] = t.trainer_state;
+    f[TFI_SIMULATION_STATE] = t.simulation_state;
+    f[TFI_SPD_IS_VIRTUAL] = t.spd_is_virtual;
+}
+
+void FromFields(const int64_t *f, Telemetry &t)
+{
+    t.hr = f[TFI_HR] / HR_SCALE;
+    t.pwr = f[TFI_PWR] / PWR_SCALE;
+    t.spd = f[TFI_SPD] / SPD_SCALE;
+    t.cad = f[TFI_CAD] / CAD_SCALE;
+    t.hr_time = static_cast<uint32_t>(f[TFI_HR_TIME]);
+    t.pwr_time = static_cast<uint32_t>(f[TFI_PWR_TIME]);
+    t.spd_time = static_cast<uint32_t>(f[TFI_SPD_TIME]);
+    t.cad_time = static_cast<uint32_t>(f[TFI_CAD_TIME]);
+    t.state_time = static_cast<uint32_t>(f[TFI_STATE_TIME]);
+    t.sequence = static_cast<uint32_t>(f[TFI_SEQUENCE]);
+    t.valid = static_cast<uint32_t>(f[TFI_VALID]);
+    t.trainer_state = static_cast<uint8_t>(f[TFI_TRAINER_STATE]);
+    t.simulation_state = static_cast<uint8_t>(f[TFI_SIMULATION_STATE]);
+    t.spd_is_virtual = static_cast<uint8_t>(f[TFI_SPD_IS_VIRTUAL]);
+    t.reserved = 0;
+}
+
+uint64_t ZigZag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t UnZigZag(uint64_t value)
+{
+    return static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+size_t PutVarint(uint64_t value, uint8_t *out)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = static_cast<uint8_t>(value);
+    return n;
+}
+
+/** Read a varint from data[pos..size), advancing `pos'.  Return false if
+ * it is incomplete or too long. */
+bool GetVarint(const uint8_t *data, size_t size, size_t &pos, uint64_t &value)
+{
+    value = 0;
+    for (unsigned shift = 0; shift < 7 * MAX_VARINT; shift += 7) {
+        if (pos >= size)
+            return false;
+        uint8_t b = data[pos++];
+        value |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+/** Write the `body' of a frame to `out', preceded by its length. */
+size_t PutFrame(const uint8_t *body, size_t size, uint8_t *out)
+{
+    size_t n = PutVarint(size, out);
+    memcpy(out + n, body, size);
+    return n + size;
+}
+
+/** Write the part common to all frames */
+size_t PutFrameHeader(TelemetryFrameType type, uint16_t source, uint32_t sequence, uint8_t *out)
+{
+    size_t n = 0;
+    out[n++] = static_cast<uint8_t>(TELEMETRY_PROTOCOL_VERSION << 4 | type);
+    n += PutVarint(source, out + n);
+    n += PutVarint(sequence, out + n);
+    return n;
+}
+
+static_assert(TELEMETRY_FIELD_COUNT < 64, "field mask fits in a varint");
+// length, type, source, sequence, field mask and the fields
+static_assert(2 + 1 + 3 + 5 + 2 + TELEMETRY_FIELD_COUNT * MAX_VARINT <= MAX_TELEMETRY_FRAME,
+              "largest frame fits in MAX_TELEMETRY_FRAME");
+
+};                                      // end anonymous namespace
+
+TelemetryEncoder::TelemetryEncoder(uint16_t source, uint32_t keyframe_interval)
+    : m_Source(source),
+      m_KeyframeInterval(keyframe_interval),
+      m_SinceKeyframe(0),
+      m_Started(false),
+      m_Sequence(0)
+{
+    std::fill(m_Fields, m_Fields + TELEMETRY_FIELD_COUNT, 0);
+}
+
+size_t TelemetryEncoder::Encode(const Telemetry &t, uint8_t *out)
+{
+    int64_t fields[TELEMETRY_FIELD_COUNT];
+    ToFields(t, fields);
+    m_Sequence++;
+    m_Started = true;
+
+    bool keyframe = m_SinceKeyframe == 0
+        || (m_KeyframeInterval > 0 && m_SinceKeyframe >= m_KeyframeInterval);
+    if (keyframe) {
+        std::copy(fields, fields + TELEMETRY_FIELD_COUNT, m_Fields);
+        m_SinceKeyframe = 1;
+        return EncodeKeyframe(m_Sequence, out);
+    }
+
+    uint8_t body[MAX_TELEMETRY_FRAME];
+    size_t n = PutFrameHeader(TFT_DELTA, m_Source, m_Sequence, body);
+    uint64_t mask = 0;
+    for (int i = 0; i < TELEMETRY_FIELD_COUNT; i++) {
+        if (fields[i] != m_Fields[i])
+            mask |= uint64_t(1) << i;
+    }
+    n += PutVarint(mask, body + n);
+    for (int i = 0; i < TELEMETRY_FIELD_COUNT; i++) {
+        if (mask & (uint64_t(1) << i)) {
+            uint64_t delta = static_cast<uint64_t>(fields[i]) - static_cast<uint64_t>(m_Fields[i]);
+            n += PutVarint(ZigZag(static_cast<int64_t>(delta)), body + n);
+            m_Fields[i] = fields[i];
+        }
+    }
+    m_SinceKeyframe++;
+    return PutFrame(body, n, out);
+}
+
+size_t TelemetryEncoder::Snapshot(uint8_t *out) const
+{
+    if (! m_Started)
+        return 0;
+    return EncodeKeyframe(m_Sequence, out);
+}
+
+size_t TelemetryEncoder::EncodeKeyframe(uint32_t sequence, uint8_t *out) const
+{
+    uint8_t body[MAX_TELEMETRY_FRAME];
+    size_t n = PutFrameHeader(TFT_KEYFRAME, m_Source, sequence, body);
+    for (int i = 0; i < TELEMETRY_FIELD_COUNT; i++)
+        n += PutVarint(ZigZag(m_Fields[i]), body + n);
+    return PutFrame(body, n, out);
+}
+
+TelemetryDecoder::TelemetryDecoder()
+    : m_Gaps(0)
+{
+}
+
+TelemetryDecoder::DecodeStatus TelemetryDecoder::Decode(
+    const uint8_t *data, size_t size, size_t &used,
+    uint16_t &source, Telemetry &t)
+{
+    size_t pos = 0;
+    uint64_t length;
+    if (! GetVarint(data, size, pos, length))
+        return size >= MAX_VARINT ? TDS_MALFORMED : TDS_INCOMPLETE;
+    if (length == 0 || length > MAX_TELEMETRY_FRAME)
+        return TDS_MALFORMED;
+    if (size - pos < length)
+        return TDS_INCOMPLETE;
+    used = pos + static_cast<size_t>(length);
+
+    // From here on, `size' is the end of the frame
+    size = used;
+    uint8_t type = data[pos++];
+    if ((type >> 4) != TELEMETRY_PROTOCOL_VERSION)
+        return TDS_MALFORMED;
+    uint64_t s, sequence;
+    if (! GetVarint(data, size, pos, s) || s > 0xFFFF
+        || ! GetVarint(data, size, pos, sequence) || sequence > 0xFFFFFFFF)
+        return TDS_MALFORMED;
+
+    if (s >= m_Sources.size()) {
+        SourceState empty;
+        empty.Synchronized = false;
+        empty.Sequence = 0;
+        std::fill(empty.Fields, empty.Fields + TELEMETRY_FIELD_COUNT, 0);
+        m_Sources.resize(static_cast<size_t>(s) + 1, empty);
+    }
+    SourceState &st = m_Sources[static_cast<size_t>(s)];
+    int64_t fields[TELEMETRY_FIELD_COUNT];
+
+    switch (type & 0x0F) {
+    case TFT_KEYFRAME:
+        for (int i = 0; i < TELEMETRY_FIELD_COUNT; i++) {
+            uint64_t v;
+            if (! GetVarint(data, size, pos, v))
+                return TDS_MALFORMED;
+            fields[i] = UnZigZag(v);
+        }
+        // A snapshot repeats the last frame, that is not a gap
+        if (st.Synchronized && sequence != st.Sequence && sequence != uint32_t(st.Sequence + 1))
+            m_Gaps++;
+        break;
+
+    case TFT_DELTA: {
+        if (! st.Synchronized)
+            return TDS_NEED_KEYFRAME;
+        if (sequence != uint32_t(st.Sequence + 1)) {
+            m_Gaps++;
+            st.Synchronized = false;
+            return TDS_NEED_KEYFRAME;
+        }
+        uint64_t mask;
+        if (! GetVarint(data, size, pos, mask) || (mask >> TELEMETRY_FIELD_COUNT) != 0)
+            return TDS_MALFORMED;
+        std::copy(st.Fields, st.Fields + TELEMETRY_FIELD_COUNT, fields);
+        for (int i = 0; i < TELEMETRY_FIELD_COUNT; i++) {
+            if (mask & (uint64_t(1) << i)) {
+                uint64_t v;
+                if (! GetVarint(data, size, pos, v))
+                    return TDS_MALFORMED;
+                fields[i] = static_cast<int64_t>(
+                    static_cast<uint64_t>(fields[i]) + static_cast<uint64_t>(UnZigZag(v)));
+            }
+        }
+        break;
+    }
+
+    default:
+        return TDS_MALFORMED;
+    }
+
+    std::copy(fields, fields + TELEMETRY_FIELD_COUNT, st.Fields);
+    st.Synchronized = true;
+    st.Sequence = static_cast<uint32_t>(sequence);
+    source = static_cast<uint16_t>(s);
+    FromFields(st.Fields, t);
+    return TDS_TELEMETRY;
+}
+
+bool PeekTelemetryFrame(const uint8_t *data, size_t size, size_t &frame_size, uint16_t &source)
+{
+    size_t pos = 0;
+    uint64_t length, s;
+    if (! GetVarint(data, size, pos, length) || length == 0 || size - pos < length)
+        return false;
+    frame_size = pos + static_cast<size_t>(length);
+    pos++;                              // type
+    if (! GetVarint(data, frame_size, pos, s) || s > 0xFFFF)
+        return false;
+    source = static_cast<uint16_t>(s);
+    return true;
+}
@@ -0,0 +1,159 @@
+/**
+ *  TelemetryProtocol -- compact binary encoding of telemetry streams
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "structures.h"
+
+/** A telemetry stream is a sequence of frames, each one holding a
+ * Telemetry of one source (a TelemetryServer):
+ *
+ *     length    varint   number of bytes following it
+ *     type      uint8    TELEMETRY_PROTOCOL_VERSION << 4 | TelemetryFrameType
+ *     source    varint
+ *     sequence  varint   frame number, counted per source
+ *     fields             see below
+ *
+ * The fields are integers: the measurements are stored in fixed point, the
+ * heart rate, power and cadence in hundredths, the speed in mm/s.  A
+ * keyframe has all TELEMETRY_FIELD_COUNT of them, in TelemetryField order,
+ * zigzag varint encoded.  A delta frame has a varint bit mask of the fields
+ * which changed since the previous frame of the source, followed by the
+ * zigzag varint difference of each of them.
+ *
+ * Varints are 7 bits per byte, least significant group first, with the high
+ * bit set on all bytes but the last.  Zigzag maps signed to unsigned values,
+ * 0, -1, 1, -2 ... to 0, 1, 2, 3 ...
+ *
+ * Frames are self-delimiting, so they can be sent over a TCP stream or
+ * packed into UDP datagrams alike.  A delta only applies to the frame just
+ * before it: receivers detect lost frames from the sequence numbers and
+ * ignore the source's deltas until the next keyframe.
+ */
+enum {
+    TELEMETRY_PROTOCOL_VERSION = 1,
+    MAX_TELEMETRY_FRAME = 160           // bytes, including the length
+};
+
+enum TelemetryFrameType {
+    TFT_KEYFRAME = 1,
+    TFT_DELTA = 2
+};
+
+enum TelemetryField {
+    TFI_HR, TFI_PWR, TFI_SPD, TFI_CAD,
+    TFI_HR_TIME, TFI_PWR_TIME, TFI_SPD_TIME, TFI_CAD_TIME, TFI_STATE_TIME,
+    TFI_SEQUENCE, TFI_VALID,
+    TFI_TRAINER_STATE, TFI_SIMULATION_STATE, TFI_SPD_IS_VIRTUAL,
+    TELEMETRY_FIELD_COUNT
+};
+
+/** Encode the telemetry of one source into frames.  Encoding is cheap and
+ * the result does not depend on the receiver, so a server encodes each
+ * telemetry once and sends the same frame to all of its clients.
+ */
+class TelemetryEncoder
+{
+public:
+    /** A keyframe is sent every this many frames, so receivers which lost
+     * a frame recover: 40 frames are 10 seconds at 4 Hz. */
+    enum { DEFAULT_KEYFRAME_INTERVAL = 40 };
+
+    /** Encode the telemetry of `source'.  With a `keyframe_interval' of 0
+     * only the first frame is a keyframe, which suits a reliable transport
+     * when each receiver starts with a Snapshot(). */
+    explicit TelemetryEncoder(uint16_t source = 0,
+                              uint32_t keyframe_interval = DEFAULT_KEYFRAME_INTERVAL);
+
+    /** Encode `t' as the next frame into `out', which must have room for
+     * MAX_TELEMETRY_FRAME bytes, and return the frame size. */
+    size_t Encode(const Telemetry &t, uint8_t *out);
+
+    /** Encode the last telemetry again, as a keyframe with the sequence
+     * number of the last frame, into `out'.  A receiver joining the stream
+     * (or which lost frames) can apply the deltas following it.  Returns 0
+     * if nothing was encoded yet. */
+    size_t Snapshot(uint8_t *out) const;
+
+    /** Make the next frame a keyframe. */
+    void ForceKeyframe() { m_SinceKeyframe = 0; }
+
+    uint16_t Source() const { return m_Source; }
+
+    /** Sequence number of the last frame */
+    uint32_t Sequence() const { return m_Sequence; }
+
+private:
+    size_t EncodeKeyframe(uint32_t sequence, uint8_t *out) const;
+
+    uint16_t m_Source;
+    uint32_t m_KeyframeInterval;
+    uint32_t m_SinceKeyframe;           // frames since the last keyframe, 0 to force one
+    bool m_Started;                     // a frame was encoded
+    uint32_t m_Sequence;
+    int64_t m_Fields[TELEMETRY_FIELD_COUNT];
+};
+
+/** Decode the frames of one or more sources, keeping track of the last
+ * telemetry of each source to apply the deltas to.
+ */
+class TelemetryDecoder
+{
+public:
+    enum DecodeStatus {
+        TDS_INCOMPLETE,                 // not enough data for a full frame yet
+        TDS_TELEMETRY,                  // a telemetry was decoded
+        TDS_NEED_KEYFRAME,              // a delta was skipped, see above
+        TDS_MALFORMED                   // not a frame, or of another version
+    };
+
+    TelemetryDecoder();
+
+    /** Decode the frame at the start of `data', `size' bytes.  With
+     * TDS_TELEMETRY and TDS_NEED_KEYFRAME, `used' is set to the frame size,
+     * with TDS_TELEMETRY `source' and `t' are set as well.  After
+     * TDS_MALFORMED, the stream can't be decoded further. */
+    DecodeStatus Decode(const uint8_t *data, size_t size, size_t &used,
+                        uint16_t &source, Telemetry &t);
+
+    /** Number of times frames were found missing */
+    uint32_t Gaps() const { return m_Gaps; }
+
+private:
+    struct SourceState {
+        bool Synchronized;              // a keyframe was received, no frames lost since
+        uint32_t Sequence;
+        int64_t Fields[TELEMETRY_FIELD_COUNT];
+    };
+
+    std::vector<SourceState> m_Sources;
+    uint32_t m_Gaps;
+};
+
+/** Find the size and source of the frame at the start of `data', `size'
+ * bytes, without decoding it, e.g. to discard frames queued for sending.
+ * Return false if `data' doesn't start with a complete frame. */
+bool PeekTelemetryFrame(const uint8_t *data, size_t size, size_t &frame_size, uint16_t &source);
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
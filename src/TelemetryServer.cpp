@@ -20,32 +20,140 @@
 #include "TelemetryServer.h"
 #include "Tools.h"
 
+namespace {
+
+/** Compare everything but the sequence number. */
+bool SameTelemetry(const Telemetry &a, const Telemetry &b)
+{
+    return a.hr == b.hr && a.hr_time == b.hr_time
+        && a.pwr == b.pwr && a.pwr_time == b.pwr_time
+        && a.spd == b.spd && a.spd_time == b.spd_time
+        && a.spd_is_virtual == b.spd_is_virtual
+        && a.cad == b.cad && a.cad_time == b.cad_time
+        && a.trainer_state == b.trainer_state
+        && a.simulation_state == b.simulation_state
+        && a.state_time == b.state_time
+        && a.valid == b.valid;
+}
+
+/** True if any field of `b' holds a sample newer than the one in `a'. */
+bool HasNewSample(const Telemetry &a, const Telemetry &b)
+{
+    return a.hr_time != b.hr_time || a.pwr_time != b.pwr_time
+        || a.spd_time != b.spd_time || a.cad_time != b.cad_time
+        || a.state_time != b.state_time;
+}
+
+bool IsFresh(uint32_t timestamp, uint32_t now, uint32_t stale_timeout)
+{
+    return timestamp != 0 && (now - timestamp) <= stale_timeout;
+}
+
+};                                      // end anonymous namespace
+
 std::ostream& operator<<(std::ostream &out, const Telemetry &t)
 {
-    if (t.hr >= 0)
-        out << "HR: " << t.hr;
+    const char *sep = "";
+    if (t.valid & TF_HR) {
+        out << sep << "HR: " << t.hr;
+        sep = ", ";
+    }
+    if (t.valid & TF_PWR) {
+        out << sep << "PWR: " << t.pwr;
+        sep = ", ";
+    }
+    if (t.valid & TF_SPD) {
+        out << sep << "SPD: " << t.spd * 3.6 << (t.spd_is_virtual ? " (virtual)" : "");
+        sep = ", ";
+    }
+    if (t.valid & TF_CAD) {
+        out << sep << "CAD: " << t.cad;
+        sep = ", ";
+    }
     return out;
 }
 
-TelemetryServer::TelemetryServer (AntStick * stick, std::unique_ptr<AntChannel> * device, std::mutex & guard)
-    : m_AntStick (stick),
+TelemetryServer::TelemetryServer (AntStickPool * sticks, std::unique_ptr<AntChannel> * device, std::mutex & guard)
+    : m_AntSticks (sticks),
       m_Hrm(nullptr),
+      m_Bike(nullptr),
       m_current_telemetry(),
+      m_SeenUpdates(0),
+      m_Recorder(nullptr),
+      m_RecorderSource(0),
+      m_LastFlush(0),
       m_guard(guard)
 {
-    if (device && device->get() && device->get()->ChannelId().DeviceType == HRM::ANT_DEVICE_TYPE)
-        m_Hrm = device;
+    AddDevice(device);
     LOG_MSG("Started server");
 }
 
+void TelemetryServer::AddDevice(std::unique_ptr<AntChannel> * device)
+{
+    std::lock_guard<std::mutex> Guard(m_guard);
+    if (!device || !device->get())
+        return;
+    if (device->get()->ChannelId().DeviceType == HRM::ANT_DEVICE_TYPE)
+        m_Hrm = device;
+    else if (device->get()->ChannelId().DeviceType == BIKE::ANT_DEVICE_TYPE)
+        m_Bike = device;
+}
+
 TelemetryServer::~TelemetryServer()
 {}
 
 void TelemetryServer::Tick()
 {
-    std::lock_guard<std::mutex> Guard(m_guard);
-    CheckSensorHealth();
-    CollectTelemetry();
+    m_SeenUpdates = m_AntSticks->GetUpdateSignal()->Wait(m_SeenUpdates, MAX_TICK_WAIT);
+
+    if (m_Recorder) {
+        uint32_t now = CurrentMilliseconds();
+        if (now - m_LastFlush >= RECORDER_FLUSH_INTERVAL) {
+            m_Recorder->Flush();
+            m_LastFlush = now;
+        }
+    }
+
+    Telemetry previous = m_current_telemetry;
+    {
+        // The search service changes and destroys the channels under the
+        // guard, but does not hold it while waiting for messages.
+        std::lock_guard<std::mutex> Guard(m_guard);
+        CheckSensorHealth();
+        CollectTelemetry();
+        CollectAggregates();
+    }
+    if (SameTelemetry(previous, m_current_telemetry))
+        return;
+    // A field going stale is published too, but only new samples advance
+    // the sequence number, see Telemetry::sequence.
+    if (HasNewSample(previous, m_current_telemetry))
+        m_current_telemetry.sequence++;
+    m_Published.Store(m_current_telemetry);
+    m_TelemetryChanged.Notify();
+    if (m_Recorder)
+        m_Recorder->RecordTelemetry(m_RecorderSource, m_current_telemetry);
+    for (auto &s : m_Sinks)
+        s.first->Publish(s.second, m_current_telemetry);
+}
+
+void TelemetryServer::SetRecorder(SessionRecorder *recorder)
+{
+    m_Recorder = recorder;
+    if (m_Recorder)
+        m_RecorderSource = m_Recorder->NewSource();
+}
+
+void TelemetryServer::AddSink(TelemetrySink *sink)
+{
+    m_Sinks.push_back(std::make_pair(sink, sink->NewSource()));
+}
+
+void TelemetryServer::Wake()
+{
+    // Other servers on the pool wake up too, they find nothing has changed
+    // and go back to waiting.
+    m_AntSticks->GetUpdateSignal()->Notify();
 }
 
 void TelemetryServer::CheckSensorHealth()
@@ -53,15 +161,81 @@ void TelemetryServer::CheckSensorHealth()
     //TODO implement reconnect to device from searching service's pool
 }
 
+/** Take the fresh samples from the devices, fields without one keep their
+ * last sample but are no longer valid.
+ */
 void TelemetryServer::CollectTelemetry ()
 {
-    double hr = 0;
-    if (m_Hrm && m_Hrm->get() && m_Hrm->get()->ChannelState() == AntChannel::CH_OPEN)
-        hr = ((HeartRateMonitor *)m_Hrm->get())->InstantHeartRate();
-    m_current_telemetry.hr = hr ? hr : m_current_telemetry.hr;
+    Telemetry &t = m_current_telemetry;
+    auto now = CurrentMilliseconds();
+    t.valid = 0;
+
+    if (m_Hrm && m_Hrm->get()) {
+        auto r = ((HeartRateMonitor *)m_Hrm->get())->LatestReadings();
+        if (IsFresh(r.Timestamp, now, HRM::STALE_TIMEOUT)) {
+            t.hr = r.HeartRate;
+            t.hr_time = r.Timestamp;
+            t.valid |= TF_HR;
+        }
+    }
+
+    if (m_Bike && m_Bike->get()) {
+        auto r = ((FitnessEquipmentControl *)m_Bike->get())->LatestReadings();
+        if (IsFresh(r.PowerTimestamp, now, BIKE::STALE_TIMEOUT)) {
+            t.pwr = r.Power;
+            t.pwr_time = r.PowerTimestamp;
+            t.valid |= TF_PWR;
+        }
+        if (IsFresh(r.SpeedTimestamp, now, BIKE::STALE_TIMEOUT)) {
+            t.spd = r.Speed;
+            t.spd_is_virtual = r.SpeedIsVirtual ? 1 : 0;
+            t.spd_time = r.SpeedTimestamp;
+            t.valid |= TF_SPD;
+        }
+        if (IsFresh(r.CadenceTimestamp, now, BIKE::STALE_TIMEOUT)) {
+            t.cad = r.Cadence;
+            t.cad_time = r.CadenceTimestamp;
+            t.valid |= TF_CAD;
+        }
+        if (IsFresh(r.StateTimestamp, now, BIKE::STALE_TIMEOUT)) {
+            t.trainer_state = static_cast<uint8_t>(r.State);
+            t.simulation_state = static_cast<uint8_t>(r.Simulation);
+            t.state_time = r.StateTimestamp;
+            t.valid |= TF_TRAINER_STATE | TF_SIMULATION_STATE;
+        }
+    }
+}
+
+/** The devices publish their statistics with each message, we only need to
+ * copy them while the channels can't go away.
+ */
+void TelemetryServer::CollectAggregates ()
+{
+    TelemetryAggregates a;
+    if (m_Hrm && m_Hrm->get()) {
+        a.hr = ((HeartRateMonitor *)m_Hrm->get())->HeartRateStats();
+    }
+    if (m_Bike && m_Bike->get()) {
+        auto bike = (FitnessEquipmentControl *)m_Bike->get();
+        a.pwr = bike->PowerStats();
+        a.spd = bike->SpeedStats();
+        a.cad = bike->CadenceStats();
+    }
+    m_Aggregates.Store(a);
 }
 
 Telemetry TelemetryServer::GetTelemetry()
 {
-    return m_current_telemetry;
+    return m_Published.Load();
+}
+
+Telemetry TelemetryServer::WaitForTelemetry(uint32_t &version, unsigned milliseconds)
+{
+    version = m_TelemetryChanged.Wait(version, milliseconds);
+    return m_Published.Load();
+}
+
+TelemetryAggregates TelemetryServer::GetAggregates()
+{
+    return m_Aggregates.Load();
 }
@@ -18,28 +18,89 @@
 #pragma once
 #include <iostream>
 #include <mutex>
+#include <utility>
+#include <vector>
 #include "structures.h"
 #include "FitnessEquipmentControl.h"
 #include "HeartRateMonitor.h"
+#include "AntStickPool.h"
+#include "SeqLock.h"
+#include "SessionRecording.h"
+#include "TelemetrySink.h"
+#include "UpdateSignal.h"
 
 std::ostream& operator<<(std::ostream &out, const Telemetry &t);
 
+/** Combine the readings of a heart rate monitor and an FE-C trainer into one
+ * Telemetry record.  The devices are slots of a SearchService, which can
+ * replace the channel in them at any time, `guard' protects them.
+ */
 class TelemetryServer {
 public:
-    TelemetryServer (AntStick * stick, std::unique_ptr<AntChannel> * device, std::mutex & guard);
+    TelemetryServer (AntStickPool * sticks, std::unique_ptr<AntChannel> * device, std::mutex & guard);
     ~TelemetryServer();
 
+    /** Also report the readings of `device', a heart rate monitor or FE-C
+     * trainer slot.  Other device types are ignored. */
+    void AddDevice(std::unique_ptr<AntChannel> * device);
+
+    /** Tick() waits at most this many milliseconds for new readings, so
+     * stale readings are still noticed when a sensor goes quiet. */
+    enum { MAX_TICK_WAIT = 1000 };
+
+    /** Wait until a channel of the pool has new readings, then update the
+     * telemetry.  Consumers are only woken up if the telemetry has
+     * changed. */
     void Tick();
+
+    /** Make a Tick() waiting on another thread return early. */
+    void Wake();
+
+    /** Return the latest telemetry.  This never blocks, it can be called
+     * from any thread, as often as needed. */
     Telemetry GetTelemetry();
+
+    /** Wait at most `milliseconds' for the telemetry to change, then return
+     * the latest one.  `version' is the version seen last by the caller
+     * (start with 0) and is updated to the version returned. */
+    Telemetry WaitForTelemetry(uint32_t &version, unsigned milliseconds);
+
+    /** Return the rolling statistics of the metrics, as of the last
+     * Tick().  Like GetTelemetry(), this never blocks. */
+    TelemetryAggregates GetAggregates();
+
+    /** Tick() flushes the recorder at most this often, in milliseconds,
+     * so a recording is complete up to then if the program dies. */
+    enum { RECORDER_FLUSH_INTERVAL = 1000 };
+
+    /** Record each new telemetry to `recorder', which must outlive the
+     * server.  Set it before calling Tick(). */
+    void SetRecorder(SessionRecorder *recorder);
+
+    /** Also publish each new telemetry to `sink', which must outlive the
+     * server.  Add sinks before calling Tick(). */
+    void AddSink(TelemetrySink *sink);
     
 private:
 
     void CheckSensorHealth();
     void CollectTelemetry ();
+    void CollectAggregates ();
 
-    AntStick *m_AntStick;
+    AntStickPool *m_AntSticks;
     std::unique_ptr<AntChannel> *m_Hrm;
+    std::unique_ptr<AntChannel> *m_Bike;
     Telemetry m_current_telemetry;
+    SeqLock<Telemetry> m_Published;
+    SeqLock<TelemetryAggregates> m_Aggregates;
+    UpdateSignal m_TelemetryChanged;
+    uint32_t m_SeenUpdates;
+
+    SessionRecorder *m_Recorder;
+    uint16_t m_RecorderSource;
+    uint32_t m_LastFlush;
+
+    std::vector<std::pair<TelemetrySink*, uint16_t>> m_Sinks;
 
     std::mutex & m_guard;
 };
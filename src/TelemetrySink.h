@@ -0,0 +1,43 @@
+/**
+ *  TelemetrySink -- receiver of the telemetry of TelemetryServer instances
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "structures.h"
+
+/** Receives the telemetry of one or more servers, see
+ * TelemetryServer::AddSink().
+ */
+class TelemetrySink {
+public:
+    virtual ~TelemetrySink() {}
+
+    /** Return a new source number, to tell apart the telemetry of different
+     * servers. */
+    virtual uint16_t NewSource() = 0;
+
+    /** Called on the thread running TelemetryServer::Tick() with each new
+     * telemetry of `source'.  Must not block. */
+    virtual void Publish(uint16_t source, const Telemetry &t) = 0;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
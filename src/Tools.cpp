@@ -23,6 +23,7 @@
 #include <libusb/libusb.h>
 #pragma warning (pop)
 
+#include <chrono>
 #include <iostream>
 #include <iomanip>
 #include <locale>
@@ -183,6 +184,12 @@ uint32_t CurrentMilliseconds()
     return timeGetTime();
 }
 
+uint64_t CurrentNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 #if 0
 void PutTimestamp(std::ostream &o)
 {
@@ -87,11 +87,11 @@ void DumpData (const unsigned char *data, int size, std::ostream &o);
 /**Print debug message
 */
 #if defined(DEBUG)
-#define LOG_MSG(msg) printf(msg)
+#define LOG_MSG(...) printf(__VA_ARGS__)
 #define LOG_D(val) printf("%d\n", val)
 #define LOG_F(val) printf("%f\n", val)
 #else
-#define LOG_MSG(msg)
+#define LOG_MSG(...)
 #define LOG_D(val)
 #define LOG_F(val)
 #endif
@@ -105,6 +105,13 @@ void DumpData (const unsigned char *data, int size, std::ostream &o);
  */
 uint32_t CurrentMilliseconds();
 
+/** Return a monotonic timestamp in nanoseconds from an unspecified epoch
+ * (std::chrono::steady_clock), with sub-microsecond resolution on the
+ * platforms we run on.  Use it to time when data arrives, and to compare
+ * arrival times across sticks; it is not related to CurrentMilliseconds().
+ */
+uint64_t CurrentNanoseconds();
+
 #if 0
 /** Put the current time on the output stream o. */
 void PutTimestamp(std::ostream &o);
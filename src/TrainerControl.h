@@ -28,9 +28,17 @@
 #endif
 
 extern "C" TRAINERCONTROLDLL_API int InitAntService(void ** ant_instanance, int & max_channels);
+#if !defined(_WIN32)
+/*use a framed ANT byte stream (pty, pipe or file) instead of an USB stick*/
+extern "C" TRAINERCONTROLDLL_API int InitAntServiceOnStream(void ** ant_instanance, int & max_channels, const char * path);
+#endif
+/*use an emulated stick with num_hrm heart rate monitors and num_bikes FE-C trainers in range*/
+extern "C" TRAINERCONTROLDLL_API int InitAntServiceEmulated(void ** ant_instanance, int & max_channels, int num_hrm, int num_bikes);
 extern "C" TRAINERCONTROLDLL_API int CloseAntService();
 extern "C" TRAINERCONTROLDLL_API int RunSearch(void * ant_instanance, void ** pp_search_service, std::thread & thread, std::mutex & guard);
 extern "C" TRAINERCONTROLDLL_API int AddDeviceForSearch(void * p_search_service, AntDeviceType type);
+/*upper limits of the heart rate (BPM) or power (watts) zones in increasing order, at most AGGREGATE_ZONES - 1, for the devices found from now on*/
+extern "C" TRAINERCONTROLDLL_API int SetDeviceZones(void * p_search_service, AntDeviceType type, const double * limits, int num_limits);
 extern "C" TRAINERCONTROLDLL_API int StopSearch(void ** pp_search_service, std::thread & thread);
 extern "C" TRAINERCONTROLDLL_API AntSession InitSession(void * ant_instanance, AntDevice ** devices, int num_devices, std::mutex & guard);
 extern "C" TRAINERCONTROLDLL_API int GetDeviceList(void * p_search_service, AntDevice ** devices, unsigned int & num_devices, unsigned int & num_active_devices);
@@ -38,4 +46,8 @@ extern "C" TRAINERCONTROLDLL_API int CloseSession(AntSession & session);
 /*create separate thread assign with session*/
 extern "C" TRAINERCONTROLDLL_API int Run(AntSession & session, std::thread & thread);
 extern "C" TRAINERCONTROLDLL_API int Stop(AntSession & session, std::thread & thread);
-extern "C" TRAINERCONTROLDLL_API Telemetry GetTelemetry(AntSession & session);
\ No newline at end of file
+extern "C" TRAINERCONTROLDLL_API Telemetry GetTelemetry(AntSession & session);
+/*block until the telemetry of the session changes or timeout_ms have passed, version is the one seen last (start with 0)*/
+extern "C" TRAINERCONTROLDLL_API Telemetry WaitForTelemetry(AntSession & session, unsigned int & version, unsigned int timeout_ms);
+/*rolling means, maxima, time in zone and normalized power of the session metrics, as of the last telemetry update*/
+extern "C" TRAINERCONTROLDLL_API TelemetryAggregates GetTelemetryAggregates(AntSession & session);
\ No newline at end of file
@@ -64,6 +64,60 @@ int run_unit_tests()
         printf("test_session_init FAILED\n");
         res = -1;
     }
+    MessageRingFraming test_message_ring;
+    if (false == test_message_ring.run_case())
+    {
+        printf("test_message_ring FAILED\n");
+        res = -1;
+    }
+    StickCommands test_stick_commands;
+    if (false == test_stick_commands.run_case())
+    {
+        printf("test_stick_commands FAILED\n");
+        res = -1;
+    }
+    SeqLockValues test_seqlock;
+    if (false == test_seqlock.run_case())
+    {
+        printf("test_seqlock FAILED\n");
+        res = -1;
+    }
+    HrvWindowStats test_hrv_window;
+    if (false == test_hrv_window.run_case())
+    {
+        printf("test_hrv_window FAILED\n");
+        res = -1;
+    }
+    AccumulatedPowerRollover test_power_rollover;
+    if (false == test_power_rollover.run_case())
+    {
+        printf("test_power_rollover FAILED\n");
+        res = -1;
+    }
+    RollingAggregates test_rolling_aggregates;
+    if (false == test_rolling_aggregates.run_case())
+    {
+        printf("test_rolling_aggregates FAILED\n");
+        res = -1;
+    }
+    SessionReplay test_session_replay;
+    if (false == test_session_replay.run_case())
+    {
+        printf("test_session_replay FAILED\n");
+        res = -1;
+    }
+    TelemetryCodec test_telemetry_codec;
+    if (false == test_telemetry_codec.run_case())
+    {
+        printf("test_telemetry_codec FAILED\n");
+        res = -1;
+    }
+    SharedTelemetryRing test_shared_telemetry;
+    if (false == test_shared_telemetry.run_case())
+    {
+        printf("test_shared_telemetry FAILED\n");
+        res = -1;
+    }
     /*SessionClose test_session_close;
     if (false == test_session_close.run_case())
     {
@@ -0,0 +1,74 @@
+/**
+ *  UpdateSignal -- wake up threads waiting for new data
+ *  Copyright (C) 2019 Alexey Kokoshnikov (alexeikokoshnikov@gmail.com)
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/** Count updates and let other threads wait for the next one.  A waiter
+ * passes the count it has seen last, so an update which happens between two
+ * waits is not missed.  Used together with SeqLock: the writer stores the
+ * new value, then calls Notify(), waiters Load() the value once woken up.
+ */
+class UpdateSignal
+{
+public:
+    UpdateSignal() : m_Count(0) {}
+
+    UpdateSignal(const UpdateSignal&) = delete;
+    UpdateSignal& operator=(const UpdateSignal&) = delete;
+
+    void Notify()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_Lock);
+            m_Count++;
+        }
+        m_Changed.notify_all();
+    }
+
+    uint32_t Count() const
+    {
+        std::lock_guard<std::mutex> guard(m_Lock);
+        return m_Count;
+    }
+
+    /** Wait until there was an update after `seen', or until `milliseconds'
+     * have passed.  Return the current count, which is `seen' if we timed
+     * out. */
+    uint32_t Wait(uint32_t seen, unsigned milliseconds)
+    {
+        std::unique_lock<std::mutex> guard(m_Lock);
+        m_Changed.wait_for(guard, std::chrono::milliseconds(milliseconds),
+                           [this, seen]() { return m_Count != seen; });
+        return m_Count;
+    }
+
+private:
+    mutable std::mutex m_Lock;
+    std::condition_variable m_Changed;
+    uint32_t m_Count;
+};
+
+/*
+    Local Variables:
+    mode: c++
+    End:
+*/
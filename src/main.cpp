@@ -16,69 +16,259 @@
  * with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "stdafx.h"
-#include "AntStick.h"
+#include "AntStickPool.h"
 #include "NetTools.h"
+#include "SearchService.h"
+#include "SessionRecording.h"
+#include "SharedTelemetry.h"
+#include "TelemetryBroadcaster.h"
+#include "TelemetryMulticaster.h"
 #include "TelemetryServer.h"
 #include "Tools.h"
 #include <algorithm>
+#include <atomic>
+#include <csignal>
 #include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
 
-void ProcessChannels(AntStick &s)
+/** Set by SIGINT and SIGTERM, the sticks are processed until then, so the
+ * recording is flushed and closed on the way out. */
+volatile std::sig_atomic_t g_StopRequested = 0;
+
+void RequestStop(int)
 {
-    try {
-        TelemetryServer server (&s);
-        while (true) {
-            server.Tick();
-        }
-    }
-    catch (std::exception &e) {
-        LOG_MSG(e.what());
-    }
+    g_StopRequested = 1;
 }
 
-void ProcessAntSticks()
+/** Search for a heart rate monitor and a trainer on `sticks' and publish
+ * their telemetry to `sinks', and to `recorder' unless it is nullptr.  The
+ * search service takes ownership of `sticks'.
+ */
+void ProcessChannels(AntStickPool *sticks, SessionRecorder *recorder,
+                     const std::vector<TelemetrySink*> &sinks)
 {
-    while (true) {
+    std::mutex guard;
+    SearchService search (sticks, guard);
+    search.AddDeviceForSearch(HRM_Type);
+    search.AddDeviceForSearch(BIKE_Type);
+
+    TelemetryServer server (sticks, nullptr, guard);
+    server.SetRecorder(recorder);
+    for (auto sink : sinks)
+        server.AddSink(sink);
+    std::atomic<bool> done(false);
+    std::thread telemetry([&server, &done]() {
+        while (! done)
+            server.Tick();
+    });
+
+    // The slots keep their device type, the server only needs to know
+    // about each one once.
+    std::vector<bool> added(search.GetDevices().size(), false);
+    while (! g_StopRequested) {
+        // Sticks attached and removed are picked up by the pool, as long as
+        // hotplug is available, a failed stick only affects its channels.
         try {
-            AntStick a;
-            auto t = std::time(nullptr);
-            auto tm = *std::localtime(&t);
-            LOG_MSG(" USB Stick: Serial#: "); LOG_D(a.GetSerialNumber());
-            LOG_MSG(", version "); LOG_MSG(a.GetVersion().c_str());
-            LOG_MSG(", max "); LOG_D(a.GetMaxNetworks()); 
-            LOG_MSG(" networks, max "); LOG_D(a.GetMaxChannels());
-            LOG_MSG(" channels\n");
-            a.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
-            ProcessChannels(a);
-        }
-        catch (const AntStickNotFound &e) {
-            auto t = std::time(nullptr);
-            auto tm = *std::localtime(&t);
-            LOG_MSG(e.what());
-            return;
+            search.Tick();
         }
         catch (std::exception &e) {
-            auto t = std::time(nullptr);
-            auto tm = *std::localtime(&t);
-            LOG_MSG(e.what());
+            LOG_MSG("%s", e.what()); LOG_MSG("\n");
+        }
+        auto &devices = search.GetDevices();
+        for (size_t i = 0; i < devices.size(); i++) {
+            if (! added[i] && devices[i].get()) {
+                server.AddDevice(const_cast<std::unique_ptr<AntChannel>*>(&devices[i]));
+                added[i] = true;
+            }
         }
     }
+
+    done = true;
+    server.Wake();
+    telemetry.join();
 }
 
-int main()
+void ProcessAntSticks(SessionRecorder *recorder, const std::vector<TelemetrySink*> &sinks)
 {
+    std::unique_ptr<AntStickPool> sticks(new AntStickPool());
+    sticks->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    sticks->SetRecorder(recorder);
+    bool hotplug = sticks->EnableHotplug();
+
     try {
+        sticks->AddUsbSticks();
+    }
+    catch (const AntStickNotFound &e) {
+        LOG_MSG("%s", e.what());
+        if (! hotplug)
+            return;
+        // Wait for the first stick to be plugged in.
+        while (sticks->GetStickCount() == 0 && ! g_StopRequested)
+            sticks->Tick();
+    }
+
+    for (int i = 0; i < sticks->GetStickCount(); i++) {
+        AntStick *a = sticks->GetStick(i);
+        (void)a;                        // LOG_MSG() expands to nothing without DEBUG
+        LOG_MSG(" USB Stick: Serial#: "); LOG_D(a->GetSerialNumber());
+        LOG_MSG(", version "); LOG_MSG("%s", a->GetVersion().c_str());
+        LOG_MSG(", max "); LOG_D(a->GetMaxNetworks());
+        LOG_MSG(" networks, max "); LOG_D(a->GetMaxChannels());
+        LOG_MSG(" channels\n");
+    }
+
+    ProcessChannels(sticks.release(), recorder, sinks);
+}
+
+/** Play back the sticks of the recording `path', `speed' times as fast as
+ * they were recorded, or as fast as possible with a speed of 0.
+ */
+void ReplaySession(const char *path, double speed, const std::vector<TelemetrySink*> &sinks)
+{
+    auto reader = std::make_shared<SessionReader>(path);
+    std::unique_ptr<AntStickPool> sticks(new AntStickPool());
+    sticks->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+    for (auto source : reader->FrameSources()) {
+        sticks->AddStick(std::unique_ptr<AntTransport>(
+            new ReplayTransport(reader, source, speed)));
+    }
+    ProcessChannels(sticks.release(), nullptr, sinks);
+}
+
+int RunCommand(int argc, char **argv, const std::vector<TelemetrySink*> &sinks)
+{
+    std::signal(SIGINT, RequestStop);
+    std::signal(SIGTERM, RequestStop);
+    try {
+        std::string command = argc > 2 ? argv[1] : "";
+        if (command == "replay") {
+            ReplaySession(argv[2], argc > 3 ? atof(argv[3]) : 1.0, sinks);
+            return 0;
+        }
+
         int r = libusb_init(NULL);
         if (r < 0)
             throw LibusbError("libusb_init", r);
-        ProcessAntSticks();
+        std::unique_ptr<SessionRecorder> recorder;
+        if (command == "record")
+            recorder.reset(new SessionRecorder(argv[2]));
+        ProcessAntSticks(recorder.get(), sinks);
     }
     catch (const std::exception &e) {
-        LOG_MSG(e.what()); LOG_MSG("\n");
+        LOG_MSG("%s", e.what()); LOG_MSG("\n");
         return 1;
     }
     return 0;
 }
 
+// usage: main [-m GROUP[@INTERFACE]] [-q oldest|latest|disconnect]
+//             [record FILE | replay FILE [SPEED]]
+//
+// -m sends the telemetry to the UDP multicast GROUP as well, from the
+// interface with the INTERFACE address, e.g. 239.255.75.0@127.0.0.1 to
+// reach this host only.
+//
+// -q selects what happens to TCP clients which don't keep up, see
+// TelemetryBroadcaster::QueuePolicy, the default is "latest".
+int main(int argc, char **argv)
+{
+    std::vector<TelemetrySink*> sinks;
+
+#if defined(__linux__)
+    std::unique_ptr<TelemetryMulticaster> multicaster;
+    TelemetryBroadcaster::QueuePolicy policy = TelemetryBroadcaster::QP_KEEP_LATEST;
+#endif
+    while (argc > 2 && argv[1][0] == '-') {
+        std::string option = argv[1];
+        std::string value = argv[2];
+#if defined(__linux__)
+        if (option == "-m") {
+            try {
+                std::string interface;
+                auto at = value.find('@');
+                if (at != std::string::npos) {
+                    interface = value.substr(at + 1);
+                    value.erase(at);
+                }
+                multicaster.reset(new TelemetryMulticaster(
+                    value, TelemetryMulticaster::DEFAULT_PORT, 1, interface));
+                sinks.push_back(multicaster.get());
+            }
+            catch (const std::exception &e) {
+                LOG_MSG("%s", e.what()); LOG_MSG("\n");
+                return 1;
+            }
+        }
+        else if (option == "-q") {
+            if (value == "oldest")
+                policy = TelemetryBroadcaster::QP_DROP_OLDEST;
+            else if (value == "latest")
+                policy = TelemetryBroadcaster::QP_KEEP_LATEST;
+            else if (value == "disconnect")
+                policy = TelemetryBroadcaster::QP_DISCONNECT;
+            else {
+                LOG_MSG("Unknown queue policy: "); LOG_MSG("%s", argv[2]); LOG_MSG("\n");
+                return 1;
+            }
+        }
+        else
+#endif
+        {
+            LOG_MSG("Unknown option: "); LOG_MSG("%s", argv[1]); LOG_MSG("\n");
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    // Publish the telemetry to other processes on this host
+    std::unique_ptr<SharedTelemetryWriter> shared;
+    try {
+        shared.reset(new SharedTelemetryWriter());
+        sinks.push_back(shared.get());
+    }
+    catch (const std::exception &e) {
+        LOG_MSG("%s", e.what()); LOG_MSG(", not publishing to shared memory\n");
+    }
+
+#if defined(__linux__)
+    // Serve the telemetry to TCP clients, see README.md
+    std::unique_ptr<TelemetryBroadcaster> broadcaster;
+    try {
+        broadcaster.reset(new TelemetryBroadcaster(
+            TelemetryBroadcaster::DEFAULT_PORT, policy));
+        sinks.push_back(broadcaster.get());
+    }
+    catch (const std::exception &e) {
+        LOG_MSG("%s", e.what()); LOG_MSG(", not accepting TCP clients\n");
+    }
+    std::thread network;
+    if (broadcaster) {
+        network = std::thread([&broadcaster]() {
+            try {
+                broadcaster->Run();
+            }
+            catch (const std::exception &e) {
+                LOG_MSG("%s", e.what()); LOG_MSG("\n");
+            }
+        });
+    }
+
+    int result = RunCommand(argc, argv, sinks);
+
+    if (broadcaster) {
+        broadcaster->Stop();
+        network.join();
+    }
+    return result;
+#else
+    return RunCommand(argc, argv, sinks);
+#endif
+}
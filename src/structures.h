@@ -17,6 +17,8 @@
  */
 #pragma once
 
+#include <stdint.h>
+
 struct AntSession
 {
     void * m_AntStick;
@@ -24,14 +26,86 @@ struct AntSession
     bool m_bIsRun;
 };
 
+// Bits of Telemetry::valid, set for the fields which hold a sample that is
+// not stale.
+enum TelemetryFields
+{
+    TF_HR = 0x01,
+    TF_PWR = 0x02,
+    TF_SPD = 0x04,
+    TF_CAD = 0x08,
+    TF_TRAINER_STATE = 0x10,
+    TF_SIMULATION_STATE = 0x20
+};
+
 // Hold information about a "current" reading from the trainer.  We quote
 // "current" because data comes from different sources and might not be
-// completely in sync.
+// completely in sync: each field has the time of its own sample, and `valid'
+// tells which of them are current.  A field which is not valid holds its
+// last sample, or -1 if none was received.
+//
+// The layout is fixed (64 bytes, no implicit padding), the record can be
+// copied as is across the DLL boundary, to shared memory or to the network.
 struct Telemetry
 {
     Telemetry()
-        : hr(-1) {}
-    double hr;
+        : hr(-1), pwr(-1), spd(-1), cad(-1),
+          hr_time(0), pwr_time(0), spd_time(0), cad_time(0), state_time(0),
+          sequence(0), valid(0),
+          trainer_state(0), simulation_state(0), spd_is_virtual(0), reserved(0) {}
+    double hr;                  // heart rate, beats per minute
+    double pwr;                 // power, watts
+    double spd;                 // speed, meters per second
+    double cad;                 // cadence, revolutions per minute
+    // CurrentMilliseconds() when each field was sampled, 0 if never
+    uint32_t hr_time;
+    uint32_t pwr_time;
+    uint32_t spd_time;
+    uint32_t cad_time;
+    uint32_t state_time;        // trainer_state and simulation_state
+    // Incremented each time a new sample arrives for any field, consumers
+    // compare it to the one seen last to find out if there is anything new.
+    uint32_t sequence;
+    uint32_t valid;             // TelemetryFields
+    uint8_t trainer_state;      // FitnessEquipmentControl::TrainerState
+    uint8_t simulation_state;   // FitnessEquipmentControl::SimulationState
+    uint8_t spd_is_virtual;     // speed is calculated, not measured
+    uint8_t reserved;
+};
+
+static_assert(sizeof(Telemetry) == 64, "Telemetry layout is fixed");
+
+enum
+{
+    AGGREGATE_WINDOWS = 4,
+    AGGREGATE_ZONES = 8
+};
+
+// Rolling statistics of one metric, see RollingAggregator.  Fixed layout
+// (128 bytes), like Telemetry.
+struct MetricAggregates
+{
+    MetricAggregates()
+        : window(), mean(), peak(), zone_time(),
+          normalized(0), samples(0), last_time(0) {}
+    uint32_t window[AGGREGATE_WINDOWS]; // window lengths in milliseconds, 0 if unused
+    double mean[AGGREGATE_WINDOWS];     // mean of the samples in each window
+    double peak[AGGREGATE_WINDOWS];     // maximum of the samples in each window
+    uint32_t zone_time[AGGREGATE_ZONES]; // milliseconds spent in each zone
+    double normalized;                  // normalized power, 0 for other metrics
+    uint32_t samples;                   // samples since the channel opened
+    uint32_t last_time;                 // CurrentMilliseconds() of the last sample
+};
+
+static_assert(sizeof(MetricAggregates) == 128, "MetricAggregates layout is fixed");
+
+// Rolling statistics of all metrics of a session
+struct TelemetryAggregates
+{
+    MetricAggregates hr;
+    MetricAggregates pwr;
+    MetricAggregates spd;
+    MetricAggregates cad;
 };
 
 enum AntDeviceType
@@ -17,9 +17,26 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
 #include <vector>
 #include "Mock.h"
 #include "TrainerControl.h"
+#include "AntStick.h"
+#include "AntStickEmulator.h"
+#include "FitnessEquipmentControl.h"
+#include "HeartRateMonitor.h"
+#include "HeartRateVariability.h"
+#include "RollingAggregator.h"
+#include "SeqLock.h"
+#include "SessionRecording.h"
+#include "SharedTelemetry.h"
+#include "TelemetryProtocol.h"
 
 #if defined(ENABLE_UNIT_TESTS)
 
@@ -29,6 +46,7 @@
 #define CHECK_NOT_EQ(val1, val2) if (val1 == val2) { printf("EQUAL\n"); return -1;}
 template <typename T>
 inline bool IS_EQ(T val1, T val2) { return (val1 == val2) ? true : false; }
+inline bool IS_NEAR(double val1, double val2, double tolerance = 1e-6) { return std::fabs(val1 - val2) <= tolerance; }
 
 enum test_case_type
 {
@@ -90,6 +108,90 @@ protected:
     std::vector<test_case> test_cases;
 };
 
+
+/** A test suite whose cases each have a method of their own, rather than
+ * execute() telling them apart by their description.
+ */
+class case_method_suite : public test_suite
+{
+protected:
+    typedef std::function<int(const test_case &)> case_method;
+
+    template <typename Suite>
+    void add_case(test_case_type type, const char *description, int expected,
+                  int (Suite::*method)(const test_case &))
+    {
+        test_case _case = { type, "", expected };
+        snprintf(_case.description, sizeof(_case.description), "%s", description);
+        test_cases.push_back(_case);
+        case_methods.push_back(std::bind(method, static_cast<Suite*>(this), std::placeholders::_1));
+    }
+    virtual int execute(const test_case _case)
+    {
+        for (size_t i = 0; i < test_cases.size(); i++)
+        {
+            if (0 == strcmp(test_cases[i].description, _case.description))
+                return case_methods[i](_case);
+        }
+        return -1;
+    }
+
+    std::vector<case_method> case_methods;
+};
+
+/** Tick `stick' until `done' returns true, for at most `timeout'
+ * milliseconds.  Returns false if it timed out.
+ */
+inline bool TickUntil(AntStick *stick, std::function<bool()> done, unsigned timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (!done())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        stick->Tick();
+    }
+    return true;
+}
+
+/** A suite whose cases each run against a new AntStick on an
+ * AntStickEmulator, with the masters listed in `masters'.
+ */
+class emulated_stick_suite : public case_method_suite
+{
+public:
+    emulated_stick_suite():
+        stick(nullptr)
+    {
+    }
+protected:
+    virtual int prepare(const test_case)
+    {
+        AntStickEmulator *emulator = new AntStickEmulator();
+        emulator->SetSeed(1);
+        for (auto &master : masters)
+            emulator->AddMaster(master.first, master.second);
+        stick = new AntStick(std::unique_ptr<AntTransport>(make_transport(emulator)));
+        stick->SetReadTimeout(5);
+        stick->SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+        return 0;
+    }
+    virtual int complete(const test_case)
+    {
+        delete stick;
+        stick = nullptr;
+        return 0;
+    }
+
+    /** The transport of the stick, which takes ownership of `emulator' */
+    virtual AntTransport* make_transport(AntStickEmulator *emulator) { return emulator; }
+
+    bool tick_until(std::function<bool()> done, unsigned timeout) { return TickUntil(stick, done, timeout); }
+
+    std::vector<std::pair<uint8_t, uint32_t>> masters;      // device type and number
+    AntStick *stick;
+};
+
 class ServiceInit : public test_suite
 {
 public:
@@ -655,4 +757,932 @@ protected:
     AntSession ant_session;
     std::thread server_thread;
 };*/
-#endif//ENABLE_UNIT_TESTS
\ No newline at end of file
+
+class MessageRingFraming : public case_method_suite
+{
+public:
+    MessageRingFraming():
+        message(CHANNEL_RESPONSE, 0, ASSIGN_CHANNEL, RESPONSE_NO_ERROR),
+        expected(message.begin(), message.end()),
+        arrival(0)
+    {
+        add_case(VALID, "whole messages", AntMessageRing::FRAME_OK, &MessageRingFraming::whole_messages);
+        add_case(VALID, "split message", AntMessageRing::FRAME_OK, &MessageRingFraming::split_message);
+        add_case(VALID, "garbage before sync", AntMessageRing::FRAME_OK, &MessageRingFraming::garbage_before_sync);
+#if !defined(FAKE_CALL)
+        add_case(BAD_PARAM, "bad checksum", AntMessageRing::FRAME_BAD_CHECKSUM, &MessageRingFraming::bad_checksum);
+#endif
+        add_case(VALID, "wrap around", AntMessageRing::FRAME_OK, &MessageRingFraming::wrap_around);
+        printf("test message ring framing [%d]\n", test_cases.size());
+    }
+protected:
+    virtual int prepare(const test_case)
+    {
+        ring.reset(new AntMessageRing());
+        received.clear();
+        arrival = 0;
+        return 0;
+    }
+    virtual int complete(const test_case)
+    {
+        ring.reset();
+        return 0;
+    }
+
+    int whole_messages(const test_case &_case)
+    {
+        uint8_t two[2 * AntMessage::MAX_SIZE];
+        std::copy(message.begin(), message.end(), two);
+        std::copy(message.begin(), message.end(), two + message.size());
+        ring->Append(two, 2 * message.size(), 100);
+        for (int i = 0; i < 2; i++)
+        {
+            CHECK_EQ(_case.expected, ring->ExtractMessage(received, arrival))
+            CHECK_EQ(true, IS_EQ(expected, received))
+            CHECK_EQ(100u, arrival)
+        }
+        CHECK_EQ(AntMessageRing::FRAME_INCOMPLETE, ring->ExtractMessage(received, arrival))
+        return 0;
+    }
+    int split_message(const test_case &_case)
+    {
+        ring->Append(message.data(), 3, 100);
+        CHECK_EQ(AntMessageRing::FRAME_INCOMPLETE, ring->ExtractMessage(received, arrival))
+        ring->Append(message.data() + 3, message.size() - 3, 200);
+        CHECK_EQ(_case.expected, ring->ExtractMessage(received, arrival))
+        CHECK_EQ(true, IS_EQ(expected, received))
+        // A message arrives with its last byte
+        CHECK_EQ(200u, arrival)
+        return 0;
+    }
+    int garbage_before_sync(const test_case &_case)
+    {
+        const uint8_t garbage[] = { 0x00, 0x55, 0xFF, 0x12, 0x03 };
+        ring->Append(garbage, sizeof(garbage), 100);
+        CHECK_EQ(AntMessageRing::FRAME_INCOMPLETE, ring->ExtractMessage(received, arrival))
+        CHECK_EQ(0u, ring->Size())
+        ring->Append(message.data(), message.size(), 200);
+        CHECK_EQ(_case.expected, ring->ExtractMessage(received, arrival))
+        CHECK_EQ(true, IS_EQ(expected, received))
+        return 0;
+    }
+    int bad_checksum(const test_case &_case)
+    {
+        // Only the sync byte of the corrupted message is dropped, the next
+        // call skips the rest of it and finds the good one.
+        AntMessage corrupted = message;
+        corrupted.data()[4] ^= 0x01;
+        ring->Append(corrupted.data(), corrupted.size(), 100);
+        ring->Append(message.data(), message.size(), 200);
+        CHECK_EQ(_case.expected, ring->ExtractMessage(received, arrival))
+        CHECK_EQ(AntMessageRing::FRAME_OK, ring->ExtractMessage(received, arrival))
+        CHECK_EQ(true, IS_EQ(expected, received))
+        CHECK_EQ(200u, arrival)
+        return 0;
+    }
+    int wrap_around(const test_case &_case)
+    {
+        // Messages straddle the end of the buffer and the free running
+        // cursors go around it several times.
+        for (unsigned i = 0; i < 3 * AntMessageRing::CAPACITY; i++)
+        {
+            ring->Append(message.data(), message.size(), i);
+            CHECK_EQ(_case.expected, ring->ExtractMessage(received, arrival))
+            CHECK_EQ(true, IS_EQ(expected, received))
+            CHECK_EQ(i, arrival)
+        }
+        CHECK_EQ(0u, ring->Size())
+        return 0;
+    }
+
+    const AntMessage message;
+    const Buffer expected;
+    std::unique_ptr<AntMessageRing> ring;
+    Buffer received;
+    uint64_t arrival;
+};
+
+class StickCommands : public emulated_stick_suite
+{
+public:
+    StickCommands()
+    {
+        masters = { { HRM::ANT_DEVICE_TYPE, 100 } };
+        add_case(VALID, "commands in flight", RESPONSE_NO_ERROR, &StickCommands::commands_in_flight);
+        add_case(BAD_STATE, "no response", RESPONSE_TIMEOUT, &StickCommands::no_response);
+        add_case(VALID, "unassign after close", 0, &StickCommands::unassign_after_close);
+        printf("test stick commands [%d]\n", test_cases.size());
+    }
+protected:
+    int commands_in_flight(const test_case &_case)
+    {
+        // All commands are sent before any response is read, each response
+        // must reach the callback of its own command.
+        std::vector<int> status(4, -1);
+        uint8_t network = static_cast<uint8_t>(stick->GetNetwork());
+        for (uint8_t channel = 0; channel < 3; channel++)
+        {
+            stick->SendCommand(AntMessage(ASSIGN_CHANNEL, channel, 0x00, network),
+                               [&status, channel](AntChannelEvent event) { status[channel] = event; });
+        }
+        // Channel 5 is not assigned
+        stick->SendCommand(AntMessage(UNASSIGN_CHANNEL, 5),
+                           [&status](AntChannelEvent event) { status[3] = event; });
+        bool answered = tick_until([&status]() {
+                return std::find(status.begin(), status.end(), -1) == status.end();
+            }, TIMEOUT);
+        CHECK_EQ(true, answered)
+        for (int i = 0; i < 3; i++)
+        {
+            CHECK_EQ(_case.expected, status[i])
+        }
+        CHECK_EQ(CHANNEL_IN_WRONG_STATE, status[3])
+        return 0;
+    }
+    int no_response(const test_case &_case)
+    {
+        // The stick does not answer broadcast data
+        int status = -1;
+        auto sent = std::chrono::steady_clock::now();
+        stick->SendCommand(AntMessage(BROADCAST_DATA, 0, 1, 2, 3, 4, 5, 6, 7, 8),
+                           [&status](AntChannelEvent event) { status = event; });
+        bool answered = tick_until([&status]() { return status != -1; }, 2 * TIMEOUT);
+        CHECK_EQ(true, answered)
+        CHECK_EQ(_case.expected, status)
+        auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - sent).count();
+        CHECK_EQ(true, (waited >= TIMEOUT / 2))
+        return 0;
+    }
+    int unassign_after_close(const test_case &)
+    {
+        int free_channels = stick->GetFreeChannels();
+        std::unique_ptr<HeartRateMonitor> hrm(new HeartRateMonitor(stick, 0));
+        bool opened = tick_until([&hrm]() { return hrm->ChannelState() == AntChannel::CH_OPEN; }, 5000);
+        CHECK_EQ(true, opened)
+        CHECK_EQ(free_channels - 1, stick->GetFreeChannels())
+
+        // The channel number is only given back once the stick confirmed the
+        // unassign, which has to wait for the channel to close.
+        hrm.reset();
+        CHECK_EQ(free_channels - 1, stick->GetFreeChannels())
+        bool released = tick_until([this, free_channels]() {
+                return stick->GetFreeChannels() == free_channels;
+            }, TIMEOUT);
+        CHECK_EQ(true, released)
+
+        // A new channel gets the same number and can be assigned
+        hrm.reset(new HeartRateMonitor(stick, 0));
+        opened = tick_until([&hrm]() { return hrm->ChannelState() == AntChannel::CH_OPEN; }, 5000);
+        CHECK_EQ(true, opened)
+        return 0;
+    }
+};
+
+class SeqLockValues : public case_method_suite
+{
+public:
+    SeqLockValues()
+    {
+        add_case(VALID, "versions", 0, &SeqLockValues::versions);
+        add_case(VALID, "concurrent writer", 0, &SeqLockValues::concurrent_writer);
+        printf("test seqlock values [%d]\n", test_cases.size());
+    }
+protected:
+    int versions(const test_case &)
+    {
+        SeqLock<Telemetry> value;
+        CHECK_EQ(1u, value.Version())
+        Telemetry t;
+        t.hr = 120;
+        t.pwr = 250.5;
+        t.sequence = 7;
+        value.Store(t);
+        CHECK_EQ(2u, value.Version())
+        Telemetry loaded = value.Load();
+        CHECK_EQ(t.hr, loaded.hr)
+        CHECK_EQ(t.pwr, loaded.pwr)
+        CHECK_EQ(t.spd, loaded.spd)
+        CHECK_EQ(t.sequence, loaded.sequence)
+        return 0;
+    }
+    int concurrent_writer(const test_case &)
+    {
+        // All words of a value are the same, a torn read would mix the words
+        // of two values.
+        struct Words
+        {
+            uint32_t word[15];
+        };
+        const uint32_t stores = 200000;
+        SeqLock<Words> value;
+        std::thread writer([&value, stores]() {
+            Words w;
+            for (uint32_t i = 1; i <= stores; i++)
+            {
+                std::fill(w.word, w.word + 15, i);
+                value.Store(w);
+            }
+        });
+        int torn = 0;
+        int backwards = 0;
+        uint32_t last = 0;
+        while (last < stores)
+        {
+            Words w = value.Load();
+            if (std::count(w.word, w.word + 15, w.word[0]) != 15)
+                torn++;
+            if (w.word[0] < last)
+                backwards++;
+            last = w.word[0];
+        }
+        writer.join();
+        CHECK_EQ(0, torn)
+        CHECK_EQ(0, backwards)
+        CHECK_EQ(stores + 1, value.Version())
+        return 0;
+    }
+};
+
+class HrvWindowStats : public case_method_suite
+{
+public:
+    HrvWindowStats()
+    {
+        add_case(VALID, "steady", 0, &HrvWindowStats::steady);
+        add_case(VALID, "missed beats", 0, &HrvWindowStats::missed_beats);
+        add_case(VALID, "interval longer than window", 0, &HrvWindowStats::long_interval);
+        add_case(VALID, "reset", 0, &HrvWindowStats::reset);
+        printf("test hrv window [%d]\n", test_cases.size());
+    }
+protected:
+    int steady(const test_case &) { return run_intervals(false, false, false); }
+    int missed_beats(const test_case &) { return run_intervals(true, false, false); }
+    int long_interval(const test_case &) { return run_intervals(false, true, false); }
+    int reset(const test_case &) { return run_intervals(false, false, true); }
+
+    /** Feed random intervals and compare the window with the reference
+     * after each one.  Every 7th beat can be missed, every 100th interval
+     * can be longer than the window, and the window can be reset halfway.
+     */
+    int run_intervals(bool missed_beats, bool long_interval, bool reset)
+    {
+        const uint32_t window_ms = 30000;
+        HrvWindow hrv(window_ms);
+        std::vector<uint16_t> rr;
+        std::vector<bool> follows;
+        std::mt19937 random(1);
+
+        for (int i = 0; i < 1000; i++)
+        {
+            // 600 to 1200 1/1024 s, 50 to 100 BPM
+            uint16_t interval = static_cast<uint16_t>(600 + random() % 600);
+            bool follows_previous = !(missed_beats && i % 7 == 0);
+            if (long_interval && i % 100 == 50)
+                interval = 40000;
+            if (reset && i == 500)
+            {
+                hrv.Reset();
+                rr.clear();
+                follows.clear();
+                CHECK_EQ(0, hrv.Count())
+                CHECK_EQ(0.0, hrv.Rmssd())
+                CHECK_EQ(0.0, hrv.Sdnn())
+            }
+
+            hrv.Add(interval, follows_previous);
+            rr.push_back(interval);
+            follows.push_back(follows_previous);
+            if (0 != check_reference(hrv, rr, follows, window_ms))
+            {
+                printf("after interval #%d\n", i);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /** Compare `hrv' with RMSSD and SDNN computed from scratch over the
+     * newest intervals of `rr' which fit in the window, at least one. */
+    int check_reference(const HrvWindow &hrv, const std::vector<uint16_t> &rr,
+                        const std::vector<bool> &follows, uint32_t window_ms)
+    {
+        const uint64_t window = uint64_t(window_ms) * 1024 / 1000;
+        size_t first = rr.size() - 1;
+        uint64_t duration = rr[first];
+        while (first > 0 && duration + rr[first - 1] <= window)
+            duration += rr[--first];
+        size_t count = rr.size() - first;
+
+        double mean = 0;
+        for (size_t i = first; i < rr.size(); i++)
+            mean += rr[i];
+        mean /= count;
+        double squares = 0;
+        for (size_t i = first; i < rr.size(); i++)
+            squares += (rr[i] - mean) * (rr[i] - mean);
+        double sdnn = count > 1 ? std::sqrt(squares / (count - 1)) * 1000.0 / 1024.0 : 0;
+
+        double diffs = 0;
+        int diff_count = 0;
+        for (size_t i = first + 1; i < rr.size(); i++)
+        {
+            if (follows[i])
+            {
+                double diff = double(rr[i]) - double(rr[i - 1]);
+                diffs += diff * diff;
+                diff_count++;
+            }
+        }
+        double rmssd = diff_count > 0 ? std::sqrt(diffs / diff_count) * 1000.0 / 1024.0 : 0;
+
+        CHECK_EQ(static_cast<int>(count), hrv.Count())
+        CHECK_EQ(true, IS_NEAR(rmssd, hrv.Rmssd()))
+        CHECK_EQ(true, IS_NEAR(sdnn, hrv.Sdnn()))
+        return 0;
+    }
+};
+
+/** Transport replacing the pages an emulated trainer broadcasts with
+ * trainer specific pages whose event count and accumulated power the test
+ * controls.  Until Start(), the pages report no new power events.
+ */
+class ScriptedTrainerTransport : public AntTransport
+{
+public:
+    ScriptedTrainerTransport(AntStickEmulator *emulator):
+        emulator(emulator),
+        started(false),
+        pages(0),
+        event_count(250),
+        accumulated_power(65000),
+        events(0),
+        power(0)
+    {
+    }
+
+    void Start() { started = true; }
+
+    /** Power events reported since Start() and the sum of their power */
+    uint32_t Events() const { return events; }
+    uint64_t Power() const { return power; }
+
+    virtual void WriteMessage(const AntMessage &message) override
+    {
+        emulator->WriteMessage(message);
+    }
+    virtual void MaybeGetNextMessage(Buffer &message) override
+    {
+        emulator->SetReadTimeout(GetReadTimeout());
+        emulator->MaybeGetNextMessage(message);
+        if (message.size() < 13 || message[2] != BROADCAST_DATA)
+            return;
+
+        uint16_t instant_power = 0;
+        if (started)
+        {
+            // Every fourth page also covers the events of two lost ones
+            int page_events = (pages % 4 == 3) ? 3 : 1;
+            instant_power = (pages % 2 == 0) ? 300 : 700;
+            event_count = static_cast<uint8_t>(event_count + page_events);
+            accumulated_power = static_cast<uint16_t>(accumulated_power + page_events * instant_power);
+            events += page_events;
+            power += page_events * instant_power;
+            pages++;
+        }
+
+        const uint8_t page[8] = {
+            0x19,                       // trainer specific data page
+            event_count,
+            90,                         // cadence
+            static_cast<uint8_t>(accumulated_power & 0xFF),
+            static_cast<uint8_t>(accumulated_power >> 8),
+            static_cast<uint8_t>(instant_power & 0xFF),
+            static_cast<uint8_t>((instant_power >> 8) & 0x0F),
+            0x30                        // in use, at target power
+        };
+        std::copy(page, page + 8, message.begin() + 4);
+        uint8_t checksum = 0;
+        for (size_t i = 0; i + 1 < message.size(); i++)
+            checksum ^= message[i];
+        message.back() = checksum;
+    }
+
+private:
+    std::unique_ptr<AntStickEmulator> emulator;
+    bool started;
+    uint32_t pages;
+    uint8_t event_count;
+    uint16_t accumulated_power;
+    uint32_t events;
+    uint64_t power;
+};
+
+class AccumulatedPowerRollover : public emulated_stick_suite
+{
+public:
+    AccumulatedPowerRollover():
+        transport(nullptr)
+    {
+        masters = { { BIKE::ANT_DEVICE_TYPE, 200 } };
+        add_case(VALID, "rollover", 0, &AccumulatedPowerRollover::rollover);
+        printf("test accumulated power rollover [%d]\n", test_cases.size());
+    }
+protected:
+    virtual AntTransport* make_transport(AntStickEmulator *emulator)
+    {
+        transport = new ScriptedTrainerTransport(emulator);
+        return transport;
+    }
+
+    int rollover(const test_case &)
+    {
+        std::vector<double> event_power;
+        std::unique_ptr<FitnessEquipmentControl> trainer(new FitnessEquipmentControl(stick, 0));
+        trainer->SetPowerListener([&event_power](double power, int) { event_power.push_back(power); });
+        bool receiving = tick_until([&trainer]() { return trainer->LatestReadings().PowerTimestamp != 0; }, 5000);
+        CHECK_EQ(true, receiving)
+
+        // The script starts at 250 events and 65000 W, so both the event
+        // count and the accumulated power roll over within a few pages.
+        FitnessEquipmentControl::Readings start = trainer->LatestReadings();
+        transport->Start();
+        bool done = tick_until([this]() { return transport->Events() >= 20; }, 10000);
+        CHECK_EQ(true, done)
+        FitnessEquipmentControl::Readings end = trainer->LatestReadings();
+
+        CHECK_EQ(transport->Events(), end.PowerEvents - start.PowerEvents)
+        CHECK_EQ(transport->Power(), end.AccumulatedPower - start.AccumulatedPower)
+        double average = double(transport->Power()) / transport->Events();
+        CHECK_EQ(true, IS_NEAR(average, FitnessEquipmentControl::AveragePower(start, end)))
+        // No spikes from the lost pages
+        for (double power : event_power)
+        {
+            CHECK_EQ(true, (power == 300 || power == 700))
+        }
+        return 0;
+    }
+
+    ScriptedTrainerTransport *transport;        // owned by the stick
+};
+
+class RollingAggregates : public case_method_suite
+{
+public:
+    RollingAggregates()
+    {
+        add_case(VALID, "means and maxima", 0, &RollingAggregates::means_and_maxima);
+        add_case(VALID, "normalized power", 0, &RollingAggregates::normalized_power);
+        add_case(VALID, "normalized power disabled", 0, &RollingAggregates::normalized_power_disabled);
+        add_case(VALID, "zones", 0, &RollingAggregates::zones);
+        printf("test rolling aggregates [%d]\n", test_cases.size());
+    }
+protected:
+    struct Sample
+    {
+        uint32_t timestamp;
+        double value;
+    };
+
+    virtual int prepare(const test_case)
+    {
+        // 4 Hz give or take, with a gap longer than the zone hold time
+        std::mt19937 random(1);
+        uint32_t timestamp = 1000000;
+        samples.clear();
+        for (int i = 0; i < 800; i++)
+        {
+            timestamp += (i == 400) ? 8000 : 200 + random() % 100;
+            samples.push_back({ timestamp, 100.0 + random() % 400 });
+        }
+        return 0;
+    }
+
+    int means_and_maxima(const test_case &)
+    {
+        const std::vector<uint32_t> windows = { 3000, 10000, 30000 };
+        RollingAggregator aggregator(windows);
+        for (size_t n = 0; n < samples.size(); n++)
+        {
+            aggregator.Add(samples[n].timestamp, samples[n].value);
+            MetricAggregates a = aggregator.Latest();
+            CHECK_EQ(n + 1, a.samples)
+            CHECK_EQ(samples[n].timestamp, a.last_time)
+            for (size_t w = 0; w < windows.size(); w++)
+            {
+                double mean, peak;
+                window_reference(n, windows[w], mean, peak);
+                CHECK_EQ(windows[w], a.window[w])
+                CHECK_EQ(true, IS_NEAR(mean, a.mean[w]))
+                CHECK_EQ(peak, a.peak[w])
+            }
+            CHECK_EQ(0u, a.window[windows.size()])
+        }
+        return 0;
+    }
+    int normalized_power(const test_case &)
+    {
+        RollingAggregator aggregator;
+        aggregator.EnableNormalizedPower();
+        double sum_fourth_powers = 0;
+        for (size_t n = 0; n < samples.size(); n++)
+        {
+            aggregator.Add(samples[n].timestamp, samples[n].value);
+            double average, peak;
+            window_reference(n, RollingAggregator::NORMALIZED_POWER_WINDOW, average, peak);
+            sum_fourth_powers += average * average * average * average;
+            double normalized = std::pow(sum_fourth_powers / (n + 1), 0.25);
+            CHECK_EQ(true, IS_NEAR(normalized, aggregator.Latest().normalized))
+        }
+        return 0;
+    }
+    int normalized_power_disabled(const test_case &)
+    {
+        RollingAggregator aggregator;
+        for (const Sample &s : samples)
+            aggregator.Add(s.timestamp, s.value);
+        CHECK_EQ(0.0, aggregator.Latest().normalized)
+        return 0;
+    }
+    int zones(const test_case &)
+    {
+        RollingAggregator aggregator;
+        aggregator.SetZones({ 200, 350 });
+        uint32_t zone_time[AGGREGATE_ZONES] = {};
+        for (size_t n = 0; n < samples.size(); n++)
+        {
+            aggregator.Add(samples[n].timestamp, samples[n].value);
+            if (n > 0)
+            {
+                // The previous sample counts until this one, at most
+                // MAX_ZONE_HOLD
+                double previous = samples[n - 1].value;
+                int zone = previous < 200 ? 0 : (previous < 350 ? 1 : 2);
+                zone_time[zone] += (std::min)(samples[n].timestamp - samples[n - 1].timestamp,
+                                              uint32_t(RollingAggregator::MAX_ZONE_HOLD));
+            }
+        }
+        MetricAggregates a = aggregator.Latest();
+        for (int zone = 0; zone < AGGREGATE_ZONES; zone++)
+        {
+            CHECK_EQ(zone_time[zone], a.zone_time[zone])
+        }
+        return 0;
+    }
+
+    /** Mean and maximum of the samples in the `length' milliseconds up to
+     * sample `last', which always counts. */
+    void window_reference(size_t last, uint32_t length, double &mean, double &peak)
+    {
+        size_t first = last;
+        while (first > 0 && samples[last].timestamp - samples[first - 1].timestamp < length)
+            first--;
+        mean = 0;
+        peak = 0;
+        for (size_t i = first; i <= last; i++)
+        {
+            mean += samples[i].value;
+            peak = (std::max)(peak, samples[i].value);
+        }
+        mean /= last - first + 1;
+    }
+
+    std::vector<Sample> samples;
+};
+
+#define TEST_RECORDING "test_session.rec"
+
+class SessionReplay : public case_method_suite
+{
+public:
+    SessionReplay()
+    {
+        add_case(VALID, "records", 0, &SessionReplay::records);
+        add_case(VALID, "replay", 0, &SessionReplay::replay);
+        printf("test session replay [%d]\n", test_cases.size());
+    }
+protected:
+    virtual int complete(const test_case)
+    {
+        remove(TEST_RECORDING);
+        return 0;
+    }
+
+    int records(const test_case &)
+    {
+        const AntMessage sent(ASSIGN_CHANNEL, 0, 0x00, 0);
+        const AntMessage received(CHANNEL_RESPONSE, 0, ASSIGN_CHANNEL, RESPONSE_NO_ERROR);
+        Telemetry t;
+        t.hr = 130;
+        t.pwr = 215.5;
+        t.sequence = 42;
+        uint16_t stick_source, server_source;
+        {
+            SessionRecorder recorder(TEST_RECORDING);
+            stick_source = recorder.NewSource();
+            server_source = recorder.NewSource();
+            recorder.RecordFrame(stick_source, RK_SENT_FRAME, sent.data(), sent.size());
+            recorder.RecordFrame(stick_source, RK_RECEIVED_FRAME, received.data(), received.size());
+            recorder.RecordTelemetry(server_source, t);
+            CHECK_EQ(3u, recorder.Count())
+        }
+
+        SessionReader reader(TEST_RECORDING);
+        CHECK_EQ(3u, reader.Count())
+        const AntMessage *frames[2] = { &sent, &received };
+        const RecordKind kinds[3] = { RK_SENT_FRAME, RK_RECEIVED_FRAME, RK_TELEMETRY };
+        for (uint32_t n = 0; n < 3; n++)
+        {
+            const SessionRecord &r = reader.At(n);
+            CHECK_EQ(n, r.sequence)
+            CHECK_EQ(kinds[n], r.kind)
+            if (n < 2)
+            {
+                CHECK_EQ(stick_source, r.source)
+                CHECK_EQ(frames[n]->size(), r.size)
+                CHECK_EQ(0, memcmp(frames[n]->data(), r.payload, r.size))
+            }
+        }
+        Telemetry replayed = reader.TelemetryAt(2);
+        CHECK_EQ(server_source, reader.At(2).source)
+        CHECK_EQ(t.hr, replayed.hr)
+        CHECK_EQ(t.pwr, replayed.pwr)
+        CHECK_EQ(t.sequence, replayed.sequence)
+        std::vector<uint16_t> sources = reader.FrameSources();
+        CHECK_EQ(1u, sources.size())
+        CHECK_EQ(stick_source, sources[0])
+        return 0;
+    }
+    int replay(const test_case &)
+    {
+        // Record an emulated HRM, then play the recording back to a new
+        // stick: the channel must see the same beats.
+        HeartRateMonitor::Readings recorded;
+        {
+            SessionRecorder recorder(TEST_RECORDING);
+            AntStickEmulator *emulator = new AntStickEmulator();
+            emulator->SetSeed(1);
+            emulator->AddMaster(HRM::ANT_DEVICE_TYPE, 100);
+            uint16_t source = recorder.NewSource();
+            AntStick stick(std::unique_ptr<AntTransport>(
+                               new RecordingTransport(std::unique_ptr<AntTransport>(emulator), &recorder, source)));
+            stick.SetReadTimeout(5);
+            stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+            std::unique_ptr<HeartRateMonitor> hrm(new HeartRateMonitor(&stick, 0));
+            bool beating = TickUntil(&stick, [&hrm]() { return hrm->LatestReadings().Beats >= 3; }, 10000);
+            CHECK_EQ(true, beating)
+            recorded = hrm->LatestReadings();
+        }
+
+        std::shared_ptr<SessionReader> reader = std::make_shared<SessionReader>(TEST_RECORDING);
+        std::vector<uint16_t> sources = reader->FrameSources();
+        CHECK_EQ(1u, sources.size())
+        AntStick stick(std::unique_ptr<AntTransport>(new ReplayTransport(reader, sources[0], 0)));
+        stick.SetReadTimeout(5);
+        stick.SetNetworkKey(AntStick::g_AntPlusNetworkKey);
+        std::unique_ptr<HeartRateMonitor> hrm(new HeartRateMonitor(&stick, 0));
+        bool replayed = TickUntil(&stick, [&hrm, &recorded]() {
+                return hrm->LatestReadings().Beats == recorded.Beats;
+            }, 5000);
+        CHECK_EQ(true, replayed)
+        HeartRateMonitor::Readings r = hrm->LatestReadings();
+        CHECK_EQ(recorded.LastRr, r.LastRr)
+        CHECK_EQ(recorded.MissedBeats, r.MissedBeats)
+        CHECK_EQ(100u, hrm->ChannelId().DeviceNumber)
+        return 0;
+    }
+};
+
+class TelemetryCodec : public case_method_suite
+{
+public:
+    TelemetryCodec():
+        encoder(3, 10)
+    {
+        add_case(VALID, "round trip", TelemetryDecoder::TDS_TELEMETRY, &TelemetryCodec::round_trip);
+        add_case(BAD_STATE, "lost frame", TelemetryDecoder::TDS_NEED_KEYFRAME, &TelemetryCodec::lost_frame);
+        add_case(VALID, "snapshot", TelemetryDecoder::TDS_TELEMETRY, &TelemetryCodec::snapshot);
+        add_case(BAD_PARAM, "malformed", TelemetryDecoder::TDS_MALFORMED, &TelemetryCodec::malformed);
+        printf("test telemetry codec [%d]\n", test_cases.size());
+    }
+protected:
+    virtual int prepare(const test_case)
+    {
+        encoder = TelemetryEncoder(3, 10);
+        decoder = TelemetryDecoder();
+
+        std::mt19937 random(1);
+        Telemetry t;
+        t.hr_time = 0xFFFFFF00u;        // wraps around
+        sent.clear();
+        for (int i = 0; i < 100; i++)
+        {
+            t.sequence++;
+            t.valid = TF_HR | TF_PWR | TF_SPD | TF_CAD;
+            t.hr = 120 + random() % 40;
+            t.pwr = 200 + (random() % 4000) / 100.0;
+            t.spd = 8 + (random() % 2000) / 1000.0;
+            // Mostly unchanged, as when it comes from a slower sensor
+            if (i % 3 == 0)
+                t.cad = 85 + random() % 10;
+            t.hr_time += 250;
+            t.pwr_time = t.hr_time + 3;
+            t.spd_time = t.pwr_time;
+            t.cad_time = t.pwr_time;
+            t.trainer_state = 3;
+            sent.push_back(t);
+        }
+        return 0;
+    }
+
+    int round_trip(const test_case &_case)
+    {
+        // Decode the whole stream fed a few bytes at a time
+        std::vector<uint8_t> stream;
+        for (const Telemetry &s : sent)
+        {
+            size_t size = encoder.Encode(s, frame);
+            stream.insert(stream.end(), frame, frame + size);
+        }
+        size_t received = 0, start = 0, decoded = 0;
+        while (decoded < sent.size())
+        {
+            CHECK_EQ(true, (received < stream.size()))
+            received = (std::min)(received + 7, stream.size());
+            TelemetryDecoder::DecodeStatus status;
+            while ((status = decoder.Decode(&stream[start], received - start, used, source, t))
+                   != TelemetryDecoder::TDS_INCOMPLETE)
+            {
+                CHECK_EQ(_case.expected, status)
+                CHECK_EQ(3, source)
+                CHECK_EQ(0, compare(sent[decoded], t))
+                start += used;
+                decoded++;
+            }
+        }
+        CHECK_EQ(0u, decoder.Gaps())
+        return 0;
+    }
+    int lost_frame(const test_case &_case)
+    {
+        // After a lost frame, the deltas are skipped until the next
+        // keyframe, frame 10.
+        for (size_t i = 0; i < 20; i++)
+        {
+            size_t size = encoder.Encode(sent[i], frame);
+            if (i == 5)
+                continue;
+            TelemetryDecoder::DecodeStatus status = decoder.Decode(frame, size, used, source, t);
+            CHECK_EQ(size, used)
+            if (i > 5 && i < 10)
+            {
+                CHECK_EQ(_case.expected, status)
+            }
+            else
+            {
+                CHECK_EQ(TelemetryDecoder::TDS_TELEMETRY, status)
+                CHECK_EQ(0, compare(sent[i], t))
+            }
+        }
+        CHECK_EQ(1u, decoder.Gaps())
+        return 0;
+    }
+    int snapshot(const test_case &_case)
+    {
+        // A receiver joining late starts with a snapshot and follows the
+        // deltas from there.
+        CHECK_EQ(0u, encoder.Snapshot(frame))
+        for (size_t i = 0; i < 5; i++)
+            encoder.Encode(sent[i], frame);
+        size_t size = encoder.Snapshot(frame);
+        CHECK_EQ(_case.expected, decoder.Decode(frame, size, used, source, t))
+        CHECK_EQ(0, compare(sent[4], t))
+        size = encoder.Encode(sent[5], frame);
+        CHECK_EQ(_case.expected, decoder.Decode(frame, size, used, source, t))
+        CHECK_EQ(0, compare(sent[5], t))
+        CHECK_EQ(0u, decoder.Gaps())
+        return 0;
+    }
+    int malformed(const test_case &_case)
+    {
+        // A frame of another protocol version
+        size_t size = encoder.Encode(sent[0], frame);
+        frame[1] = (TELEMETRY_PROTOCOL_VERSION + 1) << 4 | TFT_KEYFRAME;
+        CHECK_EQ(_case.expected, decoder.Decode(frame, size, used, source, t))
+        return 0;
+    }
+
+    /** The measurements are sent in fixed point, hundredths and mm/s */
+    int compare(const Telemetry &expected, const Telemetry &t)
+    {
+        CHECK_EQ(true, IS_NEAR(expected.hr, t.hr, 0.005))
+        CHECK_EQ(true, IS_NEAR(expected.pwr, t.pwr, 0.005))
+        CHECK_EQ(true, IS_NEAR(expected.spd, t.spd, 0.0005))
+        CHECK_EQ(true, IS_NEAR(expected.cad, t.cad, 0.005))
+        CHECK_EQ(expected.hr_time, t.hr_time)
+        CHECK_EQ(expected.pwr_time, t.pwr_time)
+        CHECK_EQ(expected.spd_time, t.spd_time)
+        CHECK_EQ(expected.cad_time, t.cad_time)
+        CHECK_EQ(expected.sequence, t.sequence)
+        CHECK_EQ(expected.valid, t.valid)
+        CHECK_EQ(expected.trainer_state, t.trainer_state)
+        return 0;
+    }
+
+    std::vector<Telemetry> sent;
+    TelemetryEncoder encoder;
+    TelemetryDecoder decoder;
+    uint8_t frame[MAX_TELEMETRY_FRAME];
+    size_t used;
+    uint16_t source;
+    Telemetry t;
+};
+
+#if defined(_WIN32)
+#define TEST_SHARED_TELEMETRY "Local\\trainer-telemetry-test"
+#else
+#define TEST_SHARED_TELEMETRY "/trainer-telemetry-test"
+#endif
+
+class SharedTelemetryRing : public case_method_suite
+{
+public:
+    SharedTelemetryRing():
+        source(0)
+    {
+        add_case(VALID, "late reader", 0, &SharedTelemetryRing::late_reader);
+        add_case(BAD_STATE, "lost records", SHARED_TELEMETRY_RING_SIZE * 2 + 10, &SharedTelemetryRing::lost_records);
+        add_case(VALID, "writer closed", 0, &SharedTelemetryRing::writer_closed);
+        printf("test shared telemetry ring [%d]\n", test_cases.size());
+    }
+protected:
+    virtual int prepare(const test_case)
+    {
+        writer.reset(new SharedTelemetryWriter(TEST_SHARED_TELEMETRY));
+        reader.reset(new SharedTelemetryReader(TEST_SHARED_TELEMETRY));
+        source = writer->NewSource();
+        CHECK_EQ(1, reader->Sources())
+        return 0;
+    }
+    virtual int complete(const test_case)
+    {
+        reader.reset();
+        writer.reset();
+        return 0;
+    }
+
+    int late_reader(const test_case &_case)
+    {
+        return read_ring(_case);
+    }
+    int lost_records(const test_case &_case)
+    {
+        // Start reading before anything is published, so the reader falls
+        // behind by more than the ring.
+        SharedTelemetryRecord record;
+        CHECK_EQ(false, reader->Next(record))
+        return read_ring(_case);
+    }
+
+    /** Publish three rings full and read them, `expected' is the number of
+     * records the reader must have lost. */
+    int read_ring(const test_case &_case)
+    {
+        SharedTelemetryRecord record;
+        const uint64_t published = SHARED_TELEMETRY_RING_SIZE * 3 + 10;
+
+        Telemetry t;
+        for (uint64_t i = 0; i < published; i++)
+        {
+            t.sequence = static_cast<uint32_t>(i + 1);
+            writer->Publish(source, t);
+        }
+        // Only the last ring full is left
+        uint64_t position = published - SHARED_TELEMETRY_RING_SIZE;
+        while (reader->Next(record))
+        {
+            CHECK_EQ(position, record.position)
+            CHECK_EQ(source, record.source)
+            CHECK_EQ(position + 1, record.telemetry.sequence)
+            position++;
+        }
+        CHECK_EQ(published, position)
+        CHECK_EQ(static_cast<uint64_t>(_case.expected), reader->Lost())
+        CHECK_EQ(published, reader->Latest(source).sequence)
+        return 0;
+    }
+    int writer_closed(const test_case &)
+    {
+        SharedTelemetryRecord record;
+        CHECK_EQ(false, reader->WriterClosed())
+        writer.reset();
+        CHECK_EQ(true, reader->WriterClosed())
+        CHECK_EQ(false, reader->Next(record))
+        return 0;
+    }
+
+    std::unique_ptr<SharedTelemetryWriter> writer;
+    std::unique_ptr<SharedTelemetryReader> reader;
+    uint16_t source;
+};
+#endif//ENABLE_UNIT_TESTS